@@ -0,0 +1,202 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_cache.h"
+
+#define CACHE_MAGIC	"FLVCACH3"	// 2: keyframes don't count AVC sequence headers
+					// 3: keyframe_index filled in
+#define CACHE_MAGIC_LEN	7		// without version: older caches get replaced
+#define CACHE_SLOTS	(1 << 18)
+// Give up probing after that, and reuse home slot.
+#define MAX_PROBE	32
+
+struct cache_header
+{
+    char	magic[8];
+    uint32_t	record_size;
+    uint32_t	slots;
+};
+
+struct cache_record
+{
+    uint64_t		dev;
+    uint64_t		ino;
+    uint64_t		size;
+    int64_t		mtime;
+    int64_t		mtime_nsec;
+    struct flv_summary	sum;
+    uint64_t		check;	// 0 = empty slot
+};
+
+static struct cache_header	*cache = 0;
+static struct cache_record	*records = 0;
+
+static uint64_t hash_bytes(const void *buf, int len)
+{
+    const unsigned char *pt = buf;
+    uint64_t h = 0xcbf29ce484222325ULL;	// FNV-1a
+    int i;
+    for (i = 0; i < len; i++)
+	h = (h ^ pt[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Detects records torn by concurrent writers.
+static uint64_t record_check(const struct cache_record *r)
+{
+    return hash_bytes(r, offsetof(struct cache_record, check)) | 1;
+}
+
+static int cache_file(char *path, int size)
+{
+    const char *s = getenv("FLV_CACHE");
+    if (s)
+	return snprintf(path, size, "%s", s) < size;
+    s = getenv("HOME");
+    if (!s)
+	return 0;
+    return snprintf(path, size, "%s/.flv_cache", s) < size;
+}
+
+// New cache, built aside and renamed in place: a cache being used is never
+// truncated under another process' mapping. Returns fd, -1 on failure.
+static int create_cache(const char *path, size_t len)
+{
+    struct cache_header head;
+    char tmp[4096 + 32];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%i", path, (int)getpid());
+    fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+	return -1;
+    // Sparse file, only slots in use take space.
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CACHE_MAGIC, 8);
+    head.record_size = sizeof(struct cache_record);
+    head.slots = CACHE_SLOTS;
+    if (ftruncate(fd, len) ||
+	pwrite(fd, &head, sizeof(head), 0) != sizeof(head) ||
+	rename(tmp, path))
+    {
+	close(fd);
+	unlink(tmp);
+	return -1;
+    }
+    return fd;
+}
+
+int flv_cache_open(void)
+{
+    char path[4096];
+    size_t len = sizeof(struct cache_header) +
+		 (size_t)CACHE_SLOTS * sizeof(struct cache_record);
+    struct cache_header head;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (cache)
+	return 1;
+    if (!cache_file(path, sizeof(path)))
+	return 0;
+    memset(&head, 0, sizeof(head));
+    memset(&st, 0, sizeof(st));
+    fd = open(path, O_RDWR);
+    if (fd == -1 && errno == ENOENT)
+	fd = create_cache(path, len);
+    if (fd == -1)
+	return 0;
+    if (fstat(fd, &st) ||
+	pread(fd, &head, sizeof(head), 0) != sizeof(head) ||
+	memcmp(head.magic, CACHE_MAGIC, 8) ||
+	head.record_size != sizeof(struct cache_record) ||
+	head.slots != CACHE_SLOTS ||
+	st.st_size != len)
+    {
+	close(fd);
+	// Older or damaged cache: start over. Anything else isn't ours.
+	if (st.st_size < sizeof(head) || memcmp(head.magic, CACHE_MAGIC, CACHE_MAGIC_LEN))
+	    return 0;
+	fd = create_cache(path, len);
+	if (fd == -1)
+	    return 0;
+    }
+    map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return 0;
+
+    cache = map;
+    records = (struct cache_record*)(cache + 1);
+    return 1;
+}
+
+static void record_key(const struct stat *st, struct cache_record *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->dev = st->st_dev;
+    r->ino = st->st_ino;
+    r->size = st->st_size;
+    r->mtime = st->st_mtim.tv_sec;
+    r->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+// Slot holding (dev, ino), or a free one. Record may be stale.
+static struct cache_record *find_slot(const struct cache_record *key)
+{
+    uint64_t h = hash_bytes(key, 2 * sizeof(uint64_t));
+    struct cache_record *r;
+    int i;
+
+    for (i = 0; i < MAX_PROBE; i++)
+    {
+	r = &records[(h + i) % CACHE_SLOTS];
+	if (!r->check ||
+	    (r->dev == key->dev && r->ino == key->ino))
+	    return r;
+    }
+    return &records[h % CACHE_SLOTS];
+}
+
+int flv_cache_lookup(int fd, struct flv_summary *sum)
+{
+    struct cache_record key, *r;
+    struct stat st;
+
+    if (!cache || fstat(fd, &st))
+	return 0;
+    record_key(&st, &key);
+    r = find_slot(&key);
+    if (!r->check ||
+	r->dev != key.dev || r->ino != key.ino ||
+	r->size != key.size ||
+	r->mtime != key.mtime || r->mtime_nsec != key.mtime_nsec ||
+	r->check != record_check(r))
+	return 0;
+    memcpy(sum, &r->sum, sizeof(*sum));
+    return 1;
+}
+
+void flv_cache_store(int fd, const struct flv_summary *sum)
+{
+    struct cache_record rec, *r;
+    struct stat st;
+
+    if (!cache || fstat(fd, &st))
+	return;
+    record_key(&st, &rec);
+    memcpy(&rec.sum, sum, sizeof(rec.sum));
+    rec.check = record_check(&rec);
+    r = find_slot(&rec);
+    memcpy(r, &rec, sizeof(rec));
+}
@@ -0,0 +1,41 @@
+#ifndef FLV_CACHE_H
+#define FLV_CACHE_H
+
+#include <stdint.h>
+
+/* Scan results cache.
+ *
+ * One mmap()ed file ($FLV_CACHE, or ~/.flv_cache), fixed-size records,
+ * open addressing on (dev, inode). A record is only valid if size and mtime
+ * still match, so changed files are rescanned automatically.
+ * Everything is optional: if the cache can't be opened tools just parse files.
+ */
+
+#define FLV_SUMMARY_RANGES	8
+#define FLV_SUMMARY_ERRORS	4
+
+// Summary comes from a full scan (tag counts, errors and gaps are known).
+// Otherwise only the overall time range is.
+#define FLV_SUMMARY_FULL	1
+
+struct flv_summary
+{
+    uint32_t	flags;
+    uint32_t	nranges;
+    int32_t	min_times[FLV_SUMMARY_RANGES];
+    int32_t	max_times[FLV_SUMMARY_RANGES];
+    uint32_t	audio_tags;
+    uint32_t	video_tags;
+    uint32_t	meta_tags;
+    uint32_t	keyframes;
+    uint32_t	errors;		// invalid tag runs
+    uint32_t	backward;	// backward timestamps
+    uint64_t	error_offsets[FLV_SUMMARY_ERRORS];	// first ones
+    uint64_t	keyframe_index;	// offset of onMetaData keyframes object, 0 if none
+};
+
+int flv_cache_open(void);
+int flv_cache_lookup(int fd, struct flv_summary *sum);
+void flv_cache_store(int fd, const struct flv_summary *sum);
+
+#endif
@@ -0,0 +1,205 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_ckpt.h"
+
+#define CKPT_MAGIC	"FLVCKPT1"
+#define TAIL_HASH_LEN	4096
+
+struct ckpt_input
+{
+    uint64_t	dev;
+    uint64_t	ino;
+    uint64_t	size;
+    int64_t	mtime;
+};
+
+struct ckpt_header
+{
+    char		magic[8];
+    uint32_t		ninputs;
+    uint32_t		state_len;
+    struct ckpt_input	inputs[FLV_CKPT_INPUTS];
+    uint64_t		in_off;
+    uint64_t		out_off;
+    uint64_t		tail_hash;	// of output bytes before out_off
+    uint64_t		check;		// of everything after header
+};
+
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+    const unsigned char *pt = buf;
+    size_t i;
+    for (i = 0; i < len; i++)
+	h = (h ^ pt[i]) * 0x100000001b3ULL;	// FNV-1a
+    return h;
+}
+
+static int ckpt_file(char *path, int size, const char *out_fname, const char *ext)
+{
+    return snprintf(path, size, "%s.ckpt%s", out_fname, ext) < size;
+}
+
+static int get_inputs(struct ckpt_header *h, const int *in_fds, int nin)
+{
+    struct stat st;
+    int i;
+
+    if (nin > FLV_CKPT_INPUTS)
+	return 0;
+    h->ninputs = nin;
+    for (i = 0; i < nin; i++)
+    {
+	if (fstat(in_fds[i], &st))
+	    return 0;
+	h->inputs[i].dev = st.st_dev;
+	h->inputs[i].ino = st.st_ino;
+	h->inputs[i].size = st.st_size;
+	h->inputs[i].mtime = st.st_mtime;
+    }
+    return 1;
+}
+
+static int tail_hash(int out_fd, uint64_t out_off, uint64_t *hash)
+{
+    unsigned char buf[TAIL_HASH_LEN];
+    size_t len = (out_off < TAIL_HASH_LEN ? out_off : TAIL_HASH_LEN);
+
+    if (pread(out_fd, buf, len, out_off - len) != len)
+	return 0;
+    *hash = hash_bytes(0xcbf29ce484222325ULL, buf, len);
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    while (len)
+    {
+	ssize_t ret = write(fd, buf, len);
+	if (ret == -1)
+	    return 0;
+	buf = (const char*)buf + ret;
+	len -= ret;
+    }
+    return 1;
+}
+
+int flv_ckpt_save(const char *out_fname, int out_fd, const int *in_fds, int nin,
+		  uint64_t in_off, uint64_t out_off, const void *state, uint32_t state_len)
+{
+    char path[4096], tmp[4096];
+    struct ckpt_header h;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, 8);
+    h.state_len = state_len;
+    h.in_off = in_off;
+    h.out_off = out_off;
+    h.check = hash_bytes(0xcbf29ce484222325ULL, state, state_len);
+    if (!get_inputs(&h, in_fds, nin) ||
+	!ckpt_file(path, sizeof(path), out_fname, "") ||
+	!ckpt_file(tmp, sizeof(tmp), out_fname, ".tmp") ||
+	fsync(out_fd) ||			// output first
+	!tail_hash(out_fd, out_off, &h.tail_hash))
+	return 0;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+	return 0;
+    if (!write_all(fd, &h, sizeof(h)) || !write_all(fd, state, state_len) ||
+	fsync(fd) || close(fd) || rename(tmp, path))
+    {
+	perror(tmp);
+	unlink(tmp);
+	return 0;
+    }
+    return 1;
+}
+
+void *flv_ckpt_load(const char *out_fname, int out_fd, const int *in_fds, int nin,
+		    uint64_t *in_off, uint64_t *out_off, uint32_t *state_len)
+{
+    struct ckpt_header h, cur;
+    char path[4096];
+    struct stat st;
+    uint64_t hash;
+    void *state = 0;
+    int fd;
+
+    if (!ckpt_file(path, sizeof(path), out_fname, "") ||
+	(fd = open(path, O_RDONLY)) == -1)
+	return 0;
+    memset(&cur, 0, sizeof(cur));
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, CKPT_MAGIC, 8) ||
+	!get_inputs(&cur, in_fds, nin) || h.ninputs != nin ||
+	memcmp(h.inputs, cur.inputs, sizeof(h.inputs)) ||
+	!(state = malloc(h.state_len + 1)) ||
+	read(fd, state, h.state_len) != h.state_len ||
+	hash_bytes(0xcbf29ce484222325ULL, state, h.state_len) != h.check)
+	goto fail;
+
+    // Output must still have what the checkpoint says was written.
+    if (fstat(out_fd, &st) || st.st_size < h.out_off ||
+	!tail_hash(out_fd, h.out_off, &hash) || hash != h.tail_hash)
+	goto fail;
+
+    close(fd);
+    *in_off = h.in_off;
+    *out_off = h.out_off;
+    *state_len = h.state_len;
+    return state;
+
+  fail:
+    free(state);
+    close(fd);
+    return 0;
+}
+
+static int part_file(char *path, int size, const char *out_fname)
+{
+    return snprintf(path, size, "%s.part", out_fname) < size;
+}
+
+int flv_ckpt_create(const char *out_fname)
+{
+    char path[4096];
+
+    if (!ckpt_file(path, sizeof(path), out_fname, ""))
+	return -1;
+    unlink(path);
+    if (!part_file(path, sizeof(path), out_fname))
+	return -1;
+    return open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+int flv_ckpt_reopen(const char *out_fname)
+{
+    char path[4096];
+
+    if (!part_file(path, sizeof(path), out_fname))
+	return -1;
+    return open(path, O_RDWR);
+}
+
+int flv_ckpt_done(const char *out_fname, int out_fd)
+{
+    char path[4096];
+
+    if (fsync(out_fd) || !part_file(path, sizeof(path), out_fname) ||
+	rename(path, out_fname))
+    {
+	perror(out_fname);
+	return 0;
+    }
+    if (ckpt_file(path, sizeof(path), out_fname, ""))
+	unlink(path);
+    return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef FLV_CKPT_H
+#define FLV_CKPT_H
+
+#include <stdint.h>
+
+/* Checkpoints for long runs: <out>.ckpt next to the output file.
+ *
+ * Saved after the output is fsync()ed, through a temp file and rename(), so
+ * the sidecar always describes output that is on disk. It holds where the
+ * input(s) and output are at, plus whatever state the tool needs to go on.
+ * Inputs are identified by dev, inode, size and mtime; output tail is checked
+ * with a hash of its last bytes before resuming.
+ *
+ * Output is written to <out>.part, and only renamed to <out> by
+ * flv_ckpt_done() once complete: an existing <out> is always complete, a
+ * .part without a usable checkpoint is started over.
+ */
+
+#define FLV_CKPT_INPUTS	2
+#define FLV_CKPT_BYTES	(256 << 20)	// checkpoint every that much output
+
+int flv_ckpt_save(const char *out_fname, int out_fd, const int *in_fds, int nin,
+		  uint64_t in_off, uint64_t out_off, const void *state, uint32_t state_len);
+
+/* Returns state (malloc()ed, free it) if there's a checkpoint for these
+ * inputs and the output checks out, 0 otherwise. */
+void *flv_ckpt_load(const char *out_fname, int out_fd, const int *in_fds, int nin,
+		    uint64_t *in_off, uint64_t *out_off, uint32_t *state_len);
+
+// <out>.part, new (stale checkpoint removed) or existing one. -1 on failure.
+int flv_ckpt_create(const char *out_fname);
+int flv_ckpt_reopen(const char *out_fname);
+// fsync(), rename .part to out, remove checkpoint. 0 on failure.
+int flv_ckpt_done(const char *out_fname, int out_fd);
+
+#endif
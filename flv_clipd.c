@@ -0,0 +1,563 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "flv_index.h"
+#include "flv_plan.h"
+
+#define uchar unsigned char
+
+#define DEFAULT_WORKERS	8
+#define DEFAULT_FILES	64
+#define QUEUE_LEN	256
+#define REQUEST_MAX	4096
+#define CLIENT_TIMEOUT	10	// seconds to send the request, and per write
+#define SOCKET_MODE	0600
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_clipd [-w workers] [-n files] [-m mode]  socket\n");
+    printf("  flv_clipd -c socket  request...\n");
+    printf("\n");
+    printf("  Clip server: keeps the last used files mapped with their tag index\n");
+    printf("  (%i by default) and answers requests on a unix socket with a pool of\n", DEFAULT_FILES);
+    printf("  workers (%i by default). -c sends a request and prints the answer.\n", DEFAULT_WORKERS);
+    printf("  The socket is only for the owner unless -m gives another mode (octal,\n");
+    printf("  e.g. 660): anyone who can connect gets clips of any file we can read.\n");
+    printf("  Clients get %i s to send their request.\n", CLIENT_TIMEOUT);
+    printf("\n");
+    printf("  Requests, one per connection (times are mm:ss:ms):\n");
+    printf("    info file.flv                  tags, time range, size\n");
+    printf("    range begin end file.flv       flv_cut --plan output\n");
+    printf("    prefix begin end file.flv      prefix for range\n");
+    printf("    cut begin end file.flv         whole clip, like flv_cut\n");
+    printf("  Answer is a status line (\"ok\" or \"error ...\") followed by the data.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+
+/**************************************************************************/
+/* Mapped files, LRU */
+
+struct mapped_file
+{
+    char		*path;
+    dev_t		dev;
+    ino_t		ino;
+    off_t		size;
+    struct timespec	mtime;
+    int			fd;
+    const uchar		*beg;
+    struct flv_index	idx;
+
+    int			refs;		// requests using it
+    int			evicted;	// free when last ref is gone
+    unsigned long	last_used;
+};
+
+struct mapped_file	**files = 0;
+int			max_files = DEFAULT_FILES;
+int			nfiles = 0;
+unsigned long		use_clock = 0;
+pthread_mutex_t		files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void free_file(struct mapped_file *f)
+{
+    flv_index_free(&f->idx);
+    if (f->beg)
+	munmap((void*)f->beg, f->size);
+    if (f->fd != -1)
+	close(f->fd);
+    free(f->path);
+    free(f);
+}
+
+struct mapped_file *map_file(const char *path, const struct stat *st)
+{
+    struct mapped_file *f = calloc(1, sizeof(*f));
+    if (!f)
+	return 0;
+    f->fd = open(path, O_RDONLY);
+    f->path = strdup(path);
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->size = st->st_size;
+    f->mtime = st->st_mtim;
+    if (f->fd == -1 || !f->path || !f->size)
+    {
+	free_file(f);
+	return 0;
+    }
+    f->beg = mmap(0, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (f->beg == MAP_FAILED)
+    {
+	f->beg = 0;
+	free_file(f);
+	return 0;
+    }
+    if (!flv_index_open(&f->idx, f->fd, f->beg, f->size))
+    {
+	free_file(f);
+	return 0;
+    }
+    return f;
+}
+
+// Must hold files_lock.
+struct mapped_file *find_file(const char *path, const struct stat *st)
+{
+    int i;
+    for (i = 0; i < nfiles; i++)
+    {
+	struct mapped_file *f = files[i];
+	if (strcmp(f->path, path))
+	    continue;
+	if (f->dev == st->st_dev && f->ino == st->st_ino && f->size == st->st_size &&
+	    f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec)
+	    return f;
+	// file changed: drop it
+	files[i] = files[--nfiles];
+	f->evicted = 1;
+	if (!f->refs)
+	    free_file(f);
+	return 0;
+    }
+    return 0;
+}
+
+// Must hold files_lock. Evicts least recently used idle file if full.
+void insert_file(struct mapped_file *f)
+{
+    int i, lru = -1;
+    if (nfiles == max_files)
+    {
+	for (i = 0; i < nfiles; i++)
+	    if (lru == -1 || files[i]->last_used < files[lru]->last_used)
+		lru = i;
+	files[lru]->evicted = 1;
+	if (!files[lru]->refs)
+	    free_file(files[lru]);
+	files[lru] = files[--nfiles];
+    }
+    files[nfiles++] = f;
+}
+
+struct mapped_file *get_file(const char *path)
+{
+    struct mapped_file *f, *f2;
+    struct stat st;
+
+    if (stat(path, &st))
+	return 0;
+    pthread_mutex_lock(&files_lock);
+    f = find_file(path, &st);
+    if (f)
+    {
+	f->refs++;
+	f->last_used = ++use_clock;
+	pthread_mutex_unlock(&files_lock);
+	return f;
+    }
+    pthread_mutex_unlock(&files_lock);
+
+    // Mapping and indexing happen outside the lock.
+    f = map_file(path, &st);
+    if (!f)
+	return 0;
+
+    pthread_mutex_lock(&files_lock);
+    f2 = find_file(path, &st);
+    if (f2)			// somebody beat us to it
+    {
+	free_file(f);
+	f = f2;
+    }
+    else
+	insert_file(f);
+    f->refs++;
+    f->last_used = ++use_clock;
+    pthread_mutex_unlock(&files_lock);
+    return f;
+}
+
+void put_file(struct mapped_file *f)
+{
+    pthread_mutex_lock(&files_lock);
+    if (!--f->refs && f->evicted)
+	free_file(f);
+    pthread_mutex_unlock(&files_lock);
+}
+
+
+/**************************************************************************/
+/* Requests */
+
+int send_all(int fd, const void *buf, size_t len)
+{
+    while (len)
+    {
+	ssize_t ret = write(fd, buf, len);
+	if (ret == -1 && errno == EINTR)
+	    continue;
+	if (ret <= 0)
+	    return 0;
+	buf = (const uchar*)buf + ret;
+	len -= ret;
+    }
+    return 1;
+}
+
+int send_str(int fd, const char *format, ...)
+{
+    char buf[512];
+    va_list ap;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (len >= sizeof(buf))
+	len = sizeof(buf) - 1;
+    return send_all(fd, buf, len);
+}
+
+int send_range(int sock, int fd, off_t offset, size_t len)
+{
+    while (len)
+    {
+	ssize_t ret = sendfile(sock, fd, &offset, len);
+	if (ret == -1 && errno == EINTR)
+	    continue;
+	if (ret <= 0)
+	    return 0;
+	len -= ret;
+    }
+    return 1;
+}
+
+int parse_time(const char *str, uint32_t *time)
+{
+    int m, s, ms;
+    if (sscanf(str, "%i:%i:%i", &m, &s, &ms) != 3)
+	return 0;
+    *time = ms + s * 1000 + m * 1000 * 60;
+    return 1;
+}
+
+void do_info(int sock, struct mapped_file *f)
+{
+    struct flv_index *idx = &f->idx;
+    uint32_t i, min = UINT32_MAX, max = 0, keyframes = 0;
+
+    for (i = 0; i < idx->ntags; i++)
+    {
+	if (idx->times[i] < min)
+	    min = idx->times[i];
+	if (idx->times[i] > max)
+	    max = idx->times[i];
+	keyframes += ((idx->flags[i] & FLV_TAG_KEY) != 0);
+    }
+    if (!idx->ntags)
+	min = 0;
+    send_str(sock, "ok\ntags %u\nkeyframes %u\ntime %u %u\nsize %llu\nvalid %llu\n",
+	     idx->ntags, keyframes, min, max,
+	     (unsigned long long)f->size, (unsigned long long)idx->end);
+}
+
+void do_plan(int sock, const char *cmd, struct mapped_file *f, uint32_t begin, uint32_t end)
+{
+    struct flv_plan plan;
+    int i;
+
+    if (!flv_plan_make(&f->idx, f->beg, begin, end, &plan))
+    {
+	send_str(sock, "error nothing to cut\n");
+	return;
+    }
+    if (!strcmp(cmd, "range"))
+    {
+	if (send_str(sock, "ok\nprefix %i\n", plan.prefix_len))
+	    for (i = 0; i < plan.nranges; i++)
+		if (!send_str(sock, "range %llu %llu\n",
+			      (unsigned long long)plan.ranges[i].offset,
+			      (unsigned long long)plan.ranges[i].len))
+		    break;
+    }
+    else if (send_str(sock, "ok\n") &&
+	     send_all(sock, plan.prefix, plan.prefix_len) &&
+	     !strcmp(cmd, "cut"))
+    {
+	for (i = 0; i < plan.nranges; i++)
+	    if (!send_range(sock, f->fd, plan.ranges[i].offset, plan.ranges[i].len))
+		break;
+    }
+    flv_plan_free(&plan);
+}
+
+void handle_request(int sock, char *req)
+{
+    char cmd[16], begin_str[32], end_str[32];
+    uint32_t begin = 0, end = 0;
+    struct mapped_file *f;
+    const char *path;
+    int n = 0;
+
+    if (sscanf(req, "%15s %n", cmd, &n) != 1)
+    {
+	send_str(sock, "error empty request\n");
+	return;
+    }
+    path = req + n;
+    if (strcmp(cmd, "info"))
+    {
+	if (strcmp(cmd, "range") && strcmp(cmd, "prefix") && strcmp(cmd, "cut"))
+	{
+	    send_str(sock, "error unknown request %s\n", cmd);
+	    return;
+	}
+	if (sscanf(path, "%31s %31s %n", begin_str, end_str, &n) != 2 ||
+	    !parse_time(begin_str, &begin) || !parse_time(end_str, &end))
+	{
+	    send_str(sock, "error bad time range\n");
+	    return;
+	}
+	path += n;
+    }
+
+    f = get_file(path);
+    if (!f)
+    {
+	send_str(sock, "error %s: %s\n", path, strerror(errno ? errno : EINVAL));
+	return;
+    }
+    if (!strcmp(cmd, "info"))
+	do_info(sock, f);
+    else if (f->idx.end != f->size)
+	send_str(sock, "error invalid tag found, fix file first\n");
+    else
+	do_plan(sock, cmd, f, begin, end);
+    put_file(f);
+}
+
+void serve(int sock)
+{
+    char req[REQUEST_MAX];
+    time_t deadline = time(0) + CLIENT_TIMEOUT;
+    int len = 0;
+
+    // One line. Reads time out (SO_RCVTIMEO), so do slow clients.
+    while (len < REQUEST_MAX - 1 && time(0) < deadline)
+    {
+	ssize_t ret = read(sock, req + len, REQUEST_MAX - 1 - len);
+	if (ret == -1 && errno == EINTR)
+	    continue;
+	if (ret <= 0)
+	    break;
+	len += ret;
+	if (memchr(req + len - ret, '\n', ret))
+	    break;
+    }
+    req[len] = 0;
+    if (strchr(req, '\n'))
+	*strchr(req, '\n') = 0;
+    else
+    {
+	send_str(sock, "error incomplete request\n");
+	return;
+    }
+    errno = 0;
+    handle_request(sock, req);
+}
+
+
+/**************************************************************************/
+/* Worker pool */
+
+int		queue[QUEUE_LEN];
+int		queue_head = 0, queue_len = 0;
+pthread_mutex_t	queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	queue_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t	queue_not_full = PTHREAD_COND_INITIALIZER;
+
+void *worker(void *arg)
+{
+    for (;;)
+    {
+	int sock;
+	pthread_mutex_lock(&queue_lock);
+	while (!queue_len)
+	    pthread_cond_wait(&queue_not_empty, &queue_lock);
+	sock = queue[queue_head];
+	queue_head = (queue_head + 1) % QUEUE_LEN;
+	queue_len--;
+	pthread_cond_signal(&queue_not_full);
+	pthread_mutex_unlock(&queue_lock);
+
+	serve(sock);
+	close(sock);
+    }
+    return 0;
+}
+
+void queue_request(int sock)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == QUEUE_LEN)
+	pthread_cond_wait(&queue_not_full, &queue_lock);
+    queue[(queue_head + queue_len) % QUEUE_LEN] = sock;
+    queue_len++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+int unix_socket(const char *path, struct sockaddr_un *addr)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(sock != -1, "socket: %s\n", strerror(errno));
+    ASSERT(strlen(path) < sizeof(addr->sun_path), "%s: socket path too long\n", path);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return sock;
+}
+
+void run_server(const char *path, int workers, int mode)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { CLIENT_TIMEOUT, 0 };
+    int sock = unix_socket(path, &addr);
+    pthread_t thread;
+    mode_t mask;
+    int i;
+
+    unlink(path);
+    mask = umask(0077);		// no window with the umask's mode
+    ASSERT(!bind(sock, (struct sockaddr*)&addr, sizeof(addr)),
+	   "%s: %s\n", path, strerror(errno));
+    umask(mask);
+    ASSERT(!chmod(path, mode), "%s: %s\n", path, strerror(errno));
+    ASSERT(!listen(sock, 128), "listen: %s\n", strerror(errno));
+
+    files = calloc(max_files, sizeof(*files));
+    ASSERT(files, "Out of memory\n");
+    for (i = 0; i < workers; i++)
+	ASSERT(!pthread_create(&thread, 0, worker, 0), "pthread_create failed\n");
+
+    printf("Listening on %s, %i workers\n", path, workers);
+    fflush(stdout);
+    for (;;)
+    {
+	int client = accept(sock, 0, 0);
+	if (client == -1)
+	{
+	    if (errno != EINTR && errno != ECONNABORTED)
+		perror("accept");
+	    continue;
+	}
+	// Clients that don't send or don't read can't hold a worker forever.
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	queue_request(client);
+    }
+}
+
+
+/**************************************************************************/
+/* Client */
+
+int run_client(const char *path, int ac, char **av)
+{
+    struct sockaddr_un addr;
+    int sock = unix_socket(path, &addr);
+    char buf[65536], req[REQUEST_MAX], file[PATH_MAX];
+    int i, len = 0, status = -1;
+    ssize_t ret;
+
+    // File comes last, server may run in another directory.
+    if (realpath(av[ac - 1], file))
+	av[ac - 1] = file;
+    for (i = 0; i < ac; i++)
+	len += snprintf(req + len, sizeof(req) - len, "%s%s", (i ? " " : ""), av[i]);
+    ASSERT(len < sizeof(req) - 1, "Request too long\n");
+    req[len++] = '\n';
+
+    ASSERT(!connect(sock, (struct sockaddr*)&addr, sizeof(addr)),
+	   "%s: %s\n", path, strerror(errno));
+    ASSERT(send_all(sock, req, len), "write: %s\n", strerror(errno));
+
+    // Status line goes to stderr if it's an error, data to stdout.
+    len = 0;
+    while ((ret = read(sock, buf + len, sizeof(buf) - len)) > 0)
+    {
+	len += ret;
+	if (status == -1)
+	{
+	    char *nl = memchr(buf, '\n', len);
+	    if (!nl)
+		continue;
+	    status = !strncmp(buf, "ok", 2);
+	    if (!status)
+		fwrite(buf, 1, len, stderr);
+	    else
+		fwrite(nl + 1, 1, buf + len - nl - 1, stdout);
+	}
+	else
+	    fwrite(buf, 1, len, status ? stdout : stderr);
+	len = 0;
+    }
+    if (status == -1)
+	fwrite(buf, 1, len, stderr);
+    return (status == 1 ? 0 : 1);
+}
+
+int main(int ac, char **av)
+{
+    int workers = DEFAULT_WORKERS;
+    int mode = SOCKET_MODE;
+
+    signal(SIGPIPE, SIG_IGN);
+    ac--; av++;
+    if (ac >= 3 && !strcmp(av[0], "-c"))
+	return run_client(av[1], ac - 2, av + 2);
+
+    while (ac > 1 && av[0][0] == '-')
+    {
+	if (!strcmp(av[0], "-w"))
+	    workers = atoi(av[1]);
+	else if (!strcmp(av[0], "-n"))
+	    max_files = atoi(av[1]);
+	else if (!strcmp(av[0], "-m"))
+	    mode = strtol(av[1], 0, 8);
+	else
+	    usage();
+	ac -= 2; av += 2;
+    }
+    if (ac != 1 || workers < 1 || max_files < 1 || mode < 0 || mode > 0777)
+	usage();
+
+    run_server(av[0], workers, mode);
+    return 0;
+}
@@ -0,0 +1,343 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "flv_codec.h"
+
+static const int aac_sample_rates[16] =
+{ 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+  16000, 12000, 11025, 8000, 7350, 0, 0, 0 };
+
+
+/* Bit reader for SPS, skips emulation prevention bytes (00 00 03). */
+struct bits
+{
+    const uchar	*pt;
+    const uchar	*end;
+    int		bit;
+    int		zeros;
+};
+
+static int read_bit(struct bits *b)
+{
+    int ret;
+    if (b->pt >= b->end)
+	return 0;
+    ret = (*b->pt >> (7 - b->bit)) & 1;
+    if (++b->bit == 8)
+    {
+	b->bit = 0;
+	b->zeros = (*b->pt ? 0 : b->zeros + 1);
+	b->pt++;
+	if (b->zeros >= 2 && b->pt < b->end && *b->pt == 3)
+	{
+	    b->pt++;
+	    b->zeros = 0;
+	}
+    }
+    return ret;
+}
+
+static unsigned int read_bits(struct bits *b, int n)
+{
+    unsigned int ret = 0;
+    while (n--)
+	ret = (ret << 1) | read_bit(b);
+    return ret;
+}
+
+// Exp-Golomb
+static unsigned int read_ue(struct bits *b)
+{
+    int zeros = 0;
+    while (!read_bit(b) && zeros < 32 && b->pt < b->end)
+	zeros++;
+    if (zeros == 32)		// invalid, can't be represented
+	return ~0u;
+    return (1u << zeros) - 1 + read_bits(b, zeros);
+}
+
+static int read_se(struct bits *b)
+{
+    unsigned int v = read_ue(b);
+    return (v & 1 ? (int)(v + 1) / 2 : -(int)(v / 2));
+}
+
+static void skip_scaling_list(struct bits *b, int size)
+{
+    int i, last = 8, next = 8;
+    for (i = 0; i < size; i++)
+    {
+	if (next)
+	    next = (last + read_se(b) + 256) % 256;
+	last = (next ? next : last);
+    }
+}
+
+// Picture size from SPS (with NAL header byte).
+static void avc_sps_size(const uchar *sps, int len, int *width, int *height)
+{
+    struct bits b = { sps + 1, sps + len, 0, 0 };
+    int profile, chroma = 1, frame_mbs_only;
+    int w, h, crop_l = 0, crop_r = 0, crop_t = 0, crop_b = 0;
+    int i;
+
+    profile = read_bits(&b, 8);
+    read_bits(&b, 16);		// constraints, level
+    read_ue(&b);		// sps id
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 ||
+	profile == 44 || profile == 83 || profile == 86 || profile == 118 ||
+	profile == 128 || profile == 138 || profile == 139 || profile == 134)
+    {
+	chroma = read_ue(&b);
+	if (chroma == 3)
+	    read_bit(&b);	// separate colour planes
+	read_ue(&b);		// bit depth luma
+	read_ue(&b);		// bit depth chroma
+	read_bit(&b);		// transform bypass
+	if (read_bit(&b))	// scaling matrix
+	    for (i = 0; i < (chroma != 3 ? 8 : 12); i++)
+		if (read_bit(&b))
+		    skip_scaling_list(&b, i < 6 ? 16 : 64);
+    }
+    read_ue(&b);		// log2 max frame num
+    i = read_ue(&b);		// poc type
+    if (i == 0)
+	read_ue(&b);
+    else if (i == 1)
+    {
+	int n;
+	read_bit(&b);
+	read_se(&b);
+	read_se(&b);
+	n = read_ue(&b);
+	for (i = 0; i < n && i < 256; i++)
+	    read_se(&b);
+    }
+    read_ue(&b);		// max ref frames
+    read_bit(&b);		// gaps allowed
+    w = read_ue(&b) + 1;
+    h = read_ue(&b) + 1;
+    frame_mbs_only = read_bit(&b);
+    if (!frame_mbs_only)
+	read_bit(&b);		// mb adaptive
+    read_bit(&b);		// direct 8x8
+    if (read_bit(&b))		// cropping
+    {
+	crop_l = read_ue(&b);
+	crop_r = read_ue(&b);
+	crop_t = read_ue(&b);
+	crop_b = read_ue(&b);
+    }
+    // Crop units: 4:2:0 and 4:2:2 are half width chroma, 4:4:4 and mono aren't.
+    *width = w * 16 - (crop_l + crop_r) * (chroma == 1 || chroma == 2 ? 2 : 1);
+    *height = (2 - frame_mbs_only) * h * 16 -
+	      (crop_t + crop_b) * (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+}
+
+int parse_avc_config(const uchar *rec, int len, struct avc_config *avc)
+{
+    const uchar *pt = rec + 6;
+    const uchar *end = rec + len;
+    int i, n;
+
+    memset(avc, 0, sizeof(*avc));
+    if (len < 7 || rec[0] != 1)
+	return 0;
+    avc->record = rec;
+    avc->record_len = len;
+    avc->profile = rec[1];
+    avc->level = rec[3];
+    avc->nal_len_size = (rec[4] & 3) + 1;
+
+    n = rec[5] & 0x1f;
+    for (i = 0; i < n; i++)
+    {
+	int l;
+	if (pt + 2 > end)
+	    return 0;
+	l = (pt[0] << 8) | pt[1];
+	if (pt + 2 + l > end)
+	    return 0;
+	if (avc->nsps < AVC_MAX_PS)
+	{
+	    avc->sps[avc->nsps] = pt + 2;
+	    avc->sps_len[avc->nsps++] = l;
+	}
+	pt += 2 + l;
+    }
+
+    if (pt >= end)
+	return 0;
+    n = *pt++;
+    for (i = 0; i < n; i++)
+    {
+	int l;
+	if (pt + 2 > end)
+	    return 0;
+	l = (pt[0] << 8) | pt[1];
+	if (pt + 2 + l > end)
+	    return 0;
+	if (avc->npps < AVC_MAX_PS)
+	{
+	    avc->pps[avc->npps] = pt + 2;
+	    avc->pps_len[avc->npps++] = l;
+	}
+	pt += 2 + l;
+    }
+
+    if (avc->nsps && avc->sps_len[0] > 4)
+	avc_sps_size(avc->sps[0], avc->sps_len[0], &avc->width, &avc->height);
+    return 1;
+}
+
+int parse_aac_config(const uchar *asc, int len, struct aac_config *aac)
+{
+    memset(aac, 0, sizeof(*aac));
+    if (len < 2)
+	return 0;
+    aac->asc = asc;
+    aac->asc_len = len;
+    aac->object_type = asc[0] >> 3;
+    aac->freq_index = ((asc[0] & 7) << 1) | (asc[1] >> 7);
+    aac->channels = (asc[1] >> 3) & 0xf;
+    if (aac->object_type == 31 || aac->freq_index == 15)
+	return 0;	// escape values, not handled
+    aac->sample_rate = aac_sample_rates[aac->freq_index];
+    return (aac->object_type && aac->sample_rate);
+}
+
+void make_adts_header(const struct aac_config *aac, int frame_len, uchar *hdr)
+{
+    int len = frame_len + ADTS_HEADER_LEN;
+    int profile = (aac->object_type > 4 ? 2 : aac->object_type) - 1;	// HE-AAC: LC core
+
+    hdr[0] = 0xff;
+    hdr[1] = 0xf1;		// MPEG-4, no CRC
+    hdr[2] = (profile << 6) | (aac->freq_index << 2) | ((aac->channels >> 2) & 1);
+    hdr[3] = ((aac->channels & 3) << 6) | ((len >> 11) & 3);
+    hdr[4] = len >> 3;
+    hdr[5] = ((len & 7) << 5) | 0x1f;	// buffer fullness 0x7ff: VBR
+    hdr[6] = 0xfc;
+}
+
+const char *check_avc_sample(int nal_len_size, const uchar *data, int len)
+{
+    const uchar *pt = data;
+    const uchar *end = data + len;
+    int i, type;
+
+    if (!len)
+	return "empty AVC sample";
+    while (pt < end)
+    {
+	uint32_t l = 0;
+	if (pt + nal_len_size > end)
+	    return "truncated NAL unit length";
+	for (i = 0; i < nal_len_size; i++)
+	    l = (l << 8) | pt[i];
+	pt += nal_len_size;
+	if (!l)
+	    return "empty NAL unit";
+	if (l > end - pt)
+	    return "NAL unit length past end of tag";
+	if (*pt & 0x80)
+	    return "NAL forbidden_zero_bit set";
+	type = *pt & 0x1f;
+	if (!type || type > 23)
+	    return "invalid NAL unit type";
+	pt += l;
+    }
+    return 0;
+}
+
+// 6144 bits per channel max, channel config 0 (PCE): up to 8
+const char *check_aac_frame(const struct aac_config *aac, const uchar *data, int len)
+{
+    int channels = (aac->channels ? aac->channels : 8);
+
+    if (!len)
+	return "empty AAC frame";
+    if (len >= 2 && data[0] == 0xff && (data[1] & 0xf0) == 0xf0)
+	return "ADTS header in raw AAC frame";
+    if (len > 768 * channels)
+	return "AAC frame too big";
+    return 0;
+}
+
+static const uchar start_code[4] = { 0, 0, 0, 1 };
+static const uchar aud_nal[2] = { 0x09, 0xf0 };
+
+#define ADD_IOV(p, l)  do {				\
+	if (n == max_iov)				\
+	    return -1;					\
+	iov[n].iov_base = (void*)(p);			\
+	iov[n].iov_len = (l);				\
+	n++;						\
+    } while(0)
+
+int avc_to_annexb(const struct avc_config *avc, const uchar *data, int len,
+		  int key, int aud, struct iovec *iov, int max_iov)
+{
+    const uchar *pt = data;
+    const uchar *end = data + len;
+    int i, n = 0, has_sps = 0;
+
+    // Check NAL lengths first, and look for SPS.
+    while (pt < end)
+    {
+	uint32_t l = 0;
+	if (pt + avc->nal_len_size > end)
+	    return -1;
+	for (i = 0; i < avc->nal_len_size; i++)
+	    l = (l << 8) | pt[i];
+	pt += avc->nal_len_size;
+	if (!l || l > end - pt)
+	    return -1;
+	if ((*pt & 0x1f) == 7)
+	    has_sps = 1;
+	pt += l;
+    }
+
+    if (aud)
+    {
+	ADD_IOV(start_code, 4);
+	ADD_IOV(aud_nal, 2);
+    }
+    if (key && !has_sps)
+    {
+	for (i = 0; i < avc->nsps; i++)
+	{
+	    ADD_IOV(start_code, 4);
+	    ADD_IOV(avc->sps[i], avc->sps_len[i]);
+	}
+	for (i = 0; i < avc->npps; i++)
+	{
+	    ADD_IOV(start_code, 4);
+	    ADD_IOV(avc->pps[i], avc->pps_len[i]);
+	}
+    }
+
+    // Don't trust lengths here either, same checks.
+    for (pt = data; pt < end; )
+    {
+	uint32_t l = 0;
+	if (pt + avc->nal_len_size > end)
+	    return -1;
+	for (i = 0; i < avc->nal_len_size; i++)
+	    l = (l << 8) | pt[i];
+	pt += avc->nal_len_size;
+	if (!l || l > end - pt)
+	    return -1;
+	// skip access unit delimiters already there
+	if (!(aud && (*pt & 0x1f) == 9))
+	{
+	    ADD_IOV(start_code, 4);
+	    ADD_IOV(pt, l);
+	}
+	pt += l;
+    }
+    return n;
+}
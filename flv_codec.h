@@ -0,0 +1,67 @@
+#ifndef FLV_CODEC_H
+#define FLV_CODEC_H
+
+/* Codec configuration records found in sequence header tags:
+ *   AVC: AVCDecoderConfigurationRecord (video tag, codec 7, AVCPacketType 0)
+ *   AAC: AudioSpecificConfig           (audio tag, format 10, AACPacketType 0)
+ */
+
+#include <sys/uio.h>
+
+#ifndef uchar
+#define uchar unsigned char
+#endif
+
+#define FLV_CODEC_AVC	7
+#define FLV_CODEC_AAC	10
+
+#define AVC_MAX_PS	4
+
+struct avc_config
+{
+    const uchar	*record;
+    int		record_len;
+    int		profile;
+    int		level;
+    int		nal_len_size;	// bytes of NAL unit length prefix
+    int		nsps;
+    const uchar	*sps[AVC_MAX_PS];
+    int		sps_len[AVC_MAX_PS];
+    int		npps;
+    const uchar	*pps[AVC_MAX_PS];
+    int		pps_len[AVC_MAX_PS];
+    int		width;		// from first SPS, 0 if unknown
+    int		height;
+};
+
+struct aac_config
+{
+    const uchar	*asc;
+    int		asc_len;
+    int		object_type;
+    int		freq_index;
+    int		sample_rate;
+    int		channels;
+};
+
+int parse_avc_config(const uchar *rec, int len, struct avc_config *avc);
+int parse_aac_config(const uchar *asc, int len, struct aac_config *aac);
+
+/* Raw AAC frame -> ADTS: 7 bytes header for frame_len bytes of raw data. */
+#define ADTS_HEADER_LEN	7
+void make_adts_header(const struct aac_config *aac, int frame_len, uchar *hdr);
+
+/* Payload checks, return 0 if fine, or what's wrong.
+ * AVC sample: NAL unit lengths must add up to len exactly, NAL headers valid.
+ * AAC frame: raw (no ADTS), not bigger than the format allows. */
+const char *check_avc_sample(int nal_len_size, const uchar *data, int len);
+const char *check_aac_frame(const struct aac_config *aac, const uchar *data, int len);
+
+/* AVC sample (length prefixed NAL units) -> Annex B, as iovecs pointing to
+ * start codes and NAL units in data (no copy). SPS / PPS are put in front
+ * of keyframes that don't have them, with an access unit delimiter if aud.
+ * Returns number of iovecs used, -1 if NAL lengths are broken or it doesn't fit. */
+int avc_to_annexb(const struct avc_config *avc, const uchar *data, int len,
+		  int key, int aud, struct iovec *iov, int max_iov);
+
+#endif
@@ -8,8 +8,11 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 
-#define uchar unsigned char
+#include "flv_index.h"
+#include "flv_plan.h"
+#include "flv_parse.h"
 
 #define FLV_TYPE_AUDIO 0x08
 #define FLV_TYPE_VIDEO 0x09
@@ -18,6 +21,9 @@
 //#define DEBUG 1
 
 int		ignore_bad_tags = 0;
+int		plan_only = 0;
+int		keyframes_every = 0;	// --keyframes
+int		keyframes_ms = 40;
 
 void die(char *str)
 {
@@ -28,10 +34,20 @@ void die(char *str)
 void usage(void)
 {
     printf("Usage:\n");
-    printf("  flv_cut [--ignore-bad-tags] [--begin mm:ss:ms] [--end mm:ss:ms]  file.flv out.flv\n");
+    printf("  flv_cut [--ignore-bad-tags] [--plan] [--keyframes n[:ms]] [--begin mm:ss:ms] [--end mm:ss:ms]  file.flv out.flv\n");
     printf("\n");
     printf("  Keep only frames between begin and end. Output written to out.flv\n");
     printf("\n");
+    printf("  --plan: don't copy anything, write header, onMetaData and sequence\n");
+    printf("          headers to out.flv and print the ranges of file.flv that\n");
+    printf("          follow, starting on a keyframe:\n");
+    printf("            prefix <out.flv> <len>\n");
+    printf("            range <offset> <len>\n");
+    printf("\n");
+    printf("  --keyframes n[:ms]: trick play, keep only every nth video keyframe\n");
+    printf("          and sequence headers, audio is dropped. Frames are retimed\n");
+    printf("          ms apart (default 40).\n");
+    printf("\n");
     exit(1);
 }
 
@@ -72,7 +88,7 @@ int file_exists(const char *name)
     return 1;
 }
 
-int get_file_len(int fd)
+long get_file_len(int fd)
 {
     struct stat st;
     if (fstat(fd, &st))
@@ -84,17 +100,6 @@ int get_file_len(int fd)
 }
 
 
-int read_number(const uchar *pt, int bytes)
-{
-    int i, len = 0;
-    for (i = 0; i < bytes; i++)
-    {
-	len = len << 8;	
-	len |= pt[i];
-    }
-    return len;
-}
-
 #ifdef DEBUG
 char time_buf[20];
 char time_buf2[20];
@@ -110,74 +115,10 @@ char* format_time(int time, char *str)
 }
 #endif // DEBUG
 
-const uchar *skip_tag(const uchar *tag_begin, int body_len)
-{
-    return tag_begin + body_len + 15;
-}
-
-int parse_tag(const uchar *pt,
-	      uchar *type, uint *body_len, uint *timestamp, uint *stream_id,
-	      const uchar *beg, int file_len)
-{
-    const uchar const *pt_orig = pt;
-#define OFFSET	(pt_orig - beg)
-    int prev_len = 0;
-
-    // check we're within file boundaries.
-    if (pt - beg + 15 > file_len)
-    {
-	printf("File boundaries exceeded.\n");
-	return 0;
-    }
-    
-    *type = *pt++;
-    if (! (*type == FLV_TYPE_AUDIO ||
-	   *type == FLV_TYPE_VIDEO ||
-	   *type == FLV_TYPE_META))
-    {
-	if (!ignore_bad_tags)
-	    printf("Invalid tag type %#02x at offset %i\n", *type, OFFSET);
-	return 0;
-    }
-    
-    *body_len = read_number(pt, 3);
-    pt += 3;
-
-    // Timestamp in milliseconds
-    *timestamp = read_number(pt, 3);
-    pt += 3;    
-
-    *stream_id = read_number(pt, 4);
-    pt += 4;
-    
-    //printf("%08i: Found TAG type %#04x, len %5i, time %7i, stream_id %i\n",
-    // OFFSET, *type, *body_len, *timestamp, *stream_id);
-
-    /* Check end tag len */
-    pt = skip_tag(pt_orig, *body_len);
-    
-    pt -= 4;
-    // check we're within file boundaries.
-    if (pt - beg + 4 > file_len)
-    {
-	printf("File boundaries exceeded.\n");
-	return 0;
-    }
-    prev_len = read_number(pt, 4);
-    if (prev_len + 4 != *body_len + 15)
-    {
-	if (!ignore_bad_tags)
-	    printf("*** Warning: Invalid tag, end of tag length mismatch (%i != %i)\n",
-		   prev_len + 4, *body_len + 15);
-	return 0;
-    }
-    return 1;
-}
-
 uchar		*head_beg = 0;
 const char	*head_fname = 0;
 int		head_fd = 0;
-int		head_len = 0;
+long		head_len = 0;
 
 const char	*out_fname = 0;
 int		out_fd = 0;
@@ -187,10 +128,10 @@ uint		time_begin = 0;
 
 ssize_t my_write(int fd, const void *buf, size_t count)
 {
-    int total = 0;
+    size_t total = 0;
     while (total != count)
     {
-	int ret = write(fd, buf, count);
+	ssize_t ret = write(fd, (const uchar*)buf + total, count - total);
 	if (ret == -1)
 	{
 	    perror(out_fname);
@@ -202,13 +143,53 @@ ssize_t my_write(int fd, const void *buf, size_t count)
 }
 
 
+// Slow path: walk the tags. Kept tags next to each other go out in one write.
+const uchar	*pending = 0;
+size_t		pending_len = 0;
+
+void flush_pending()
+{
+    if (pending_len)
+	my_write(out_fd, pending, pending_len);
+    pending_len = 0;
+}
+
+int cut_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+#ifdef DEBUG
+    printf("%08li: Found TAG type %#04x, len %5i, time %s, stream_id %i\n",
+	   (long)(pt - p->beg), tag->type, tag->len, format_time(tag->timestamp, time_buf),
+	   tag->stream_id);
+#endif
+    if (tag->timestamp > time_end)
+	return 0;
+    if (tag->timestamp < time_begin)
+	return 1;
+    if (pending + pending_len != pt)
+    {
+	flush_pending();
+	pending = pt;
+    }
+    pending_len += tag->len + 15;
+    return 1;
+}
+
+void cut_tags_strict(struct flv_parse *p, long offset)
+{
+    flv_parse_loop(p, offset, FLV_PARSE_STRICT | FLV_PARSE_VERBOSE, cut_tag, 0);
+}
+
+void cut_tags_tolerant(struct flv_parse *p, long offset)
+{
+    flv_parse_loop(p, offset, FLV_PARSE_TOLERANT, cut_tag, 0);
+}
+
 void parse_tags()
 {
     const uchar const *beg = head_beg;
     const uchar *pt = beg;
-    const uchar *next_pt = 0;
-    uchar type;
-    uint len, timestamp, stream_id;
+    struct flv_index idx;
+    struct flv_parse p;
 
     /* Checking head */
     if (!strncmp((char*)pt, "FLV", 3))
@@ -222,37 +203,206 @@ void parse_tags()
     if (*pt != FLV_TYPE_META)
 	printf("Warning: Non metadata tag (%#02x) at offset 13\n", *pt);    
 
-    while (pt - beg < head_len)
+    /* Clean file with ordered timestamps: cut is one contiguous block.
+     * Only with a persisted index, building one reads the whole file and
+     * the loop below stops at time_end. */
+    if (flv_index_load(&idx, head_fd, head_len))
     {
-	if (!parse_tag(pt, &type, &len, &timestamp, &stream_id, beg, head_len))
+	if (idx.sorted && idx.end == head_len)
 	{
-	    if (!ignore_bad_tags)
-		die("invalid tag found, aborting. Fix file first.\n");
-	    pt++;
-	    continue;
+	    uint first = flv_index_seek(&idx, time_begin);
+	    uint last = (time_end == 0xffffffff ? idx.ntags :
+			 flv_index_seek(&idx, time_end + 1));
+	    uint64_t from = (first < idx.ntags ? idx.offsets[first] : idx.end);
+	    uint64_t to = (last < idx.ntags ? idx.offsets[last] : idx.end);
+	    if (to > from)
+		my_write(out_fd, beg + from, to - from);
+	    flv_index_free(&idx);
+	    return;
 	}
-	
-	// TODO: parse metadata tag
-	
-//	printf("TAG type %#02x, len %i\n", type, len);
-	ASSERT(*pt == FLV_TYPE_AUDIO ||
-	       *pt == FLV_TYPE_VIDEO ||
-	       *pt == FLV_TYPE_META,
-	       "Unknown tag ... corrupted file ?\n");
-
-#ifdef DEBUG	
-	printf("%08i: Found TAG type %#04x, len %5i, time %s, stream_id %i\n",
-	       pt - beg, type, len, format_time(timestamp, time_buf), stream_id);
-#endif
-	
-	if (timestamp > time_end)
+	flv_index_free(&idx);
+    }
+
+    flv_parse_init(&p, beg, head_len, 0);
+    if (ignore_bad_tags)
+	cut_tags_tolerant(&p, pt - beg);
+    else
+	cut_tags_strict(&p, pt - beg);
+    flush_pending();
+    if (p.bad)
+	die("invalid tag found, aborting. Fix file first.\n");
+}
+
+void make_plan()
+{
+    struct flv_index idx;
+    struct flv_plan plan;
+    int i;
+
+    ASSERT(flv_index_open(&idx, head_fd, head_beg, head_len),
+	   "file %s: invalid FLV header\n", head_fname);
+    ASSERT(idx.end == head_len, "invalid tag found, aborting. Fix file first.\n");
+    ASSERT(flv_plan_make(&idx, head_beg, time_begin, time_end, &plan),
+	   "Nothing to cut.\n");
+
+    my_write(out_fd, plan.prefix, plan.prefix_len);
+    printf("prefix %s %i\n", out_fname, plan.prefix_len);
+    for (i = 0; i < plan.nranges; i++)
+	printf("range %llu %llu\n", (unsigned long long)plan.ranges[i].offset,
+	       (unsigned long long)plan.ranges[i].len);
+    flv_plan_free(&plan);
+    flv_index_free(&idx);
+}
+
+/**************************************************************************/
+/* Trick play */
+
+#define BATCH_TAGS 512
+
+struct iovec	batch_iov[BATCH_TAGS * 2];
+uchar		batch_hdr[BATCH_TAGS][11];
+int		batch_len = 0;
+
+void flush_batch()
+{
+    struct iovec *iov = batch_iov;
+    int n = batch_len * 2;
+
+    while (n)
+    {
+	ssize_t ret = writev(out_fd, iov, n);
+	if (ret == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	for (; n && ret >= iov->iov_len; iov++, n--)
+	    ret -= iov->iov_len;
+	if (n)		// partial write
+	{
+	    iov->iov_base = (uchar*)iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
+    }
+    batch_len = 0;
+}
+
+// Tag with new timestamp: header copy + rest of the tag from the mapping.
+void batch_tag(const uchar *tag, int body_len, uint time)
+{
+    uchar *hdr = batch_hdr[batch_len];
+
+    memcpy(hdr, tag, 11);
+    hdr[4] = time >> 16;
+    hdr[5] = time >> 8;
+    hdr[6] = time;
+    hdr[7] = time >> 24;
+    batch_iov[batch_len * 2].iov_base = hdr;
+    batch_iov[batch_len * 2].iov_len = 11;
+    batch_iov[batch_len * 2 + 1].iov_base = (void*)(tag + 11);
+    batch_iov[batch_len * 2 + 1].iov_len = body_len + 4;
+    if (++batch_len == BATCH_TAGS)
+	flush_batch();
+}
+
+uint		keyframes_seen = 0, keyframes_kept = 0;
+const uchar	*config = 0;		// last AVC sequence header
+int		config_len = 0;
+
+// Returns 0 past time_end, once there's nothing left to keep.
+int keyframe_tag(const uchar *pt, int len, uint time, int flags, int sorted)
+{
+    if (FLV_TAG_TYPE(flags) != FLV_TAG_VIDEO)
+	return 1;
+    if (flags & FLV_TAG_CONFIG)	// last one before a kept frame
+    {
+	config = pt;
+	config_len = len;
+	return 1;
+    }
+    if (!(flags & FLV_TAG_KEY) || time < time_begin)
+	return 1;
+    if (time > time_end)
+	return !sorted;
+    if (keyframes_seen++ % keyframes_every)
+	return 1;
+
+    if (config)
+    {
+	batch_tag(config, config_len, keyframes_kept * keyframes_ms);
+	config = 0;
+    }
+    batch_tag(pt, len, keyframes_kept * keyframes_ms);
+    keyframes_kept++;
+    return 1;
+}
+
+int cut_keyframe(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    return keyframe_tag(pt, tag->len, tag->timestamp | (pt[7] << 24),
+			flv_tag_flags(pt, tag->len), 1);
+}
+
+void cut_keyframes_strict(struct flv_parse *p, long offset)
+{
+    flv_parse_loop(p, offset, FLV_PARSE_STRICT | FLV_PARSE_VERBOSE, cut_keyframe, 0);
+}
+
+void cut_keyframes_tolerant(struct flv_parse *p, long offset)
+{
+    flv_parse_loop(p, offset, FLV_PARSE_TOLERANT, cut_keyframe, 0);
+}
+
+// Persisted index of a clean file, 0 if there's none.
+int index_keyframes()
+{
+    struct flv_index idx;
+    uint i;
+
+    if (!flv_index_load(&idx, head_fd, head_len))
+	return 0;
+    if (idx.end != head_len)
+    {
+	flv_index_free(&idx);
+	return 0;
+    }
+    for (i = 0; i < idx.ntags; i++)
+	if (!keyframe_tag(head_beg + idx.offsets[i], idx.sizes[i], idx.times[i],
+			  idx.flags[i], idx.sorted))
 	    break;
-	
-	next_pt = skip_tag(pt, len);
-	if (timestamp >= time_begin)
-	    my_write(out_fd, pt, next_pt - pt);
-	pt = next_pt;
+    flv_index_free(&idx);
+    return 1;
+}
+
+// One sequential pass: persisted index if there's one, tags otherwise.
+void cut_keyframes()
+{
+    struct flv_parse p;
+    uchar header[13];
+
+    ASSERT(head_len >= 13 && !strncmp((char*)head_beg, "FLV", 3),
+	   "file %s: invalid FLV header\n", head_fname);
+    madvise(head_beg, head_len, MADV_SEQUENTIAL);
+
+    memcpy(header, head_beg, 13);
+    header[4] = 0x01;		// video only
+    my_write(out_fd, header, 13);
+
+    if (!index_keyframes())
+    {
+	flv_parse_init(&p, head_beg, head_len, 0);
+	if (ignore_bad_tags)
+	    cut_keyframes_tolerant(&p, 13);
+	else
+	    cut_keyframes_strict(&p, 13);
+	if (p.bad)
+	{
+	    flush_batch();
+	    die("invalid tag found, aborting. Fix file first.\n");
+	}
     }
+    flush_batch();
+    printf("%u keyframes kept\n", keyframes_kept);
 }
 
 uint parse_time(const char *str)
@@ -274,6 +424,21 @@ int main(int ac, char **av)
 	ac--; av++;
 	ignore_bad_tags = 1;
     }
+
+    if (!strcmp(av[0], "--plan"))
+    {
+	ac--; av++;
+	plan_only = 1;
+    }
+
+    if (!strcmp(av[0], "--keyframes"))
+    {
+	ac--; av++;
+	ASSERT(ac && sscanf(av[0], "%i:%i", &keyframes_every, &keyframes_ms) >= 1 &&
+	       keyframes_every > 0 && keyframes_ms > 0,
+	       "--keyframes: n[:ms] expected\n");
+	ac--; av++;
+    }
     
     if (!strcmp(av[0], "--begin"))
     {
@@ -305,7 +470,12 @@ int main(int ac, char **av)
     
     head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
 
-    parse_tags();
+    if (plan_only)
+	make_plan();
+    else if (keyframes_every)
+	cut_keyframes();
+    else
+	parse_tags();
 
     close(out_fd);    
     
@@ -7,12 +7,18 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <math.h>
+#include <pthread.h>
 
+#include "flv_cache.h"
+#include "flv_map.h"
+#include "flv_follow.h"
+#include "flv_scan.h"
+#include "flv_codec.h"
+#include "flv_parse.h"
 
-#define uchar unsigned char
 
-#define PARSE_BROKEN_FILE 1
-//#undef PARSE_BROKEN_FILE
+#define uchar unsigned char
 
 #define FLV_TYPE_AUDIO 0x08
 #define FLV_TYPE_VIDEO 0x09
@@ -24,14 +30,42 @@ void die(char *str)
     exit(1);
 }
 
+int		summary_only = 0;
+int		timing_stats = 0;
+int		bitrate_bucket = 0;	// ms, 0 = no bitrate profile
+int		bitrate_window = 10000;
+const char	*csv_fname = 0;
+int		deep_check = 0;
+int		strict = 0;		// stop at first invalid tag
+int		check_threads = 0;	// 0: one per cpu
+int		follow = 0;
+
 void usage(void)
 {
     printf("Usage:\n");
-    printf("  flv_debug  file.flv\n");
+    printf("  flv_debug  [-s] [--strict] [--stats] [-b bucket_ms [-w window_ms] [--csv out.csv]] [-d [-j threads]] [--follow] file.flv|pack.flvpack:name\n");
     printf("\n");
     printf("  Parse file and show flv tags found.\n");
     printf("  Handles files that are partly broken, so useful to see what's going on with these.\n");
     printf("  See flv_fix to fix them.\n");
+    printf("\n");
+    printf("  -s  only show summary (tag counts, time ranges, errors).\n");
+    printf("      Results are kept in the scan cache ($FLV_CACHE or ~/.flv_cache).\n");
+    printf("  --strict  stop at the first invalid tag instead of looking for the next one.\n");
+    printf("  --stats  summary plus per-stream timing statistics: frame interval\n");
+    printf("           histogram and jitter, keyframe interval, A/V drift,\n");
+    printf("           longest audio-only / video-only runs.\n");
+    printf("  -b       summary plus bitrate profile: audio / video / meta bytes\n");
+    printf("           per bucket_ms, average and peak bitrate over a sliding window\n");
+    printf("           of window_ms (default %i).\n", bitrate_window);
+    printf("           --csv writes the whole profile (bits/s per bucket) to out.csv\n");
+    printf("  -d       deep check: NAL units in AVC tags (lengths add up, valid\n");
+    printf("           types), AAC frames sanity. Runs on -j threads (default one\n");
+    printf("           per cpu).\n");
+    printf("  --follow keep going as the file grows (recording in progress), only\n");
+    printf("           parsing what's new, until the writer closes it, it's truncated\n");
+    printf("           or nothing is written for %i s. With -s, shows duration,\n", FLV_FOLLOW_IDLE);
+    printf("           bitrate and gaps so far after each update.\n");
     exit(1);
 }
 
@@ -40,41 +74,6 @@ void usage(void)
 	{ printf(format, ##args); /*exit(1);*/ }	\
     } while(0)
 
-int my_open(const char *fname, int flags, mode_t mode)
-{
-    int ret = open(fname, flags, mode);
-    if (ret == -1)
-	{
-	    perror(fname);
-	    exit(1);
-	}
-    return ret;
-}
-
-void *my_mmap(void *addr, size_t length, int prot, int flags,
-	      int fd, off_t offset)
-{
-    void *ret = mmap(addr, length, prot, flags, fd, offset);
-    if (ret == MAP_FAILED)
-	{
-	    perror("mmap: ");
-	    exit(1);
-	}
-    return ret;    
-}
-
-int get_file_len(int fd)
-{
-    struct stat st;
-    if (fstat(fd, &st))
-    {
-	perror("fstat: ");
-	exit(1);
-    }
-    return st.st_size;
-}
-
-
 int read_number(const uchar *pt, int bytes)
 {
     int i, len = 0;
@@ -99,81 +98,721 @@ char* format_time(int time, char *str)
     return str;
 }
 
-const uchar *skip_tag(const uchar *tag_begin, int body_len)
+uchar		*head_beg = 0;
+const char	*head_fname = 0;
+int		head_fd = 0;
+long		head_len = 0;
+struct flv_map	head_map;
+
+#define MAX_RANGES 256
+
+int min_times[MAX_RANGES] = {0,};
+int max_times[MAX_RANGES] = {0,};
+
+struct flv_summary summary;
+
+void show_summary(const struct flv_summary *sum)
 {
-    return tag_begin + body_len + 15;
+    int i;
+
+    printf("Tags: audio %u, video %u (%u keyframes), meta %u\n",
+	   sum->audio_tags, sum->video_tags, sum->keyframes, sum->meta_tags);
+    printf("Time range: ");
+    for (i = 0; i < sum->nranges; i++)
+	printf("[%s, %s] ",
+	       format_time(sum->min_times[i], time_buf),
+	       format_time(sum->max_times[i], time_buf2));
+    printf("\n");
+    printf("Errors: %u invalid, %u backward timestamps\n",
+	   sum->errors, sum->backward);
+    if (sum->keyframe_index)
+	printf("Keyframe index: in onMetaData, offset %llu\n",
+	       (unsigned long long)sum->keyframe_index);
+    else
+	printf("Keyframe index: none (flv_setmeta adds one)\n");
+    for (i = 0; i < sum->errors && i < FLV_SUMMARY_ERRORS; i++)
+	printf("  invalid tag at offset %llu\n",
+	       (unsigned long long)sum->error_offsets[i]);
 }
 
-int parse_tag(const uchar *pt,
-	      uchar *type, int *body_len, int *timestamp, int *stream_id,
-	      const uchar *beg, int file_len)
+/* Timing statistics (--stats) */
+
+#define HIST_BUCKETS	10
+// Upper bounds of frame interval histogram buckets (ms), last one is open.
+int hist_bounds[HIST_BUCKETS - 1] = { 0, 10, 20, 30, 40, 50, 75, 100, 500 };
+
+// A/V drift min / max is kept for each period (ms)
+#define DRIFT_PERIOD	60000
+
+struct stream_stats
 {
-    const uchar const *pt_orig = pt;
-    // FIXME: should check we're within the file boundaries
-#define OFFSET	(pt_orig - beg)
-    int prev_len = 0;
-    
-    *type = *pt++;
-    if (! (*type == FLV_TYPE_AUDIO ||
-	   *type == FLV_TYPE_VIDEO ||
-	   *type == FLV_TYPE_META))
+    int		tags;
+    int		last_time;
+    int		intervals;
+    double	interval_sum;
+    double	interval_sq_sum;
+    int		min_interval;
+    int		max_interval;
+    int		hist[HIST_BUCKETS];
+    int		run;		// bytes since other stream's last tag
+    int		max_run;
+    long	max_run_offset;
+};
+
+struct stream_stats	audio_stats, video_stats;
+
+int		keyframes = 0;
+int		last_keyframe = -1;
+int		min_kf_interval = 0, max_kf_interval = 0;
+double		kf_interval_sum = 0;
+
+struct drift_period
+{
+    int		min, max;
+};
+
+int		drift_min = 0, drift_max = 0;
+struct drift_period	*drift_periods = 0;
+int		ndrift = 0, max_drift = 0;
+int		next_drift = 0;
+
+void update_stream_stats(struct stream_stats *st, struct stream_stats *other,
+			 int timestamp, int tag_len, long offset)
+{
+    int d = timestamp - st->last_time;
+    int i;
+
+    if (st->tags++)
     {
-	printf("Invalid tag type %#02x at offset %i\n", *type, OFFSET);
+	if (!st->intervals++ || d < st->min_interval)
+	    st->min_interval = d;
+	if (st->intervals == 1 || d > st->max_interval)
+	    st->max_interval = d;
+	st->interval_sum += d;
+	st->interval_sq_sum += (double)d * d;
+	for (i = 0; i < HIST_BUCKETS - 1 && d > hist_bounds[i]; i++)
+	    ;
+	st->hist[i]++;
+    }
+    st->last_time = timestamp;
+
+    // interleaving
+    if (!st->run)
+	st->max_run_offset = offset;
+    st->run += tag_len;
+    if (st->run > st->max_run)
+	st->max_run = st->run;
+    other->run = 0;
+}
+
+// AVC / AAC sequence header
+int is_config_tag(const uchar *pt, uchar type, int len)
+{
+    if (len < 2)
 	return 0;
+    if (type == FLV_TYPE_VIDEO)
+	return ((pt[11] & 0xf) == 7 && pt[12] == 0);
+    if (type == FLV_TYPE_AUDIO)
+	return ((pt[11] >> 4) == 10 && pt[12] == 0);
+    return 0;
+}
+
+void update_stats(const uchar *pt, uchar type, int len, int timestamp, long offset)
+{
+    int drift;
+
+    if (is_config_tag(pt, type, len))
+	return;
+
+    if (type == FLV_TYPE_AUDIO)
+	update_stream_stats(&audio_stats, &video_stats, timestamp, len + 15, offset);
+    if (type == FLV_TYPE_VIDEO)
+    {
+	update_stream_stats(&video_stats, &audio_stats, timestamp, len + 15, offset);
+	if (len && (pt[11] >> 4) == 1)
+	{
+	    if (keyframes++)
+	    {
+		int d = timestamp - last_keyframe;
+		if (keyframes == 2 || d < min_kf_interval)
+		    min_kf_interval = d;
+		if (keyframes == 2 || d > max_kf_interval)
+		    max_kf_interval = d;
+		kf_interval_sum += d;
+	    }
+	    last_keyframe = timestamp;
+	}
     }
-    
-    *body_len = read_number(pt, 3);
-    pt += 3;
 
-    // Timestamp in milliseconds
-    *timestamp = read_number(pt, 3);
-    pt += 3;    
+    if (!audio_stats.tags || !video_stats.tags)
+	return;
+    drift = audio_stats.last_time - video_stats.last_time;
+    if (drift < drift_min)
+	drift_min = drift;
+    if (drift > drift_max)
+	drift_max = drift;
+    if (timestamp >= next_drift)
+    {
+	if (ndrift == max_drift)
+	{
+	    max_drift = (max_drift ? max_drift * 2 : 64);
+	    drift_periods = realloc(drift_periods, max_drift * sizeof(*drift_periods));
+	    if (!drift_periods)
+		die("out of memory\n");
+	}
+	drift_periods[ndrift].min = drift_periods[ndrift].max = drift;
+	ndrift++;
+	next_drift = timestamp + DRIFT_PERIOD;
+    }
+    if (drift < drift_periods[ndrift - 1].min)
+	drift_periods[ndrift - 1].min = drift;
+    if (drift > drift_periods[ndrift - 1].max)
+	drift_periods[ndrift - 1].max = drift;
+}
 
-    *stream_id = read_number(pt, 4);
-    pt += 4;
-    
-//    printf("%08i: Found TAG type %#04x, len %5i, time %s, stream_id %i\n",
-//	   OFFSET, *type, *body_len, format_time(timestamp, time_buf), *stream_id);
+void show_stream_stats(const char *name, const struct stream_stats *st)
+{
+    double mean, var;
+    int i;
 
-    /* Check end tag len */
-    pt = skip_tag(pt_orig, *body_len);
-    
-    pt -= 4;
-    // check we're within file boundaries.
-    if (pt - beg + 4 > file_len)
+    if (!st->intervals)
     {
-	printf("File boundaries exceeded.\n");
-	return 0;
-    }    
-    prev_len = read_number(pt, 4);
-    if (prev_len + 4 != *body_len + 15)
+	printf("%s: %i tags\n", name, st->tags);
+	return;
+    }
+    mean = st->interval_sum / st->intervals;
+    var = st->interval_sq_sum / st->intervals - mean * mean;
+    printf("%s: %i tags, interval min %i avg %.1f max %i ms, jitter %.1f ms\n",
+	   name, st->tags, st->min_interval, mean, st->max_interval,
+	   (var > 0 ? sqrt(var) : 0));
+    printf("  intervals:");
+    for (i = 0; i < HIST_BUCKETS; i++)
+	if (i < HIST_BUCKETS - 1)
+	    printf(" <=%i:%i", hist_bounds[i], st->hist[i]);
+	else
+	    printf(" >%i:%i", hist_bounds[i - 1], st->hist[i]);
+    printf("\n");
+    printf("  longest run without the other stream: %i bytes (at offset %li)\n",
+	   st->max_run, st->max_run_offset);
+}
+
+void show_stats()
+{
+    int i;
+
+    show_stream_stats("Audio", &audio_stats);
+    show_stream_stats("Video", &video_stats);
+    if (keyframes > 1)
+	printf("Keyframe interval: min %i avg %.0f max %i ms\n",
+	       min_kf_interval, kf_interval_sum / (keyframes - 1), max_kf_interval);
+    if (!audio_stats.tags || !video_stats.tags)
+	return;
+    printf("A/V drift: min %i max %i final %i ms\n",
+	   drift_min, drift_max, audio_stats.last_time - video_stats.last_time);
+    printf("  per %is (min/max):", DRIFT_PERIOD / 1000);
+    for (i = 0; i < ndrift; i++)
+	printf("%s %i/%i", (i && !(i % 10) ? "\n   " : ""),
+	       drift_periods[i].min, drift_periods[i].max);
+    printf("\n");
+}
+
+/* Bitrate profile (-b): bytes per bucket for each stream type,
+ * indexed by (timestamp - first timestamp) / bucket. */
+
+struct bucket
+{
+    unsigned int	bytes[3];	// audio, video, meta
+};
+
+struct bucket	*buckets = 0;
+int		nbuckets = 0;
+int		max_bucket = -1;
+int		bucket_start = -1;
+
+void update_bitrate(uchar type, int tag_len, int timestamp)
+{
+    int i;
+
+    if (bucket_start == -1)
+	bucket_start = timestamp;
+    if (timestamp < bucket_start)
+	return;
+    i = (timestamp - bucket_start) / bitrate_bucket;
+    if (i < 0)
+	return;
+    if (i >= nbuckets)
+    {
+	long n = (nbuckets ? nbuckets : 1024);
+	while (n <= i)
+	    n *= 2;
+	buckets = realloc(buckets, n * sizeof(*buckets));
+	if (!buckets)
+	    die("out of memory\n");
+	memset(buckets + nbuckets, 0, (n - nbuckets) * sizeof(*buckets));
+	nbuckets = n;
+    }
+    if (i > max_bucket)
+	max_bucket = i;
+    buckets[i].bytes[(type == FLV_TYPE_AUDIO ? 0 :
+		      type == FLV_TYPE_VIDEO ? 1 : 2)] += tag_len;
+}
+
+unsigned int bucket_total(int i)
+{
+    return buckets[i].bytes[0] + buckets[i].bytes[1] + buckets[i].bytes[2];
+}
+
+// bytes over ms -> kbit/s
+double kbps(double bytes, int ms)
+{
+    return bytes * 8 / ms;
+}
+
+void show_bitrate()
+{
+    int n = max_bucket + 1;
+    int window = bitrate_window / bitrate_bucket;
+    int i, peak_i = 0, peak_bucket_i = 0;
+    double sum = 0, window_sum = 0, peak = 0;
+    FILE *csv;
+
+    if (!n)
+	return;
+    if (window < 1)
+	window = 1;
+    if (window > n)
+	window = n;
+    for (i = 0; i < n; i++)
+    {
+	sum += bucket_total(i);
+	window_sum += bucket_total(i);
+	if (i >= window)
+	    window_sum -= bucket_total(i - window);
+	if (i >= window - 1 && window_sum > peak)
+	{
+	    peak = window_sum;
+	    peak_i = i - window + 1;
+	}
+	if (bucket_total(i) > bucket_total(peak_bucket_i))
+	    peak_bucket_i = i;
+    }
+
+    printf("Bitrate: avg %.0f kbit/s, peak %.0f kbit/s over %i ms at %s, "
+	   "peak %.0f kbit/s over %i ms at %s\n",
+	   kbps(sum, n * bitrate_bucket),
+	   kbps(peak, window * bitrate_bucket), window * bitrate_bucket,
+	   format_time(bucket_start + peak_i * bitrate_bucket, time_buf),
+	   kbps(bucket_total(peak_bucket_i), bitrate_bucket), bitrate_bucket,
+	   format_time(bucket_start + peak_bucket_i * bitrate_bucket, time_buf2));
+
+    if (!csv_fname)
+	return;
+    csv = fopen(csv_fname, "w");
+    if (!csv)
+    {
+	perror(csv_fname);
+	exit(1);
+    }
+    fprintf(csv, "time_ms,audio_bps,video_bps,meta_bps,total_bps\n");
+    for (i = 0; i < n; i++)
+	fprintf(csv, "%i,%.0f,%.0f,%.0f,%.0f\n",
+		bucket_start + i * bitrate_bucket,
+		kbps(buckets[i].bytes[0], bitrate_bucket) * 1000,
+		kbps(buckets[i].bytes[1], bitrate_bucket) * 1000,
+		kbps(buckets[i].bytes[2], bitrate_bucket) * 1000,
+		kbps(bucket_total(i), bitrate_bucket) * 1000);
+    fclose(csv);
+}
+
+
+/**************************************************************************/
+/* Deep check: tag bodies are checked on worker threads, in batches. */
+
+#define CHECK_BATCH	256
+#define CHECK_QUEUE	64
+#define CHECK_SHOW	100	// errors shown
+
+struct check_job
+{
+    int		n;
+    long	offsets[CHECK_BATCH];
+    int		param[CHECK_BATCH];	// AVC: NAL length size, AAC: channels + 1
+};
+
+struct check_error
+{
+    long	offset;
+    const char	*msg;
+};
+
+struct check_job	*check_queue[CHECK_QUEUE];
+int			queue_head = 0, queue_len = 0, queue_done = 0;
+pthread_mutex_t		check_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t		queue_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t		queue_not_full = PTHREAD_COND_INITIALIZER;
+pthread_t		*workers;
+
+struct check_error	*check_errors = 0;
+int			nerrors = 0, max_errors = 0;
+
+struct check_job	*cur_job = 0;
+int			nal_len_size = 0;	// from last AVC config, 0 if none
+int			aac_channels = 0;	// from last AAC config + 1, 0 if none
+
+const char *check_tag(const uchar *pt, int param)
+{
+    int len = read_number(pt + 1, 3);
+    const uchar *body = pt + 11;
+    struct avc_config avc;
+    struct aac_config aac;
+
+    if (*pt == FLV_TYPE_VIDEO && len && (body[0] & 0xf) == 7)
+    {
+	if (len < 5)
+	    return "truncated AVC tag";
+	switch (body[1])
+	{
+	    case 0:
+		return (parse_avc_config(body + 5, len - 5, &avc) ? 0 : "invalid AVC config");
+	    case 1:
+		if (!param)
+		    return "AVC frame before config";
+		return check_avc_sample(param, body + 5, len - 5);
+	    case 2:
+		return 0;
+	    default:
+		return "invalid AVCPacketType";
+	}
+    }
+    if (*pt == FLV_TYPE_AUDIO && len && (body[0] >> 4) == 10)
+    {
+	if (len < 2)
+	    return "truncated AAC tag";
+	switch (body[1])
+	{
+	    case 0:
+		return (parse_aac_config(body + 2, len - 2, &aac) ? 0 : "invalid AAC config");
+	    case 1:
+		if (!param)
+		    return "AAC frame before config";
+		aac.channels = param - 1;
+		return check_aac_frame(&aac, body + 2, len - 2);
+	    default:
+		return "invalid AACPacketType";
+	}
+    }
+    return 0;
+}
+
+void add_check_error(long offset, const char *msg)
+{
+    pthread_mutex_lock(&check_lock);
+    if (nerrors == max_errors)
+    {
+	max_errors = (max_errors ? max_errors * 2 : 256);
+	check_errors = realloc(check_errors, max_errors * sizeof(*check_errors));
+	if (!check_errors)
+	    die("Out of memory\n");
+    }
+    check_errors[nerrors].offset = offset;
+    check_errors[nerrors++].msg = msg;
+    pthread_mutex_unlock(&check_lock);
+}
+
+void *check_worker(void *arg)
+{
+    struct check_job *job;
+    const char *msg;
+    int i;
+
+    while (1)
+    {
+	pthread_mutex_lock(&check_lock);
+	while (!queue_len && !queue_done)
+	    pthread_cond_wait(&queue_not_empty, &check_lock);
+	if (!queue_len)
+	{
+	    pthread_mutex_unlock(&check_lock);
+	    return 0;
+	}
+	job = check_queue[queue_head];
+	queue_head = (queue_head + 1) % CHECK_QUEUE;
+	queue_len--;
+	pthread_cond_signal(&queue_not_full);
+	pthread_mutex_unlock(&check_lock);
+
+	for (i = 0; i < job->n; i++)
+	    if ((msg = check_tag(head_beg + job->offsets[i], job->param[i])))
+		add_check_error(job->offsets[i], msg);
+	free(job);
+    }
+}
+
+void push_check_job()
+{
+    pthread_mutex_lock(&check_lock);
+    while (queue_len == CHECK_QUEUE)
+	pthread_cond_wait(&queue_not_full, &check_lock);
+    check_queue[(queue_head + queue_len) % CHECK_QUEUE] = cur_job;
+    queue_len++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&check_lock);
+    cur_job = 0;
+}
+
+void start_check()
+{
+    int i;
+
+    if (!check_threads)
+	check_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (check_threads < 1)
+	check_threads = 1;
+    workers = malloc(check_threads * sizeof(pthread_t));
+    if (!workers)
+	die("Out of memory\n");
+    for (i = 0; i < check_threads; i++)
+	if (pthread_create(&workers[i], 0, check_worker, 0))
+	    die("pthread_create failed\n");
+}
+
+/* Called in file order: configs are tracked here, so workers know
+ * which one applies to each tag. */
+void check_add(const uchar *pt, uchar type, int len)
+{
+    struct avc_config avc;
+    struct aac_config aac;
+
+    if (type == FLV_TYPE_META || !len)
+	return;
+    if (is_config_tag(pt, type, len) && type == FLV_TYPE_VIDEO)
+	nal_len_size = (len > 5 && parse_avc_config(pt + 16, len - 5, &avc) ?
+			avc.nal_len_size : 0);
+    if (is_config_tag(pt, type, len) && type == FLV_TYPE_AUDIO)
+	aac_channels = (parse_aac_config(pt + 13, len - 2, &aac) ? aac.channels + 1 : 0);
+    if (!cur_job)
     {
-	printf("*** Warning: Invalid tag, end of tag length mismatch (%i != %i)\n",
-	       prev_len + 4, *body_len + 15);
+	cur_job = malloc(sizeof(*cur_job));
+	if (!cur_job)
+	    die("Out of memory\n");
+	cur_job->n = 0;
+    }
+    cur_job->offsets[cur_job->n] = pt - head_beg;
+    cur_job->param[cur_job->n++] = (type == FLV_TYPE_VIDEO ? nal_len_size : aac_channels);
+    if (cur_job->n == CHECK_BATCH)
+	push_check_job();
+}
+
+int cmp_check_error(const void *a, const void *b)
+{
+    long d = ((const struct check_error*)a)->offset - ((const struct check_error*)b)->offset;
+    return (d > 0) - (d < 0);
+}
+
+void finish_check()
+{
+    int i;
+
+    if (cur_job)
+	push_check_job();
+    pthread_mutex_lock(&check_lock);
+    queue_done = 1;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_mutex_unlock(&check_lock);
+    for (i = 0; i < check_threads; i++)
+	pthread_join(workers[i], 0);
+
+    qsort(check_errors, nerrors, sizeof(*check_errors), cmp_check_error);
+    for (i = 0; i < nerrors && i < CHECK_SHOW; i++)
+	printf("%08li: Bad payload: %s\n", check_errors[i].offset, check_errors[i].msg);
+    if (nerrors > CHECK_SHOW)
+	printf("...\n");
+    printf("Payload errors: %i (deep check, %i threads)\n", nerrors, check_threads);
+}
+
+/**************************************************************************/
+/* Parse loop, one copy per mode (see flv_parse.h) */
+
+#define DEBUG_EXTRAS	FLV_PARSE_USER	// stats, bitrate profile or deep check
+
+int		prev_time = -1;
+int		time_range_idx = 0;
+int		gaps = 0;
+int		in_error = 0;
+#define MIN_TIME (min_times[time_range_idx])
+#define MAX_TIME (max_times[time_range_idx])
+
+void add_error(long offset)
+{
+    struct flv_summary *sum = &summary;
+
+    if (!in_error && sum->errors < FLV_SUMMARY_ERRORS)
+	sum->error_offsets[sum->errors] = offset;
+    sum->errors += !in_error;
+    in_error = 1;
+}
+
+const uchar *debug_bad(struct flv_parse *p, const uchar *pt)
+{
+    const uchar *next_pt = flv_skip_missing(head_fd, p->beg, pt, p->beg + p->file_len);
+
+    add_error(pt - p->beg);
+    if (next_pt - pt >= MISSING_MIN && !summary_only)
+	printf("Missing region [%li, %li)\n",
+	       (long)(pt - p->beg), (long)(next_pt - p->beg));
+    return (next_pt > pt ? next_pt : pt + 1);
+}
+
+// onMetaData's keyframes object (times / filepositions): offset in file, 0 if none.
+long keyframe_index(const uchar *pt, int len, const uchar *beg)
+{
+    const uchar *body = pt + 11, *s;
+
+    if (len < 13 || memcmp(body, "\x02\x00\x0aonMetaData", 13))
 	return 0;
+    for (s = body + 13; s + 11 <= body + len; s++)
+	if (!memcmp(s, "\x00\x09keyframes", 11))
+	    return s - beg;
+    return 0;
+}
+
+FLV_INLINE int debug_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag,
+			 int policy)
+{
+    struct flv_summary *sum = &summary;
+    int type = tag->type, len = tag->len, timestamp = tag->timestamp;
+
+    in_error = 0;
+    if (type == FLV_TYPE_AUDIO)
+	sum->audio_tags++;
+    if (type == FLV_TYPE_VIDEO)
+    {
+	sum->video_tags++;
+	if (len && (pt[11] >> 4) == 1 && !is_config_tag(pt, type, len))
+	    sum->keyframes++;
+    }
+    if (type == FLV_TYPE_META)
+    {
+	sum->meta_tags++;
+	if (!sum->keyframe_index)
+	    sum->keyframe_index = keyframe_index(pt, len, p->beg);
+    }
+    if (timestamp < prev_time)
+	sum->backward++;
+
+    if (prev_time != -1 &&
+	timestamp - prev_time > 500)
+    {
+	if (policy & FLV_PARSE_VERBOSE)
+	    printf("WARNING: Time gap in file (jump by %s)\n",
+		   format_time(timestamp - prev_time, time_buf));
+	gaps++;
+	if (time_range_idx < MAX_RANGES - 1)
+	{
+	    time_range_idx++;
+	    MIN_TIME = timestamp;
+	}
+    }
+    if (policy & DEBUG_EXTRAS)
+    {
+	if (timing_stats)
+	    update_stats(pt, type, len, timestamp, pt - p->beg);
+	if (bitrate_bucket)
+	    update_bitrate(type, len + 15, timestamp);
+	if (deep_check)
+	    check_add(pt, type, len);
     }
+
+    if (prev_time == -1)
+	MIN_TIME = timestamp;
+    prev_time = timestamp;
+
+    if (timestamp < MIN_TIME)
+	MIN_TIME = timestamp;
+    if (timestamp > MAX_TIME)
+	MAX_TIME = timestamp;
+
+    if (policy & FLV_PARSE_VERBOSE)
+	printf("%08li: Found TAG type %#04x, len %5i, time %s, stream_id %i\n",
+	       (long)(pt - p->beg), type, len, format_time(timestamp, time_buf), tag->stream_id);
     return 1;
 }
 
-uchar		*head_beg = 0;
-const char	*head_fname = 0;
-int		head_fd = 0;
-int		head_len = 0;
+// n: FLV_PARSE_TOLERANT | FLV_PARSE_VERBOSE | 4 for DEBUG_EXTRAS | FLV_PARSE_FOLLOW
+#define DEBUG_POLICY(n)	(((n) & 11) | ((n) & 4 ? DEBUG_EXTRAS : 0))
+#define DEBUG_LOOP(n)							\
+    int debug_tag_##n(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag) \
+    {									\
+	return debug_tag(p, pt, tag, DEBUG_POLICY(n));			\
+    }									\
+    void debug_loop_##n(struct flv_parse *p, long offset)		\
+    {									\
+	flv_parse_loop(p, offset, DEBUG_POLICY(n), debug_tag_##n, debug_bad); \
+    }
+
+DEBUG_LOOP(0) DEBUG_LOOP(1) DEBUG_LOOP(2) DEBUG_LOOP(3)
+DEBUG_LOOP(4) DEBUG_LOOP(5) DEBUG_LOOP(6) DEBUG_LOOP(7)
+DEBUG_LOOP(8) DEBUG_LOOP(9) DEBUG_LOOP(10) DEBUG_LOOP(11)
+DEBUG_LOOP(12) DEBUG_LOOP(13) DEBUG_LOOP(14) DEBUG_LOOP(15)
+
+void (*const debug_loops[16])(struct flv_parse *p, long offset) =
+{ debug_loop_0, debug_loop_1, debug_loop_2, debug_loop_3,
+  debug_loop_4, debug_loop_5, debug_loop_6, debug_loop_7,
+  debug_loop_8, debug_loop_9, debug_loop_10, debug_loop_11,
+  debug_loop_12, debug_loop_13, debug_loop_14, debug_loop_15 };
+
+/**************************************************************************/
+/* --follow */
 
-int min_times[20] = {0,};
-int max_times[20] = {0,};
+int			follow_fd = -1;
+struct flv_follow	head_follow;
+
+// Wait for file to grow. 0 once the writer is done with it.
+int follow_more(void)
+{
+    struct flv_follow *f = &head_follow;
+
+    for (;;)
+    {
+	while (!f->changed && !f->done)
+	    if (!flv_follow_wait(follow_fd, &f, 1))
+		f->done = 1;
+	if (flv_follow_update(f))
+	    break;
+	if (f->done)
+	    return 0;
+    }
+    head_beg = (uchar*)f->beg;
+    head_len = f->len;
+    return 1;
+}
+
+// Duration so far, bitrate since last time, gaps.
+void show_progress(const struct flv_parse *p)
+{
+    static long last_offset = 0;
+    static int last_time = -1;
+    int i, duration = 0, ms = MAX_TIME - last_time;
+
+    for (i = 0; i <= time_range_idx; i++)
+	duration += max_times[i] - min_times[i];
+    printf("[%s] duration %s", format_time(MAX_TIME, time_buf),
+	   format_time(duration, time_buf2));
+    if (last_time != -1 && ms > 0)
+	printf(", %li kbit/s", (p->offset - last_offset) * 8 / ms);
+    printf(", %i gap(s), %i error(s)\n", gaps, summary.errors);
+    last_offset = p->offset;
+    last_time = MAX_TIME;
+}
 
 void parse_tags()
 {
     const uchar const *beg = head_beg;
     const uchar *pt = beg;
-    uchar type;
-    int len, timestamp, stream_id;
-    int prev_time = -1;
-    int i, time_range_idx = 0;
-#define MIN_TIME (min_times[time_range_idx])
-#define MAX_TIME (max_times[time_range_idx])
-    
+    struct flv_summary *sum = &summary;
+    struct flv_parse p;
+    int i, loop;
+
     /* Checking head */
     ASSERT(!strncmp((char*)pt, "FLV", 3), "file %s: invalid FLV header\n", head_fname);
     pt += 13;
@@ -181,46 +820,74 @@ void parse_tags()
     if (*pt != FLV_TYPE_META)
 	printf("Warning: Non metadata tag (%#02x) at offset 13\n", *pt);    
 
-    while (pt - beg < head_len)
+    flv_parse_init(&p, beg, head_len, 0);
+    loop = ((strict ? 0 : FLV_PARSE_TOLERANT) |
+	    (summary_only ? 0 : FLV_PARSE_VERBOSE) |
+	    (timing_stats || bitrate_bucket || deep_check ? 4 : 0));
+    debug_loops[loop | (follow ? FLV_PARSE_FOLLOW : 0)](&p, pt - beg);
+    while (follow && !p.bad)
     {
-	if (!parse_tag(pt, &type, &len, &timestamp, &stream_id, beg, head_len))
+	if (summary_only)
+	    show_progress(&p);
+	fflush(stdout);
+	if (!follow_more())
 	{
-#ifdef PARSE_BROKEN_FILE
-	    pt++;
-	    continue;
-#else
-	    printf("Broken file, stopping here (at %i%%).\n",
-		   (pt - beg) * 100 / head_len);
+	    if (head_follow.truncated)
+	    {
+		printf("%s: file truncated, stopping.\n", head_fname);
+		break;
+	    }
+	    // Writer is gone: whatever is left is broken.
+	    debug_loops[loop](&p, p.offset);
 	    break;
-#endif
 	}
-	
-	if (prev_time != -1 &&
-	    timestamp - prev_time > 500)
+	p.beg = head_beg;
+	p.file_len = head_len;
+	debug_loops[loop | FLV_PARSE_FOLLOW](&p, p.offset);
+    }
+    if (p.bad)
+    {
+	add_error(p.offset);
+	printf("Broken file, stopping here (at %li%%).\n", p.offset * 100 / head_len);
+    }
+
+    if (time_range_idx < FLV_SUMMARY_RANGES)
+    {
+	sum->flags = FLV_SUMMARY_FULL;
+	sum->nranges = time_range_idx + 1;
+	for (i = 0; i <= time_range_idx; i++)
 	{
-	    printf("WARNING: Time gap in file (jump by %s)\n",
-		   format_time(timestamp - prev_time, time_buf));
-	    time_range_idx++;
-	    MIN_TIME = timestamp;
+	    sum->min_times[i] = min_times[i];
+	    sum->max_times[i] = max_times[i];
 	}
-	prev_time = timestamp;
-
-	if (timestamp < MIN_TIME)
-	    MIN_TIME = timestamp;
-	if (timestamp > MAX_TIME)
-	    MAX_TIME = timestamp;
-	
-	printf("%08i: Found TAG type %#04x, len %5i, time %s, stream_id %i\n",
-	       pt - beg, type, len, format_time(timestamp, time_buf), stream_id);
-
-	// TODO: parse metadata tag
-	
-//	printf("TAG type %#02x, len %i\n", type, len);
-	ASSERT(*pt == FLV_TYPE_AUDIO ||
-	       *pt == FLV_TYPE_VIDEO ||
-	       *pt == FLV_TYPE_META,
-	       "Unknown tag ... corrupted file ?\n");
-	pt = skip_tag(pt, len);
+    }
+    else
+    {
+	// Doesn't fit, just keep the overall range.
+	sum->flags = 0;
+	sum->nranges = 1;
+	sum->min_times[0] = min_times[0];
+	sum->max_times[0] = max_times[0];
+	for (i = 1; i <= time_range_idx; i++)
+	{
+	    if (min_times[i] < sum->min_times[0])
+		sum->min_times[0] = min_times[i];
+	    if (max_times[i] > sum->max_times[0])
+		sum->max_times[0] = max_times[i];
+	}
+    }
+    if (!p.bad && head_fd != -1)
+	flv_cache_store(head_fd, sum);
+    if (deep_check)
+	finish_check();
+    if (summary_only)
+    {
+	show_summary(sum);
+	if (timing_stats)
+	    show_stats();
+	if (bitrate_bucket)
+	    show_bitrate();
+	return;
     }
 
     printf("Time range: ");
@@ -229,24 +896,96 @@ void parse_tags()
 	       format_time(min_times[i], time_buf),
 	       format_time(max_times[i], time_buf2));
     printf("\n");
-    if (time_range_idx)
-	printf("WARNING: %i time gap(s) found.\n", time_range_idx);
+    if (gaps)
+	printf("WARNING: %i time gap(s) found.\n", gaps);
     
 }
 
 int main(int ac, char **av)
 {
     ac--; av++;
-    if (ac != 1)
+    for (; ac > 1 && av[0][0] == '-'; ac--, av++)
+    {
+	if (!strcmp(*av, "-s"))
+	    summary_only = 1;
+	else if (!strcmp(*av, "--strict"))
+	    strict = 1;
+	else if (!strcmp(*av, "--stats"))
+	    summary_only = timing_stats = 1;
+	else if (!strcmp(*av, "-b") && ac > 2)
+	{
+	    summary_only = 1;
+	    bitrate_bucket = atoi(*++av);
+	    ac--;
+	    if (bitrate_bucket <= 0)
+		die("bad bucket size\n");
+	}
+	else if (!strcmp(*av, "-w") && ac > 2)
+	{
+	    bitrate_window = atoi(*++av);
+	    if (bitrate_window <= 0)
+		die("bad window size\n");
+	    ac--;
+	}
+	else if (!strcmp(*av, "--csv") && ac > 2)
+	{
+	    csv_fname = *++av;
+	    ac--;
+	}
+	else if (!strcmp(*av, "-d"))
+	    deep_check = 1;
+	else if (!strcmp(*av, "--follow"))
+	    follow = 1;
+	else if (!strcmp(*av, "-j") && ac > 2)
+	{
+	    check_threads = atoi(*++av);
+	    ac--;
+	}
+	else
+	    usage();
+    }
+    if (ac != 1 || (follow && deep_check))
 	usage();
     
     head_fname = *av;
-    head_fd = my_open(head_fname, O_RDONLY, 0);
-    head_len = get_file_len(head_fd);
+    if (follow)
+    {
+	follow_fd = flv_follow_init();
+	if (follow_fd == -1 || !flv_follow_open(&head_follow, follow_fd, head_fname))
+	{
+	    perror(head_fname);
+	    exit(1);
+	}
+	while (head_len < 13 && follow_more())
+	    ;
+	if (head_len < 13)
+	    die("not a flv file\n");
+	head_fd = head_follow.fd;
+    }
+    else
+    {
+	if (!flv_map_open(&head_map, head_fname))
+	{
+	    perror(head_fname);
+	    exit(1);
+	}
+	head_fd = head_map.fd;		// -1 in a pack: no cache, no hole lookups
+	head_len = head_map.len;
+	head_beg = (uchar*)head_map.beg;
+    }
     ac--; av++;
 
-    head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
+    flv_cache_open();
+    if (summary_only && !timing_stats && !bitrate_bucket && !deep_check &&
+	!follow && head_fd != -1 && flv_cache_lookup(head_fd, &summary) &&
+	(summary.flags & FLV_SUMMARY_FULL))
+    {
+	show_summary(&summary);
+	return 0;
+    }
 
+    if (deep_check)
+	start_check();
     parse_tags();
     
     return 0;
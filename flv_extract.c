@@ -0,0 +1,308 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_codec.h"
+#include "flv_parse.h"
+
+#define FLV_TYPE_AUDIO 0x08
+#define FLV_TYPE_VIDEO 0x09
+#define FLV_TYPE_META 0x12
+
+#define FLV_CODEC_MP3	2
+
+// Output batches
+#define MAX_IOVS	1024
+#define BATCH_BYTES	(4 << 20)
+
+void die(char *str)
+{
+    printf("%s", str);
+    exit(1);
+}
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_extract [-a audio_out] [-v video_out]  file.flv\n");
+    printf("\n");
+    printf("  Extract elementary streams from file.flv:\n");
+    printf("    audio: AAC -> ADTS (.aac), MP3 -> raw frames (.mp3)\n");
+    printf("    video: H.264 -> Annex B (.h264)\n");
+    printf("  Both can be extracted in the same pass.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+int file_exists(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) == -1 &&
+	errno == ENOENT)
+	return 0;
+    return 1;
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+
+uchar		*head_beg = 0;
+const char	*head_fname = 0;
+int		head_fd = 0;
+off_t		head_len = 0;
+
+
+/* Output: gathered iovecs pointing into the mapping, ADTS headers
+ * are the only thing copied (in hdrs). */
+struct output
+{
+    const char		*fname;
+    int			fd;
+    struct iovec	iov[MAX_IOVS];
+    int			niov;
+    size_t		bytes;
+    uchar		hdrs[MAX_IOVS / 2][ADTS_HEADER_LEN];
+    int			nhdrs;
+    unsigned int	frames;
+};
+
+struct output	audio_out = { 0, -1 };
+struct output	video_out = { 0, -1 };
+
+void flush_output(struct output *out)
+{
+    struct iovec *iov = out->iov;
+    int n = out->niov;
+
+    while (n)
+    {
+	ssize_t ret = writev(out->fd, iov, n);
+	if (ret == -1)
+	{
+	    perror(out->fname);
+	    exit(1);
+	}
+	while (n && ret >= iov->iov_len)
+	{
+	    ret -= iov->iov_len;
+	    iov++; n--;
+	}
+	if (n)
+	{
+	    iov->iov_base = (uchar*)iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
+    }
+    out->niov = 0;
+    out->nhdrs = 0;
+    out->bytes = 0;
+}
+
+void output_add(struct output *out, const void *buf, int len)
+{
+    out->iov[out->niov].iov_base = (void*)buf;
+    out->iov[out->niov].iov_len = len;
+    out->niov++;
+    out->bytes += len;
+}
+
+// Make sure there's room for n more iovecs.
+void output_reserve(struct output *out, int n)
+{
+    if (out->niov + n > MAX_IOVS || out->bytes >= BATCH_BYTES)
+	flush_output(out);
+}
+
+void open_output(struct output *out)
+{
+    ASSERT(!file_exists(out->fname),
+	   "%s: File exists, aborting\n", out->fname);
+    out->fd = my_open(out->fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+struct avc_config	avc;
+struct aac_config	aac;
+int			has_avc = 0, has_aac = 0;
+
+void extract_video(const uchar *pt, int len)
+{
+    struct output *out = &video_out;
+    int n;
+
+    if ((pt[11] & 0xf) != FLV_CODEC_AVC || len < 5)
+	die("Video codec not supported, aborting.\n");
+
+    if (pt[12] == 0)		// sequence header
+    {
+	ASSERT(parse_avc_config(pt + 16, len - 5, &avc),
+	       "Invalid AVC sequence header\n");
+	has_avc = 1;
+	return;
+    }
+    if (pt[12] != 1 || !has_avc)
+	return;
+
+    output_reserve(out, MAX_IOVS / 2);
+    n = avc_to_annexb(&avc, pt + 16, len - 5, (pt[11] >> 4) == 1, 0,
+		      out->iov + out->niov, MAX_IOVS - out->niov);
+    if (n < 0 && out->niov)	// lots of NAL units ? try again with all iovecs
+    {
+	flush_output(out);
+	n = avc_to_annexb(&avc, pt + 16, len - 5, (pt[11] >> 4) == 1, 0,
+			  out->iov, MAX_IOVS);
+    }
+    if (n < 0)
+    {
+	printf("Warning: broken video frame at offset %li, skipping.\n",
+	       (long)(pt - head_beg));
+	return;
+    }
+    for (; n; n--)
+	out->bytes += out->iov[out->niov++].iov_len;
+    out->frames++;
+}
+
+void extract_audio(const uchar *pt, int len)
+{
+    struct output *out = &audio_out;
+    int format = pt[11] >> 4;
+
+    if (format == FLV_CODEC_MP3)
+    {
+	output_reserve(out, 1);
+	output_add(out, pt + 12, len - 1);
+	out->frames++;
+	return;
+    }
+
+    if (format != FLV_CODEC_AAC)
+	die("Audio codec not supported, aborting.\n");
+    if (len < 2)
+	return;
+    if (pt[12] == 0)		// sequence header
+    {
+	ASSERT(parse_aac_config(pt + 13, len - 2, &aac),
+	       "Invalid AAC sequence header\n");
+	has_aac = 1;
+	return;
+    }
+    if (!has_aac)
+	return;
+
+    output_reserve(out, 2);
+    make_adts_header(&aac, len - 2, out->hdrs[out->nhdrs]);
+    output_add(out, out->hdrs[out->nhdrs++], ADTS_HEADER_LEN);
+    output_add(out, pt + 13, len - 2);
+    out->frames++;
+}
+
+int extract_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    if (!tag->len)
+	return 1;
+    if (tag->type == FLV_TYPE_VIDEO && video_out.fname)
+	extract_video(pt, tag->len);
+    if (tag->type == FLV_TYPE_AUDIO && audio_out.fname)
+	extract_audio(pt, tag->len);
+    return 1;
+}
+
+void parse_tags()
+{
+    struct flv_parse p;
+
+    ASSERT(!strncmp((char*)head_beg, "FLV", 3), "file %s: invalid FLV header\n", head_fname);
+
+    flv_parse_init(&p, head_beg, head_len, 0);
+    flv_parse_loop(&p, 13, FLV_PARSE_STRICT | FLV_PARSE_VERBOSE, extract_tag, 0);
+    if (p.bad)
+	die("invalid tag found, aborting. Fix file first.\n");
+
+    if (video_out.fname)
+    {
+	flush_output(&video_out);
+	printf("%s: %u video frames\n", video_out.fname, video_out.frames);
+    }
+    if (audio_out.fname)
+    {
+	flush_output(&audio_out);
+	printf("%s: %u audio frames\n", audio_out.fname, audio_out.frames);
+    }
+}
+
+int main(int ac, char **av)
+{
+    ac--; av++;
+    while (ac > 1 && av[0][0] == '-')
+    {
+	if (!strcmp(av[0], "-a"))
+	    audio_out.fname = av[1];
+	else if (!strcmp(av[0], "-v"))
+	    video_out.fname = av[1];
+	else
+	    usage();
+	ac -= 2; av += 2;
+    }
+    if (ac != 1 || (!audio_out.fname && !video_out.fname))
+	usage();
+
+    head_fname = *av;
+    head_fd = my_open(head_fname, O_RDONLY, 0);
+    head_len = get_file_len(head_fd);
+
+    if (audio_out.fname)
+	open_output(&audio_out);
+    if (video_out.fname)
+	open_output(&video_out);
+
+    head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
+
+    parse_tags();
+
+    return 0;
+}
@@ -8,6 +8,12 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#include "flv_scan.h"
+#include "flv_parse.h"
+#include "flv_ckpt.h"
 
 #define uchar unsigned char
 
@@ -15,6 +21,20 @@
 #define FLV_TYPE_VIDEO 0x09
 #define FLV_TYPE_META 0x12
 
+// Forward jumps bigger than that (in ms) on the a/v timeline, or backward
+// within a stream, are discontinuities.
+int		gap_threshold = 1000;
+
+// Tags are re-sorted by timestamp within that window (ms).
+int		reorder_window = 500;
+
+// Repeated tags are dropped if seen within that many tags.
+int		dedup_window = 8192;
+#define DEDUP_MAX	(1 << 24)
+
+int		quiet = 0;
+int		resume = 0;
+
 void die(char *str)
 {
     printf(str);
@@ -24,11 +44,33 @@ void die(char *str)
 void usage(void)
 {
     printf("Usage:\n");
-    printf("  flv_fix  file.flv out.flv\n");
+    printf("  flv_fix  [--resume] [-q] [-g gap_ms] [-r window_ms] [-d window_tags] file.flv out.flv\n");
     printf("\n");
     printf("  Attempt to repair invalid file.flv (flv_debug shows errors).\n");
     printf("  Output written to out.flv\n");
     printf("\n");
+    printf("  Timestamps going backward within a stream, or jumping forward on the\n");
+    printf("  combined audio / video timeline, by more than gap_ms (default %i,\n", gap_threshold);
+    printf("  0 to disable) are discontinuities (stream restart, concatenated files):\n");
+    printf("  following tags are rebased so the output has one continuous timeline.\n");
+    printf("  A gap in one stream only (still video, silence) is left alone, smaller\n");
+    printf("  steps back are left to reordering.\n");
+    printf("\n");
+    printf("  Out of order tags (audio and video slightly interleaved wrong ...)\n");
+    printf("  are re-sorted by timestamp within window_ms (default %i, 0 to disable).\n",
+	   reorder_window);
+    printf("\n");
+    printf("  Repeated tags (same type, timestamp and data, as after a reconnect)\n");
+    printf("  within window_tags tags (default %i, 0 to disable) are dropped.\n",
+	   dedup_window);
+    printf("\n");
+    printf("  -q: don't list tags found.\n");
+    printf("\n");
+    printf("  Output goes to out.flv.part, checkpointed in out.flv.ckpt, and is\n");
+    printf("  renamed to out.flv once complete. If interrupted, run again with\n");
+    printf("  --resume to go on from the last checkpoint (does nothing if out.flv\n");
+    printf("  exists, starts over if the checkpoint can't be used).\n");
+    printf("\n");
     exit(1);
 }
 
@@ -69,7 +111,7 @@ int file_exists(const char *name)
     return 1;
 }
 
-int get_file_len(int fd)
+long get_file_len(int fd)
 {
     struct stat st;
     if (fstat(fd, &st))
@@ -92,147 +134,605 @@ int read_number(const uchar *pt, int bytes)
     return len;
 }
 
-const uchar *skip_tag(const uchar *tag_begin, int body_len)
+uchar		*head_beg = 0;
+const char	*head_fname = 0;
+int		head_fd = 0;
+long		head_len = 0;
+
+const char	*out_fname = 0;
+int		out_fd = 0;
+
+ssize_t my_write(int fd, const void *buf, size_t count)
 {
-    return tag_begin + body_len + 15;
+    int total = 0;
+    while (total != count)
+    {
+	int ret = write(fd, buf, count);
+	if (ret == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	total += ret;
+    }
+    return total;
 }
 
-int parse_tag(const uchar *pt,
-	      uchar *type, int *body_len, int *timestamp, int *stream_id,
-	      const uchar *beg, int file_len)
+/* Output batching: tags are queued as iovecs pointing into the mapping,
+ * only retimed headers are copied (into hdr_buf). */
+#define OUT_IOVS	1024
+#define OUT_BYTES	(1 << 20)
+
+struct iovec	out_iov[OUT_IOVS];
+int		out_niov = 0;
+size_t		out_bytes = 0;
+uint64_t	out_total = 0;		// written so far
+uchar		hdr_buf[OUT_IOVS * 11];
+int		hdr_used = 0;
+
+void flush_out()
 {
-    const uchar const *pt_orig = pt;
-#define OFFSET	(pt_orig - beg)
-    int prev_len = 0;
+    struct iovec *iov = out_iov;
+    int n = out_niov;
 
-    // check we're within file boundaries.
-    if (pt - beg + 15 > file_len)
+    while (n)
     {
-	printf("File boundaries exceeded.\n");
-	return 0;
+	ssize_t ret = writev(out_fd, iov, n);
+	if (ret == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	// partial write
+	while (n && ret >= iov->iov_len)
+	{
+	    ret -= iov->iov_len;
+	    iov++; n--;
+	}
+	if (n)
+	{
+	    iov->iov_base = (uchar*)iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
     }
-    
-    *type = *pt++;
-    if (! (*type == FLV_TYPE_AUDIO ||
-	   *type == FLV_TYPE_VIDEO ||
-	   *type == FLV_TYPE_META))
+    out_total += out_bytes;
+    out_niov = 0;
+    out_bytes = 0;
+    hdr_used = 0;
+}
+
+void queue_out(const void *buf, size_t len)
+{
+    if (out_niov == OUT_IOVS)
+	flush_out();
+    out_iov[out_niov].iov_base = (void*)buf;
+    out_iov[out_niov].iov_len = len;
+    out_niov++;
+    out_bytes += len;
+    if (out_bytes >= OUT_BYTES)
+	flush_out();
+}
+
+// Write tag with given timestamp.
+void write_tag(const uchar *pt, int tag_len, int timestamp)
+{
+    uchar *hdr;
+
+    if (read_number(pt + 4, 3) == timestamp)
     {
-	printf("Invalid tag type %#02x at offset %i\n", *type, OFFSET);
-	return 0;
+	queue_out(pt, tag_len);
+	return;
     }
-    
-    *body_len = read_number(pt, 3);
-    pt += 3;
 
-    // Timestamp in milliseconds
-    *timestamp = read_number(pt, 3);
-    pt += 3;    
+    if (out_niov + 2 > OUT_IOVS)
+	flush_out();
+    hdr = hdr_buf + hdr_used;
+    hdr_used += 11;
+    memcpy(hdr, pt, 11);
+    hdr[4] = timestamp >> 16;
+    hdr[5] = timestamp >> 8;
+    hdr[6] = timestamp;
+    hdr[7] = timestamp >> 24;	// extended timestamp
+    queue_out(hdr, 11);
+    queue_out(pt + 11, tag_len - 11);
+}
 
-    *stream_id = read_number(pt, 4);
-    pt += 4;
-    
-    printf("%08i: Found TAG type %#04x, len %5i, time %7i, stream_id %i\n",
-	   OFFSET, *type, *body_len, *timestamp, *stream_id);
+/* Timeline. Forward jumps are looked for on the combined audio / video
+ * timeline, a gap in one stream only (still video, audio silence) is normal:
+ * a jump by more than gap_threshold moves all streams back together, leaving
+ * one frame. Backward jumps are per stream: the stream goes on one frame after
+ * its last output timestamp (metadata goes on where audio and video are).
+ * Steps back up to gap_threshold (or reorder_window if bigger) are just tags
+ * out of order: jitter mustn't pile up as drift. */
+#define STREAMS		3
+#define DEFAULT_FRAME	40
+#define END_SKEW	1000	// warn if audio and video end further apart (ms)
 
-    /* Check end tag len */
-    pt = skip_tag(pt_orig, *body_len);
-    
-    pt -= 4;
-    // check we're within file boundaries.
-    if (pt - beg + 4 > file_len)
+struct stream_time
+{
+    int		started;
+    int		last_in;	// last input timestamp
+    int		last_out;	// last output timestamp
+    int		offset;		// from backward jumps, stream's own
+    int		frame;		// last frame duration
+};
+
+struct av_time
+{
+    int		started;
+    int		last;		// latest a/v timestamp, stream offsets applied
+    int		offset;		// from forward jumps, same for all streams
+};
+
+struct stream_time	streams[STREAMS];
+struct av_time		av;
+const char		*stream_names[STREAMS] = { "audio", "video", "meta" };
+
+int stream_index(uchar type)
+{
+    return (type == FLV_TYPE_AUDIO ? 0 :
+	    type == FLV_TYPE_VIDEO ? 1 : 2);
+}
+
+int rebase_time(uchar type, int timestamp, int offset)
+{
+    struct stream_time *st = &streams[stream_index(type)];
+    int delta = timestamp - st->last_in;
+    int started = st->started;
+    int t;
+
+    if (!started)
     {
-	printf("File boundaries exceeded.\n");
-	return 0;
+	st->started = 1;
+	st->frame = DEFAULT_FRAME;
     }
-    prev_len = read_number(pt, 4);
-    if (prev_len + 4 != *body_len + 15)
+    else if (delta < 0 &&
+	     (!gap_threshold || -delta <= gap_threshold || -delta <= reorder_window))
+	return timestamp + st->offset + av.offset;	// out of order, reordering deals with it
+    else if (delta < 0)
     {
-	printf("*** Warning: Invalid tag, end of tag length mismatch (%i != %i)\n",
-	       prev_len + 4, *body_len + 15);
-	return 0;
+	int out = st->last_out + st->frame;
+	// metadata: put it where audio and video are
+	if (st == &streams[2])
+	    out = (streams[0].last_out > streams[1].last_out ?
+		   streams[0].last_out : streams[1].last_out);
+	printf("Warning: %s timestamp going backward by %i ms at offset %i, rebasing.\n",
+	       stream_names[stream_index(type)], -delta, offset);
+	st->offset = out - av.offset - timestamp;
     }
-    return 1;
+    else if (delta > 0 && (!gap_threshold || delta <= gap_threshold))
+	st->frame = delta;
+
+    // First tag of a stream may start late, that's no jump.
+    t = timestamp + st->offset;
+    if (started && av.started && gap_threshold && t - av.last > gap_threshold)
+    {
+	printf("Warning: timestamps jumping by %i ms at offset %i, rebasing.\n",
+	       t - av.last, offset);
+	av.offset -= t - av.last - st->frame;
+    }
+    if (st != &streams[2] && (!av.started || t > av.last))
+    {
+	av.started = 1;
+	av.last = t;
+    }
+
+    st->last_in = timestamp;
+    st->last_out = t + av.offset;
+    return st->last_out;
 }
 
-uchar		*head_beg = 0;
-const char	*head_fname = 0;
-int		head_fd = 0;
-int		head_len = 0;
+/* Reorder buffer: min-heap on (timestamp, input order) of tags pointing into
+ * the mapping. A tag is written once a tag reorder_window ms later shows up,
+ * or when the heap is full. */
+#define REORDER_MAX	(1 << 16)
 
-const char	*out_fname = 0;
-int		out_fd = 0;
+struct queued_tag
+{
+    const uchar		*pt;
+    int			len;
+    int			timestamp;
+    unsigned int	seq;
+};
 
-ssize_t my_write(int fd, const void *buf, size_t count)
+struct queued_tag	heap[REORDER_MAX];
+int			heap_len = 0;
+unsigned int		heap_seq = 0;
+int			last_written = 0;
+int			late_tags = 0;
+
+int tag_before(const struct queued_tag *a, const struct queued_tag *b)
 {
-    int total = 0;
-    while (total != count)
+    return (a->timestamp < b->timestamp ||
+	    (a->timestamp == b->timestamp && a->seq < b->seq));
+}
+
+void heap_push(const uchar *pt, int len, int timestamp)
+{
+    int i = heap_len++;
+    struct queued_tag tag = { pt, len, timestamp, heap_seq++ };
+
+    while (i && tag_before(&tag, &heap[(i - 1) / 2]))
     {
-	int ret = write(fd, buf, count);
-	if (ret == -1)
+	heap[i] = heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    heap[i] = tag;
+}
+
+// Write first tag and remove it.
+void heap_pop()
+{
+    struct queued_tag tag = heap[--heap_len];
+    int i = 0, child;
+
+    write_tag(heap[0].pt, heap[0].len, heap[0].timestamp);
+    last_written = heap[0].timestamp;
+    while ((child = 2 * i + 1) < heap_len)
+    {
+	if (child + 1 < heap_len && tag_before(&heap[child + 1], &heap[child]))
+	    child++;
+	if (!tag_before(&heap[child], &tag))
+	    break;
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = tag;
+}
+
+void reorder_tag(const uchar *pt, int len, int timestamp)
+{
+    if (!reorder_window)	// disabled: as is
+    {
+	write_tag(pt, len, timestamp);
+	return;
+    }
+    // Too late to put it in order, keep it close.
+    if (timestamp < last_written)
+    {
+	late_tags++;
+	timestamp = last_written;
+    }
+
+    if (heap_len == REORDER_MAX)
+	heap_pop();
+    heap_push(pt, len, timestamp);
+    while (heap_len && heap[0].timestamp <= timestamp - reorder_window)
+	heap_pop();
+}
+
+/* Duplicates: fingerprints of the last dedup_window tags, in two open
+ * addressing tables. New ones go in the current table, when it holds half
+ * the window the other one is cleared and becomes current.
+ * Fingerprint matches are checked with memcmp(). */
+struct dedup_entry
+{
+    uint64_t		fp;		// 0: empty
+    const uchar		*pt;
+};
+
+struct dedup_entry	*dedup_tables[2];
+unsigned int		dedup_mask = 0;
+int			dedup_count = 0;
+int			dedup_cur = 0;
+int			dup_tags = 0;
+size_t			dup_bytes = 0;
+
+void dedup_init()
+{
+    unsigned int slots = 16;
+    while (slots < dedup_window)	// half full at most
+	slots *= 2;
+    dedup_mask = slots - 1;
+    dedup_tables[0] = calloc(slots, sizeof(struct dedup_entry));
+    dedup_tables[1] = calloc(slots, sizeof(struct dedup_entry));
+    ASSERT(dedup_tables[0] && dedup_tables[1], "Out of memory\n");
+}
+
+// Type, timestamp, size, then body 8 bytes at a time.
+uint64_t tag_fingerprint(const uchar *pt, int len)
+{
+    uint64_t h = ((uint64_t)pt[0] << 56) ^ ((uint64_t)read_number(pt + 4, 4) << 24) ^ len;
+    const uchar *body = pt + 11, *end = body + len;
+    uint64_t w;
+
+    h *= 0x9e3779b97f4a7c15ULL;
+    for (; end - body >= 8; body += 8)
+    {
+	memcpy(&w, body, 8);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+    }
+    for (w = 0; body < end; body++)
+	w = (w << 8) | *body;
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h | 1;
+}
+
+// Seen already ?  Remembers it otherwise.
+int duplicate_tag(const uchar *pt, int len)
+{
+    uint64_t fp = tag_fingerprint(pt, len);
+    struct dedup_entry *e;
+    int t;
+
+    for (t = 0; t < 2; t++)
+	for (e = &dedup_tables[t][fp & dedup_mask]; e->fp;
+	     e = &dedup_tables[t][(e - dedup_tables[t] + 1) & dedup_mask])
+	    if (e->fp == fp && read_number(e->pt + 1, 3) == len &&
+		!memcmp(e->pt, pt, len + 11))
+		return 1;
+
+    if (dedup_count * 2 >= dedup_window)
+    {
+	dedup_cur ^= 1;
+	memset(dedup_tables[dedup_cur], 0, (dedup_mask + 1) * sizeof(struct dedup_entry));
+	dedup_count = 0;
+    }
+    for (e = &dedup_tables[dedup_cur][fp & dedup_mask]; e->fp;
+	 e = &dedup_tables[dedup_cur][(e - dedup_tables[dedup_cur] + 1) & dedup_mask])
+	;
+    e->fp = fp;
+    e->pt = pt;
+    dedup_count++;
+    return 0;
+}
+
+/* Checkpoints: output offset, input offset of next tag, and the state
+ * needed to go on: timelines, reorder heap and dedup tables (as offsets). */
+struct fix_state
+{
+    int			gap_threshold, reorder_window, dedup_window;
+    struct stream_time	streams[STREAMS];
+    struct av_time	av;
+    int			last_written, late_tags;
+    unsigned int	heap_seq;
+    int			heap_len;
+    int			dup_tags;
+    uint64_t		dup_bytes;
+    int			dedup_count, dedup_cur;
+    unsigned int	dedup_mask;
+};
+
+struct saved_tag
+{
+    uint64_t		offset;
+    int			len;
+    int			timestamp;
+    unsigned int	seq;
+};
+
+struct saved_entry
+{
+    uint64_t		fp;
+    uint64_t		offset;
+};
+
+uint64_t	last_ckpt = 0;
+
+size_t state_size()
+{
+    return (sizeof(struct fix_state) + heap_len * sizeof(struct saved_tag) +
+	    (dedup_window ? 2 * (dedup_mask + 1) * sizeof(struct saved_entry) : 0));
+}
+
+void checkpoint(long in_off)
+{
+    size_t len = state_size();
+    uchar *buf = malloc(len);
+    struct fix_state *st = (struct fix_state*)buf;
+    struct saved_tag *tags = (struct saved_tag*)(st + 1);
+    struct saved_entry *entries = (struct saved_entry*)(tags + heap_len);
+    unsigned int i, t;
+
+    ASSERT(buf, "Out of memory\n");
+    flush_out();
+    memset(st, 0, sizeof(*st));
+    st->gap_threshold = gap_threshold;
+    st->reorder_window = reorder_window;
+    st->dedup_window = dedup_window;
+    memcpy(st->streams, streams, sizeof(streams));
+    st->av = av;
+    st->last_written = last_written;
+    st->late_tags = late_tags;
+    st->heap_seq = heap_seq;
+    st->heap_len = heap_len;
+    st->dup_tags = dup_tags;
+    st->dup_bytes = dup_bytes;
+    st->dedup_count = dedup_count;
+    st->dedup_cur = dedup_cur;
+    st->dedup_mask = dedup_mask;
+    for (i = 0; i < heap_len; i++)
+    {
+	tags[i].offset = heap[i].pt - head_beg;
+	tags[i].len = heap[i].len;
+	tags[i].timestamp = heap[i].timestamp;
+	tags[i].seq = heap[i].seq;
+    }
+    for (t = 0; dedup_window && t < 2; t++)
+	for (i = 0; i <= dedup_mask; i++, entries++)
 	{
-	    perror(out_fname);
-	    exit(1);
+	    entries->fp = dedup_tables[t][i].fp;
+	    entries->offset = (entries->fp ? dedup_tables[t][i].pt - head_beg : 0);
 	}
-	total += ret;
+
+    if (!flv_ckpt_save(out_fname, out_fd, &head_fd, 1, in_off, out_total, buf, len))
+	printf("Warning: couldn't save checkpoint.\n");
+    last_ckpt = out_total;
+    free(buf);
+}
+
+void restore_state(const uchar *buf, uint32_t len)
+{
+    const struct fix_state *st = (const struct fix_state*)buf;
+    const struct saved_tag *tags = (const struct saved_tag*)(st + 1);
+    const struct saved_entry *entries;
+    unsigned int i, t;
+
+    ASSERT(len >= sizeof(*st) && st->gap_threshold == gap_threshold &&
+	   st->reorder_window == reorder_window && st->dedup_window == dedup_window &&
+	   st->dedup_mask == dedup_mask,
+	   "Checkpoint was made with different options, aborting.\n");
+    memcpy(streams, st->streams, sizeof(streams));
+    av = st->av;
+    last_written = st->last_written;
+    late_tags = st->late_tags;
+    heap_seq = st->heap_seq;
+    heap_len = st->heap_len;
+    dup_tags = st->dup_tags;
+    dup_bytes = st->dup_bytes;
+    dedup_count = st->dedup_count;
+    dedup_cur = st->dedup_cur;
+    ASSERT(len == state_size(), "Invalid checkpoint, aborting.\n");
+
+    for (i = 0; i < heap_len; i++)
+    {
+	ASSERT(tags[i].offset + tags[i].len <= head_len, "Invalid checkpoint, aborting.\n");
+	heap[i].pt = head_beg + tags[i].offset;
+	heap[i].len = tags[i].len;
+	heap[i].timestamp = tags[i].timestamp;
+	heap[i].seq = tags[i].seq;
     }
-    return total;
+    entries = (const struct saved_entry*)(tags + heap_len);
+    for (t = 0; dedup_window && t < 2; t++)
+	for (i = 0; i <= dedup_mask; i++, entries++)
+	{
+	    ASSERT(entries->offset < head_len, "Invalid checkpoint, aborting.\n");
+	    dedup_tables[t][i].fp = entries->fp;
+	    dedup_tables[t][i].pt = head_beg + entries->offset;
+	}
+}
+
+// invalid tag, try to find next one ...
+const uchar *fix_bad(struct flv_parse *p, const uchar *pt)
+{
+    const uchar *next_pt = flv_skip_missing(head_fd, p->beg, pt, p->beg + p->file_len);
+    if (next_pt - pt >= MISSING_MIN)
+	printf("Missing region [%li, %li), skipping.\n",
+	       (long)(pt - p->beg), (long)(next_pt - p->beg));
+    return (next_pt > pt ? next_pt : pt + 1);
 }
 
+FLV_INLINE int fix_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag,
+		       int policy)
+{
+    int timestamp;
+
+    if (policy & FLV_PARSE_VERBOSE)
+	printf("%08li: Found TAG type %#04x, len %5i, time %7i, stream_id %i\n",
+	       (long)(pt - p->beg), tag->type, tag->len, tag->timestamp, tag->stream_id);
+
+    if (dedup_window && duplicate_tag(pt, tag->len))
+    {
+	dup_tags++;
+	dup_bytes += tag->len + 15;
+	return 1;
+    }
+
+    timestamp = rebase_time(tag->type, tag->timestamp, pt - p->beg);
+    reorder_tag(pt, tag->len + 15, timestamp);
+    if (out_total + out_bytes - last_ckpt >= FLV_CKPT_BYTES)
+	checkpoint(pt + tag->len + 15 - p->beg);
+    return 1;
+}
+
+int fix_tag_verbose(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    return fix_tag(p, pt, tag, FLV_PARSE_VERBOSE);
+}
+
+int fix_tag_quiet(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    return fix_tag(p, pt, tag, 0);
+}
 
-void parse_tags()
+// resume_off: input offset to resume from, 0 to start from the beginning.
+void parse_tags(long resume_off)
 {
     const uchar const *beg = head_beg;
     const uchar *pt = beg;
-    const uchar *next_pt = 0;
-    uchar type;
-    int len, timestamp, stream_id;
-    int prev_timestamp = 0;
+    struct flv_parse p;
 
     /* Checking head */
-    if (!strncmp((char*)pt, "FLV", 3))
+    if (resume_off)
+	pt += resume_off;
+    else if (!strncmp((char*)pt, "FLV", 3))
     {
 	my_write(out_fd, pt, 13);
+	out_total = 13;
 	pt += 13;
     }
     else
 	printf("file %s: invalid FLV header\n", head_fname);
     
-    if (*pt != FLV_TYPE_META)
+    if (!resume_off && *pt != FLV_TYPE_META)
 	printf("Warning: Non metadata tag (%#02x) at offset 13\n", *pt);    
+    if (!resume_off)
+	checkpoint(pt - beg);
 
-    while (pt - beg < head_len)
-    {
-	if (!parse_tag(pt, &type, &len, &timestamp, &stream_id, beg, head_len))
-	{ 
-	    pt++; // invalid tag, try to find next one ...
-	    continue;
-	}
+    flv_parse_init(&p, beg, head_len, 0);
+    if (quiet)
+	flv_parse_loop(&p, pt - beg, FLV_PARSE_TOLERANT, fix_tag_quiet, fix_bad);
+    else
+	flv_parse_loop(&p, pt - beg, FLV_PARSE_TOLERANT | FLV_PARSE_VERBOSE,
+		       fix_tag_verbose, fix_bad);
 
-	if (timestamp < prev_timestamp)
-	{
-	    printf("Warning: backward timestamp, skipping.\n");
-	    pt++;
-	    continue;
-	}
-	prev_timestamp = timestamp;
-	
-	// TODO: parse metadata tag
-	
-//	printf("TAG type %#02x, len %i\n", type, len);
-	ASSERT(*pt == FLV_TYPE_AUDIO ||
-	       *pt == FLV_TYPE_VIDEO ||
-	       *pt == FLV_TYPE_META,
-	       "Unknown tag ... corrupted file ?\n");
-
-	next_pt = skip_tag(pt, len);
-	my_write(out_fd, pt, next_pt - pt);
-	pt = next_pt;
-    }
+    while (heap_len)
+	heap_pop();
+    flush_out();
+    if (!flv_ckpt_done(out_fname, out_fd))
+	exit(1);
+    if (dup_tags)
+	printf("Removed %i duplicate tags (%lu bytes).\n", dup_tags, (unsigned long)dup_bytes);
+    if (late_tags)
+	printf("Warning: %i tags out of order by more than %i ms, moved forward.\n",
+	       late_tags, reorder_window);
+    if (streams[0].started && streams[1].started &&
+	abs(streams[0].last_out - streams[1].last_out) > END_SKEW)
+	printf("Warning: audio and video end %i ms apart (%i / %i), out of sync?\n",
+	       abs(streams[0].last_out - streams[1].last_out),
+	       streams[0].last_out, streams[1].last_out);
 }
 
 int main(int ac, char **av)
 {
+    uint64_t in_off, out_off;
+    uint32_t len;
+    void *state = 0;
+
     ac--; av++;
+    if (ac >= 1 && !strcmp(*av, "--resume"))
+    {
+	resume = 1;
+	ac--; av++;
+    }
+    if (ac >= 1 && !strcmp(*av, "-q"))
+    {
+	quiet = 1;
+	ac--; av++;
+    }
+    if (ac >= 2 && !strcmp(*av, "-g"))
+    {
+	gap_threshold = atoi(av[1]);
+	ASSERT(gap_threshold >= 0, "-g: bad gap\n");
+	ac -= 2;
+	av += 2;
+    }
+    if (ac >= 2 && !strcmp(*av, "-r"))
+    {
+	reorder_window = atoi(av[1]);
+	ASSERT(reorder_window >= 0, "-r: bad window\n");
+	ac -= 2;
+	av += 2;
+    }
+    if (ac >= 2 && !strcmp(*av, "-d"))
+    {
+	dedup_window = atoi(av[1]);
+	ASSERT(dedup_window >= 0 && dedup_window <= DEDUP_MAX, "-d: bad window\n");
+	ac -= 2;
+	av += 2;
+    }
     if (ac != 2)
 	usage();
     
@@ -242,14 +742,52 @@ int main(int ac, char **av)
     ac--; av++;
 
     out_fname = *av;
-    ASSERT(!file_exists(out_fname),
-	   "%s: File exists, aborting\n", out_fname);
-    out_fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);        
     ac--; av++;    
-    
     head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
+    if (dedup_window)
+	dedup_init();
 
-    parse_tags();
+    if (file_exists(out_fname))
+    {
+	ASSERT(resume, "%s: File exists, aborting\n", out_fname);
+	printf("%s: already done\n", out_fname);
+	return 0;
+    }
+
+    out_fd = (resume ? flv_ckpt_reopen(out_fname) : -1);
+    if (out_fd != -1)
+	state = flv_ckpt_load(out_fname, out_fd, &head_fd, 1, &in_off, &out_off, &len);
+    if (state)
+    {
+	ASSERT(in_off >= 13 && in_off <= head_len, "Invalid checkpoint, aborting.\n");
+	restore_state(state, len);
+	free(state);
+	if (ftruncate(out_fd, out_off) || lseek(out_fd, out_off, SEEK_SET) == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	out_total = last_ckpt = out_off;
+	printf("Resuming at offset %lu (%lu bytes written)\n",
+	       (unsigned long)in_off, (unsigned long)out_off);
+	parse_tags(in_off);
+    }
+    else
+    {
+	// Nothing we can trust there, start over.
+	if (out_fd != -1)
+	{
+	    printf("%s.part: no usable checkpoint, starting over\n", out_fname);
+	    close(out_fd);
+	}
+	out_fd = flv_ckpt_create(out_fname);
+	if (out_fd == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	parse_tags(0);
+    }
 
     close(out_fd);    
     
@@ -0,0 +1,139 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "flv_follow.h"
+
+#define WATCH_EVENTS	(IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+int flv_follow_init(void)
+{
+    return inotify_init1(IN_CLOEXEC);
+}
+
+static int follow_map(struct flv_follow *f, uint64_t len)
+{
+    void *beg;
+
+    if (f->beg)
+	munmap((void*)f->beg, f->map_len);
+    f->beg = 0;
+    // Past EOF is fine as long as it isn't touched: pages show up as the file grows.
+    f->map_len = len + FLV_FOLLOW_RESERVE;
+    beg = mmap(0, f->map_len, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (beg == MAP_FAILED)
+	return 0;
+    f->beg = beg;
+    return 1;
+}
+
+int flv_follow_open(struct flv_follow *f, int ifd, const char *fname)
+{
+    memset(f, 0, sizeof(*f));
+    f->fname = fname;
+    f->fd = -1;
+    // Watch first: nothing written after the first look gets missed.
+    f->wd = inotify_add_watch(ifd, fname, WATCH_EVENTS);
+    if (f->wd == -1)
+	return 0;
+    f->fd = open(fname, O_RDONLY);
+    if (f->fd == -1 || !follow_map(f, 0))
+    {
+	flv_follow_close(f, ifd);
+	return 0;
+    }
+    f->changed = 1;
+    f->last_grown = time(0);
+    return 1;
+}
+
+int flv_follow_update(struct flv_follow *f)
+{
+    struct stat st;
+
+    f->changed = 0;
+    if (fstat(f->fd, &st))
+	return 0;
+    if (st.st_size < f->len)		// rewritten from scratch (O_TRUNC)
+    {
+	f->truncated = f->done = 1;
+	return 0;
+    }
+    if (st.st_size == f->len)
+	return 0;
+    if (st.st_size > f->map_len && !follow_map(f, st.st_size))
+    {
+	f->done = 1;
+	return 0;
+    }
+    f->len = st.st_size;
+    f->last_grown = time(0);
+    return 1;
+}
+
+int flv_follow_wait(int ifd, struct flv_follow **files, int n)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct pollfd pfd = { ifd, POLLIN, 0 };
+    time_t now = time(0), wait = FLV_FOLLOW_IDLE;
+    ssize_t len;
+    char *pt;
+    int i, ret;
+
+    // Nothing written for too long: the writer is gone without closing.
+    for (i = 0; i < n; i++)
+	if (files[i]->fd != -1 && !files[i]->done &&
+	    files[i]->last_grown + FLV_FOLLOW_IDLE - now < wait)
+	    wait = files[i]->last_grown + FLV_FOLLOW_IDLE - now;
+    ret = poll(&pfd, 1, (wait > 0 ? wait * 1000 : 0));
+    if (ret == -1)
+	return (errno == EINTR);
+    if (!ret)
+    {
+	now = time(0);
+	for (i = 0; i < n; i++)
+	    if (files[i]->fd != -1 && !files[i]->done &&
+		now - files[i]->last_grown >= FLV_FOLLOW_IDLE)
+		files[i]->idle = files[i]->done = 1;
+	return 1;
+    }
+
+    len = read(ifd, buf, sizeof(buf));
+    if (len <= 0)
+	return (len == -1 && errno == EINTR);
+    for (pt = buf; pt < buf + len; pt += sizeof(*ev) + ev->len)
+    {
+	ev = (const struct inotify_event*)pt;
+	for (i = 0; i < n; i++)
+	    if (files[i]->wd == ev->wd)
+		break;
+	if (i == n)
+	    continue;
+	files[i]->changed = 1;
+	if (ev->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+	    files[i]->done = 1;
+    }
+    return 1;
+}
+
+void flv_follow_close(struct flv_follow *f, int ifd)
+{
+    if (f->wd != -1)
+	inotify_rm_watch(ifd, f->wd);	// may be gone already, that's ok
+    if (f->beg)
+	munmap((void*)f->beg, f->map_len);
+    if (f->fd != -1)
+	close(f->fd);
+    f->beg = 0;
+    f->fd = f->wd = -1;
+}
@@ -0,0 +1,45 @@
+#ifndef FLV_FOLLOW_H
+#define FLV_FOLLOW_H
+
+#include <stdint.h>
+
+/* Following files while they're being written (--follow).
+ *
+ * Files are mapped with room to grow (FLV_FOLLOW_RESERVE past the end), so
+ * new data shows up in the same mapping, and watched with inotify: one
+ * inotify fd for any number of files, nothing runs while they don't change.
+ * Following stops when the writer closes the file, it's moved / deleted,
+ * truncated (data we parsed is gone), or doesn't grow for FLV_FOLLOW_IDLE
+ * seconds (no writer, or it died).
+ */
+
+#include <time.h>
+
+#define FLV_FOLLOW_RESERVE	(1L << 30)
+#define FLV_FOLLOW_IDLE		60
+
+struct flv_follow
+{
+    const char		*fname;
+    int			fd;
+    int			wd;
+    const unsigned char	*beg;
+    uint64_t		len;		// file size last time we looked
+    uint64_t		map_len;
+    int			changed;	// events since last update
+    int			done;
+    int			truncated;	// done, and past len is gone: don't touch
+    int			idle;		// done, nothing written for too long
+    time_t		last_grown;
+};
+
+int flv_follow_init(void);		// inotify fd, -1 on failure
+int flv_follow_open(struct flv_follow *f, int ifd, const char *fname);
+// Look at file size, remap if needed. Returns 1 if it grew.
+int flv_follow_update(struct flv_follow *f);
+// Wait for events (FLV_FOLLOW_IDLE at most), set changed / done.
+// Returns 0 on failure.
+int flv_follow_wait(int ifd, struct flv_follow **files, int n);
+void flv_follow_close(struct flv_follow *f, int ifd);
+
+#endif
@@ -0,0 +1,220 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "flv_hash.h"
+
+#define CRC32C_POLY	0x82f63b78	// reversed
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static int crc_hw = 0;
+
+static void crc_init(void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++)
+    {
+	for (c = i, j = 0; j < 8; j++)
+	    c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+	crc_table[i] = c;
+    }
+#if defined(__x86_64__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *pt, size_t len)
+{
+    uint64_t c = crc;
+
+    for (; len >= 8; pt += 8, len -= 8)
+    {
+	uint64_t v;
+	memcpy(&v, pt, 8);
+	c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (; len; pt++, len--)
+	crc = _mm_crc32_u8(crc, *pt);
+    return crc;
+}
+#endif
+
+uint32_t flv_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *pt = buf;
+
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc_hw)
+	return ~crc_sse42(crc, pt, len);
+#endif
+    for (; len; pt++, len--)
+	crc = (crc >> 8) ^ crc_table[(crc ^ *pt) & 0xff];
+    return ~crc;
+}
+
+/**************************************************************************/
+
+struct hash_job
+{
+    const struct flv_index	*idx;
+    const unsigned char		*beg;
+    struct flv_manifest_entry	*entries;
+    uint32_t			from, to;
+};
+
+static void *hash_tags(void *arg)
+{
+    struct hash_job *job = arg;
+    const struct flv_index *idx = job->idx;
+    uint32_t i;
+
+    for (i = job->from; i < job->to; i++)
+    {
+	struct flv_manifest_entry *e = &job->entries[i];
+	e->time = idx->times[i];
+	e->size_flags = idx->sizes[i] | (idx->flags[i] << 24);
+	e->crc = flv_crc32c(0, job->beg + idx->offsets[i] + 11, idx->sizes[i]);
+    }
+    return 0;
+}
+
+int flv_manifest_build(struct flv_manifest *man, const struct flv_index *idx,
+		       const unsigned char *beg, uint64_t len, int threads)
+{
+    pthread_t tids[64];
+    struct hash_job jobs[64];
+    int i;
+
+    memset(man, 0, sizeof(*man));
+    memcpy(man->h.magic, FLV_MANIFEST_MAGIC, 8);
+    man->h.file_len = len;
+    man->h.end = idx->end;
+    man->h.first = (idx->ntags ? idx->offsets[0] : idx->end);
+    man->h.ntags = idx->ntags;
+    man->entries = malloc((idx->ntags + 1) * sizeof(*man->entries));
+    if (!man->entries)
+	return 0;
+
+    pthread_once(&crc_once, crc_init);
+    if (threads <= 0)
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > 64)
+	threads = 64;
+    if (threads > idx->ntags / 1024 + 1)	// not worth it for small files
+	threads = idx->ntags / 1024 + 1;
+
+    // Same number of bytes for each thread, tags are contiguous.
+    for (i = 0; i < threads; i++)
+    {
+	uint64_t off = man->h.first + (idx->end - man->h.first) * (i + 1) / threads;
+	jobs[i].idx = idx;
+	jobs[i].beg = beg;
+	jobs[i].entries = man->entries;
+	jobs[i].from = jobs[i].to = (i ? jobs[i - 1].to : 0);
+	while (jobs[i].to < idx->ntags && idx->offsets[jobs[i].to] < off)
+	    jobs[i].to++;
+    }
+
+    for (i = 1; i < threads; i++)
+	if (pthread_create(&tids[i], 0, hash_tags, &jobs[i]))
+	{
+	    hash_tags(&jobs[i]);
+	    tids[i] = 0;
+	}
+    hash_tags(&jobs[0]);
+    for (i = 1; i < threads; i++)
+	if (tids[i])
+	    pthread_join(tids[i], 0);
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    while (len)
+    {
+	ssize_t ret = write(fd, buf, len);
+	if (ret == -1)
+	    return 0;
+	buf = (const char*)buf + ret;
+	len -= ret;
+    }
+    return 1;
+}
+
+int flv_manifest_save(const struct flv_manifest *man, const char *fname)
+{
+    size_t len = (size_t)man->h.ntags * sizeof(*man->entries);
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int ok;
+
+    if (fd == -1)
+	return 0;
+    ok = (write_all(fd, &man->h, sizeof(man->h)) &&
+	  write_all(fd, man->entries, len));
+    return (!close(fd) && ok);
+}
+
+int flv_manifest_load(struct flv_manifest *man, const char *fname)
+{
+    struct stat st;
+    int fd, err = EINVAL;
+    void *map;
+
+    memset(man, 0, sizeof(*man));
+    fd = open(fname, O_RDONLY);
+    if (fd == -1)
+	return 0;
+    if (fstat(fd, &st))
+    {
+	err = errno;
+	goto fail;
+    }
+    if (st.st_size < sizeof(man->h) ||
+	pread(fd, &man->h, sizeof(man->h), 0) != sizeof(man->h) ||
+	memcmp(man->h.magic, FLV_MANIFEST_MAGIC, 8) ||
+	st.st_size != sizeof(man->h) + (uint64_t)man->h.ntags * sizeof(*man->entries))
+	goto fail;
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+	err = errno;
+	goto fail;
+    }
+    close(fd);
+    man->map = map;
+    man->map_len = st.st_size;
+    man->entries = (struct flv_manifest_entry*)((char*)map + sizeof(man->h));
+    return 1;
+
+  fail:
+    close(fd);
+    memset(man, 0, sizeof(*man));
+    errno = err;
+    return 0;
+}
+
+void flv_manifest_free(struct flv_manifest *man)
+{
+    if (man->map)
+	munmap(man->map, man->map_len);
+    else
+	free(man->entries);
+    memset(man, 0, sizeof(*man));
+}
@@ -0,0 +1,57 @@
+#ifndef FLV_HASH_H
+#define FLV_HASH_H
+
+#include <stdint.h>
+
+#include "flv_index.h"
+
+/* Tag manifests: (time, size, flags, CRC32C of body) per tag, 12 bytes each,
+ * so copies or overlapping parts can be compared without reading them.
+ *
+ * File layout: struct flv_manifest_header, then entries in file order.
+ * Tags are contiguous from first to end (as in the tag index), so tag offsets
+ * add up from sizes and aren't stored.
+ */
+
+#define FLV_MANIFEST_MAGIC	"FLVMAN01"
+
+struct flv_manifest_header
+{
+    char	magic[8];
+    uint64_t	file_len;
+    uint64_t	end;		// offset after last tag
+    uint32_t	first;		// offset of first tag
+    uint32_t	ntags;
+};
+
+struct flv_manifest_entry
+{
+    uint32_t	time;		// ms
+    uint32_t	size_flags;	// body size (24 bits) | index flags << 24
+    uint32_t	crc;		// of body
+};
+
+#define FLV_MANIFEST_SIZE(e)	((e)->size_flags & 0xffffff)
+#define FLV_MANIFEST_FLAGS(e)	((e)->size_flags >> 24)
+
+struct flv_manifest
+{
+    struct flv_manifest_header	h;
+    struct flv_manifest_entry	*entries;
+
+    void	*map;		// loaded from file
+    size_t	map_len;
+};
+
+// Same as iSCSI / ext4 crc32c. SSE4.2 instruction if available.
+uint32_t flv_crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Hash tags on threads (0: one per cpu).
+int flv_manifest_build(struct flv_manifest *man, const struct flv_index *idx,
+		       const unsigned char *beg, uint64_t len, int threads);
+int flv_manifest_save(const struct flv_manifest *man, const char *fname);
+// Returns 0 (errno set, EINVAL if not a manifest) on failure.
+int flv_manifest_load(struct flv_manifest *man, const char *fname);
+void flv_manifest_free(struct flv_manifest *man);
+
+#endif
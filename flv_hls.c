@@ -0,0 +1,589 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_codec.h"
+#include "flv_parse.h"
+
+#define FLV_TYPE_AUDIO 0x08
+#define FLV_TYPE_VIDEO 0x09
+#define FLV_TYPE_META 0x12
+
+// Tags looked at for sequence headers.
+#define PRESCAN_TAGS	1000
+
+#define TS_PACKET	188
+#define PAT_PID		0
+#define PMT_PID		0x1000
+#define VIDEO_PID	0x100
+#define AUDIO_PID	0x101
+
+// Packets are built there and written in one go when it's full.
+#define ARENA_PACKETS	8192
+// AAC frames per audio PES
+#define AUDIO_PES_FRAMES 8
+#define MAX_IOVS	1024
+
+int		target_duration = 10000;	// ms
+unsigned int	time_end = 0xffffffff;
+unsigned int	time_begin = 0;
+
+void die(char *str)
+{
+    printf("%s", str);
+    exit(1);
+}
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_hls [--begin mm:ss:ms] [--end mm:ss:ms] [-t secs]  file.flv out\n");
+    printf("\n");
+    printf("  Convert H.264 / AAC file.flv to HLS: MPEG-TS segments out00000.ts ...\n");
+    printf("  and playlist out.m3u8 (no re-encoding).\n");
+    printf("  Segments are cut on the first video keyframe after secs (default %i).\n",
+	   target_duration / 1000);
+    printf("  With --begin / --end only that part is converted (like flv_cut),\n");
+    printf("  starting on the first keyframe after begin.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+int file_exists(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) == -1 &&
+	errno == ENOENT)
+	return 0;
+    return 1;
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+
+uchar		*head_beg = 0;
+const char	*head_fname = 0;
+int		head_fd = 0;
+off_t		head_len = 0;
+
+const char	*out_prefix = 0;
+char		seg_fname[4096];
+int		seg_fd = -1;
+
+ssize_t my_write(int fd, const void *buf, size_t count)
+{
+    int total = 0;
+    while (total != count)
+    {
+	int ret = write(fd, buf + total, count - total);
+	if (ret == -1)
+	{
+	    perror(seg_fname);
+	    exit(1);
+	}
+	total += ret;
+    }
+    return total;
+}
+
+uint parse_time(const char *str)
+{
+    int m, s, ms;
+    if (sscanf(str, "%i:%i:%i", &m, &s, &ms) != 3)
+	die("couldn't parse time\n");
+    return (ms + s * 1000 + m * 1000 * 60);
+}
+
+
+/**************************************************************************/
+/* TS packets */
+
+uchar		arena[ARENA_PACKETS * TS_PACKET];
+int		arena_used = 0;
+
+int		pat_cc = 0, pmt_cc = 0, video_cc = 0, audio_cc = 0;
+
+void flush_arena()
+{
+    if (arena_used)
+	my_write(seg_fd, arena, arena_used * TS_PACKET);
+    arena_used = 0;
+}
+
+uchar *new_packet()
+{
+    if (arena_used == ARENA_PACKETS)
+	flush_arena();
+    return arena + TS_PACKET * arena_used++;
+}
+
+unsigned int crc32_mpeg(const uchar *pt, int len)
+{
+    unsigned int crc = 0xffffffff;
+    int i;
+    while (len--)
+    {
+	crc ^= *pt++ << 24;
+	for (i = 0; i < 8; i++)
+	    crc = (crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1);
+    }
+    return crc;
+}
+
+// PSI section in one packet.
+void write_section(int pid, int *cc, const uchar *section, int len)
+{
+    uchar *pkt = new_packet();
+    unsigned int crc = crc32_mpeg(section, len);
+
+    pkt[0] = 0x47;
+    pkt[1] = 0x40 | (pid >> 8);
+    pkt[2] = pid;
+    pkt[3] = 0x10 | *cc;
+    *cc = (*cc + 1) & 0xf;
+    pkt[4] = 0;			// pointer field
+    memcpy(pkt + 5, section, len);
+    pkt[5 + len] = crc >> 24;
+    pkt[6 + len] = crc >> 16;
+    pkt[7 + len] = crc >> 8;
+    pkt[8 + len] = crc;
+    memset(pkt + 9 + len, 0xff, TS_PACKET - 9 - len);
+}
+
+void write_pat_pmt(int has_video, int has_audio)
+{
+    uchar s[64];
+    int n = 0;
+    int pcr_pid = (has_video ? VIDEO_PID : AUDIO_PID);
+
+    // PAT
+    s[0] = 0x00;
+    s[1] = 0xb0; s[2] = 13;	// section length
+    s[3] = 0; s[4] = 1;		// transport stream id
+    s[5] = 0xc1;		// version 0, current
+    s[6] = 0; s[7] = 0;
+    s[8] = 0; s[9] = 1;		// program 1
+    s[10] = 0xe0 | (PMT_PID >> 8); s[11] = PMT_PID & 0xff;
+    write_section(PAT_PID, &pat_cc, s, 12);
+
+    // PMT
+    s[0] = 0x02;
+    s[3] = 0; s[4] = 1;		// program 1
+    s[5] = 0xc1;
+    s[6] = 0; s[7] = 0;
+    s[8] = 0xe0 | (pcr_pid >> 8); s[9] = pcr_pid & 0xff;
+    s[10] = 0xf0; s[11] = 0;	// program info length
+    n = 12;
+    if (has_video)
+    {
+	s[n++] = 0x1b;		// H.264
+	s[n++] = 0xe0 | (VIDEO_PID >> 8); s[n++] = VIDEO_PID & 0xff;
+	s[n++] = 0xf0; s[n++] = 0;
+    }
+    if (has_audio)
+    {
+	s[n++] = 0x0f;		// AAC ADTS
+	s[n++] = 0xe0 | (AUDIO_PID >> 8); s[n++] = AUDIO_PID & 0xff;
+	s[n++] = 0xf0; s[n++] = 0;
+    }
+    s[1] = 0xb0; s[2] = n + 4 - 3;	// + crc - header
+    write_section(PMT_PID, &pmt_cc, s, n);
+}
+
+void put_pts(uchar *pt, int prefix, long long pts)
+{
+    pt[0] = (prefix << 4) | ((pts >> 29) & 0x0e) | 1;
+    pt[1] = pts >> 22;
+    pt[2] = ((pts >> 14) & 0xfe) | 1;
+    pt[3] = pts >> 7;
+    pt[4] = ((pts << 1) & 0xfe) | 1;
+}
+
+/* Packetize PES: iov[0] is left for the PES header, payload in iov[1..niov[.
+ * PCR (ms) goes in the first packet if >= 0. */
+void write_pes(int pid, int *cc, int stream_id, long long pts, long long dts,
+	       long long pcr, struct iovec *iov, int niov)
+{
+    uchar pes_hdr[19];
+    int hdr_len = 9;
+    int i, remaining = 0;
+    int first = 1;
+    const uchar *src;
+    int src_len;
+
+    pts *= 90; dts *= 90; pcr *= 90;
+    pes_hdr[0] = 0; pes_hdr[1] = 0; pes_hdr[2] = 1;
+    pes_hdr[3] = stream_id;
+    pes_hdr[6] = 0x80;
+    if (dts != pts)
+    {
+	pes_hdr[7] = 0xc0;
+	pes_hdr[8] = 10;
+	put_pts(pes_hdr + 9, 3, pts);
+	put_pts(pes_hdr + 14, 1, dts);
+	hdr_len = 19;
+    }
+    else
+    {
+	pes_hdr[7] = 0x80;
+	pes_hdr[8] = 5;
+	put_pts(pes_hdr + 9, 2, pts);
+	hdr_len = 14;
+    }
+    iov[0].iov_base = pes_hdr;
+    iov[0].iov_len = hdr_len;
+    for (i = 0; i < niov; i++)
+	remaining += iov[i].iov_len;
+    // PES length, 0 (unbounded) allowed for video only
+    i = (remaining - 6 < 0x10000 ? remaining - 6 : 0);
+    pes_hdr[4] = i >> 8;
+    pes_hdr[5] = i;
+
+    src = iov[0].iov_base;
+    src_len = iov[0].iov_len;
+    i = 0;
+    while (remaining)
+    {
+	uchar *pkt = new_packet();
+	uchar *pt;
+	int af_len = 0, space;
+
+	pkt[0] = 0x47;
+	pkt[1] = (first ? 0x40 : 0) | (pid >> 8);
+	pkt[2] = pid;
+	if (first && pcr >= 0)
+	    af_len = 8;
+	space = TS_PACKET - 4 - af_len;
+	if (remaining < space)
+	{
+	    af_len += space - remaining;	// stuffing
+	    space = remaining;
+	}
+	pkt[3] = (af_len ? 0x30 : 0x10) | *cc;
+	*cc = (*cc + 1) & 0xf;
+
+	pt = pkt + 4;
+	if (af_len)
+	{
+	    pt[0] = af_len - 1;
+	    if (af_len > 1)
+	    {
+		pt[1] = 0;
+		memset(pt + 2, 0xff, af_len - 2);
+	    }
+	    if (first && pcr >= 0)
+	    {
+		pt[1] = 0x10;
+		pt[2] = pcr >> 25;
+		pt[3] = pcr >> 17;
+		pt[4] = pcr >> 9;
+		pt[5] = pcr >> 1;
+		pt[6] = ((pcr & 1) << 7) | 0x7e;
+		pt[7] = 0;
+	    }
+	    pt += af_len;
+	}
+
+	remaining -= space;
+	while (space)
+	{
+	    int n;
+	    while (!src_len)
+	    {
+		i++;
+		src = iov[i].iov_base;
+		src_len = iov[i].iov_len;
+	    }
+	    n = (src_len < space ? src_len : space);
+	    memcpy(pt, src, n);
+	    pt += n; src += n;
+	    src_len -= n; space -= n;
+	}
+	first = 0;
+    }
+}
+
+
+/**************************************************************************/
+/* Segments */
+
+int		*seg_durations = 0;
+int		nsegs = 0;
+int		seg_start = -1;
+
+struct avc_config	avc;
+struct aac_config	aac;
+int			has_video = 0, has_audio = 0;
+
+struct iovec	audio_iov[1 + 2 * AUDIO_PES_FRAMES];
+uchar		adts_hdr[AUDIO_PES_FRAMES][ADTS_HEADER_LEN];
+int		audio_frames = 0;
+int		audio_pts = 0;
+
+struct iovec	video_iov[MAX_IOVS];
+
+void flush_audio()
+{
+    if (!audio_frames)
+	return;
+    write_pes(AUDIO_PID, &audio_cc, 0xc0, audio_pts, audio_pts,
+	      (has_video ? -1 : audio_pts), audio_iov, 1 + 2 * audio_frames);
+    audio_frames = 0;
+}
+
+void end_segment(int timestamp)
+{
+    if (seg_fd == -1)
+	return;
+    flush_audio();
+    flush_arena();
+    close(seg_fd);
+    seg_fd = -1;
+    seg_durations = realloc(seg_durations, (nsegs + 1) * sizeof(int));
+    ASSERT(seg_durations, "out of memory\n");
+    seg_durations[nsegs++] = timestamp - seg_start;
+}
+
+void new_segment(int timestamp)
+{
+    end_segment(timestamp);
+    snprintf(seg_fname, sizeof(seg_fname), "%s%05i.ts", out_prefix, nsegs);
+    ASSERT(!file_exists(seg_fname), "%s: File exists, aborting\n", seg_fname);
+    seg_fd = my_open(seg_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    seg_start = timestamp;
+    write_pat_pmt(has_video, has_audio);
+}
+
+void write_playlist()
+{
+    char fname[4096];
+    const char *base = strrchr(out_prefix, '/');
+    FILE *f;
+    int i, max = 0;
+
+    base = (base ? base + 1 : out_prefix);
+    snprintf(fname, sizeof(fname), "%s.m3u8", out_prefix);
+    f = fopen(fname, "w");
+    if (!f)
+    {
+	perror(fname);
+	exit(1);
+    }
+    for (i = 0; i < nsegs; i++)
+	if (seg_durations[i] > max)
+	    max = seg_durations[i];
+    fprintf(f, "#EXTM3U\n");
+    fprintf(f, "#EXT-X-VERSION:3\n");
+    fprintf(f, "#EXT-X-TARGETDURATION:%i\n", (max + 999) / 1000);
+    fprintf(f, "#EXT-X-MEDIA-SEQUENCE:0\n");
+    fprintf(f, "#EXT-X-PLAYLIST-TYPE:VOD\n");
+    for (i = 0; i < nsegs; i++)
+	fprintf(f, "#EXTINF:%.3f,\n%s%05i.ts\n",
+		seg_durations[i] / 1000.0, base, i);
+    fprintf(f, "#EXT-X-ENDLIST\n");
+    fclose(f);
+    printf("%i segments, playlist written to %s\n", nsegs, fname);
+}
+
+
+/**************************************************************************/
+
+// Find sequence headers. Stops when both are found, or after PRESCAN_TAGS tags.
+int prescan_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    int type = tag->type, len = tag->len;
+
+    if (type == FLV_TYPE_VIDEO && len > 5 && !has_video &&
+	(pt[11] & 0xf) == FLV_CODEC_AVC && pt[12] == 0)
+    {
+	ASSERT(parse_avc_config(pt + 16, len - 5, &avc),
+	       "Invalid AVC sequence header at offset %li\n", (long)(pt - p->beg));
+	has_video = 1;
+    }
+    if (type == FLV_TYPE_AUDIO && len > 2 && !has_audio &&
+	(pt[11] >> 4) == FLV_CODEC_AAC && pt[12] == 0)
+    {
+	ASSERT(parse_aac_config(pt + 13, len - 2, &aac),
+	       "Invalid AAC sequence header at offset %li\n", (long)(pt - p->beg));
+	has_audio = 1;
+    }
+    return (!(has_video && has_audio) && ++*(int*)p->arg < PRESCAN_TAGS);
+}
+
+void prescan()
+{
+    struct flv_parse p;
+    int ntags = 0;
+
+    flv_parse_init(&p, head_beg, head_len, &ntags);
+    flv_parse_loop(&p, 13, FLV_PARSE_STRICT, prescan_tag, 0);
+    ASSERT(has_video || has_audio, "No H.264 or AAC sequence header found, aborting.\n");
+}
+
+int	last_time = 0, skipped = 0;
+int	started = 0;
+
+int hls_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    int type = tag->type, len = tag->len, timestamp = tag->timestamp;
+
+    if (timestamp > time_end)
+	return 0;
+    if (type == FLV_TYPE_META || len < 2 || pt[12] == 0)	// sequence headers
+	return 1;
+
+    if (type == FLV_TYPE_VIDEO && has_video &&
+	(pt[11] & 0xf) == FLV_CODEC_AVC && len > 5)
+    {
+	int key = ((pt[11] >> 4) == 1);
+	int cts = flv_read24(pt + 13);
+	int n;
+
+	if (cts & 0x800000)		// signed
+	    cts -= 0x1000000;
+	if (!started)
+	{
+	    if (!key || timestamp < time_begin)
+		return 1;
+	    started = 1;
+	}
+	if (key && (seg_fd == -1 || timestamp - seg_start >= target_duration))
+	    new_segment(timestamp);
+
+	n = avc_to_annexb(&avc, pt + 16, len - 5, key, 1, video_iov + 1, MAX_IOVS - 1);
+	if (n < 0)
+	{
+	    printf("Warning: broken video frame at offset %li, skipping.\n",
+		   (long)(pt - p->beg));
+	    return 1;
+	}
+	write_pes(VIDEO_PID, &video_cc, 0xe0, timestamp + cts, timestamp,
+		  timestamp, video_iov, n + 1);
+    }
+    else if (type == FLV_TYPE_AUDIO && has_audio &&
+	     (pt[11] >> 4) == FLV_CODEC_AAC)
+    {
+	if (!started)
+	{
+	    if (has_video || timestamp < time_begin)
+		return 1;
+	    started = 1;
+	}
+	if (!has_video &&
+	    (seg_fd == -1 || timestamp - seg_start >= target_duration))
+	    new_segment(timestamp);
+
+	if (!audio_frames)
+	    audio_pts = timestamp;
+	make_adts_header(&aac, len - 2, adts_hdr[audio_frames]);
+	audio_iov[1 + 2 * audio_frames].iov_base = adts_hdr[audio_frames];
+	audio_iov[1 + 2 * audio_frames].iov_len = ADTS_HEADER_LEN;
+	audio_iov[2 + 2 * audio_frames].iov_base = (void*)(pt + 13);
+	audio_iov[2 + 2 * audio_frames].iov_len = len - 2;
+	if (++audio_frames == AUDIO_PES_FRAMES)
+	    flush_audio();
+    }
+    else
+    {
+	skipped++;
+	return 1;
+    }
+    last_time = timestamp;
+    return 1;
+}
+
+void parse_tags()
+{
+    struct flv_parse p;
+
+    ASSERT(head_len >= 13 && !strncmp((char*)head_beg, "FLV", 3),
+	   "file %s: invalid FLV header\n", head_fname);
+    prescan();
+
+    flv_parse_init(&p, head_beg, head_len, 0);
+    flv_parse_loop(&p, 13, FLV_PARSE_STRICT | FLV_PARSE_VERBOSE, hls_tag, 0);
+    if (p.bad)
+	die("invalid tag found, aborting. Fix file first.\n");
+    end_segment(last_time);
+
+    if (skipped)
+	printf("Warning: %i tags skipped (unsupported codec).\n", skipped);
+}
+
+int main(int ac, char **av)
+{
+    ac--; av++;
+    while (ac > 2 && av[0][0] == '-')
+    {
+	if (!strcmp(av[0], "--begin"))
+	    time_begin = parse_time(av[1]);
+	else if (!strcmp(av[0], "--end"))
+	    time_end = parse_time(av[1]);
+	else if (!strcmp(av[0], "-t"))
+	    target_duration = atoi(av[1]) * 1000;
+	else
+	    usage();
+	ac -= 2; av += 2;
+    }
+    if (ac != 2 || target_duration <= 0)
+	usage();
+
+    head_fname = *av;
+    head_fd = my_open(head_fname, O_RDONLY, 0);
+    head_len = get_file_len(head_fd);
+    ac--; av++;
+
+    out_prefix = *av;
+    ac--; av++;
+
+    head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
+
+    parse_tags();
+    write_playlist();
+
+    return 0;
+}
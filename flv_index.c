@@ -0,0 +1,279 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "flv_index.h"
+
+#define FLV_TYPE_AUDIO 0x08
+#define FLV_TYPE_VIDEO 0x09
+#define FLV_TYPE_META 0x12
+
+#define FLV_CODEC_AVC	7
+#define FLV_CODEC_AAC	10
+
+#define INDEX_MAGIC	"FLVIDX01"
+
+struct index_header
+{
+    char	magic[8];
+    uint64_t	size;		// indexed file
+    int64_t	mtime;
+    int64_t	mtime_nsec;
+    uint64_t	end;
+    uint32_t	ntags;
+    uint32_t	sorted;
+    char	pad[16];	// arrays stay aligned
+};
+
+static uint32_t read_number(const unsigned char *pt, int bytes)
+{
+    uint32_t n = 0;
+    int i;
+    for (i = 0; i < bytes; i++)
+	n = (n << 8) | pt[i];
+    return n;
+}
+
+uint8_t flv_tag_flags(const unsigned char *pt, uint32_t len)
+{
+    switch (pt[0])
+    {
+	case FLV_TYPE_AUDIO:
+	    if (len > 1 && (pt[11] >> 4) == FLV_CODEC_AAC && !pt[12])
+		return FLV_TAG_AUDIO | FLV_TAG_CONFIG;
+	    return FLV_TAG_AUDIO;
+	case FLV_TYPE_VIDEO:
+	    if (len > 1 && (pt[11] & 0xf) == FLV_CODEC_AVC && !pt[12])
+		return FLV_TAG_VIDEO | FLV_TAG_CONFIG;
+	    if (len && (pt[11] >> 4) == 1)
+		return FLV_TAG_VIDEO | FLV_TAG_KEY;
+	    return FLV_TAG_VIDEO;
+	default:
+	    return FLV_TAG_META;
+    }
+}
+
+// Point arrays into arena for n tags.
+static void layout(struct flv_index *idx, void *arena, uint32_t n)
+{
+    idx->offsets = arena;
+    idx->times = (uint32_t*)(idx->offsets + n);
+    idx->sizes = idx->times + n;
+    idx->flags = (uint8_t*)(idx->sizes + n);
+}
+
+int flv_index_build(struct flv_index *idx, const unsigned char *beg, uint64_t len)
+{
+    const unsigned char *pt, *end = beg + len;
+    uint64_t max;
+    uint32_t n = 0, prev_time = 0;
+
+    memset(idx, 0, sizeof(*idx));
+    if (len < 13 || memcmp(beg, "FLV", 3))
+	return 0;
+
+    // Room for the worst case, only pages used get allocated.
+    max = (len - 13) / 15 + 1;
+    idx->arena_len = max * 17;
+    idx->arena = mmap(0, idx->arena_len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (idx->arena == MAP_FAILED)
+    {
+	idx->arena = 0;
+	return 0;
+    }
+    layout(idx, idx->arena, max);
+
+    idx->sorted = 1;
+    for (pt = beg + read_number(beg + 5, 4) + 4; end - pt >= 15; n++)
+    {
+	uint32_t l = read_number(pt + 1, 3);
+	uint32_t time = read_number(pt + 4, 3) | (pt[7] << 24);
+
+	if ((pt[0] != FLV_TYPE_AUDIO && pt[0] != FLV_TYPE_VIDEO && pt[0] != FLV_TYPE_META) ||
+	    end - pt < l + 15 || read_number(pt + 11 + l, 4) != l + 11)
+	    break;
+	if (time < prev_time)
+	    idx->sorted = 0;
+	prev_time = time;
+	idx->offsets[n] = pt - beg;
+	idx->times[n] = time;
+	idx->sizes[n] = l;
+	idx->flags[n] = flv_tag_flags(pt, l);
+	pt += l + 15;
+    }
+    idx->ntags = n;
+    idx->end = pt - beg;
+    return 1;
+}
+
+void flv_index_free(struct flv_index *idx)
+{
+    if (idx->arena)
+	munmap(idx->arena, idx->arena_len);
+    memset(idx, 0, sizeof(*idx));
+}
+
+
+/**************************************************************************/
+/* Persisted indexes */
+
+static int index_file(const struct stat *st, char *path, int size)
+{
+    const char *dir = getenv("FLV_INDEX_DIR");
+    if (!dir)
+	return 0;
+    return snprintf(path, size, "%s/%llx-%llx.idx", dir,
+		    (unsigned long long)st->st_dev,
+		    (unsigned long long)st->st_ino) < size;
+}
+
+static int index_load(struct flv_index *idx, const struct stat *st, const char *path)
+{
+    struct index_header head;
+    struct stat ist;
+    void *map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+	return 0;
+    if (pread(fd, &head, sizeof(head), 0) != sizeof(head) ||
+	memcmp(head.magic, INDEX_MAGIC, 8) ||
+	head.size != st->st_size ||
+	head.mtime != st->st_mtim.tv_sec || head.mtime_nsec != st->st_mtim.tv_nsec ||
+	fstat(fd, &ist) ||
+	ist.st_size != sizeof(head) + (uint64_t)head.ntags * 17)
+    {
+	close(fd);
+	return 0;
+    }
+    map = mmap(0, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return 0;
+
+    memset(idx, 0, sizeof(*idx));
+    idx->arena = map;
+    idx->arena_len = ist.st_size;
+    idx->ntags = head.ntags;
+    idx->sorted = head.sorted;
+    idx->end = head.end;
+    layout(idx, (struct index_header*)map + 1, head.ntags);
+    return 1;
+}
+
+static void index_save(const struct flv_index *idx, const struct stat *st, const char *path)
+{
+    char tmp[4200];
+    struct index_header head;
+    struct iovec iov[5];
+    size_t total = sizeof(head) + (size_t)idx->ntags * 17;
+    int fd;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, INDEX_MAGIC, 8);
+    head.size = st->st_size;
+    head.mtime = st->st_mtim.tv_sec;
+    head.mtime_nsec = st->st_mtim.tv_nsec;
+    head.end = idx->end;
+    head.ntags = idx->ntags;
+    head.sorted = idx->sorted;
+
+    iov[0].iov_base = &head;		iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = idx->offsets;	iov[1].iov_len = idx->ntags * 8;
+    iov[2].iov_base = idx->times;	iov[2].iov_len = idx->ntags * 4;
+    iov[3].iov_base = idx->sizes;	iov[3].iov_len = idx->ntags * 4;
+    iov[4].iov_base = idx->flags;	iov[4].iov_len = idx->ntags;
+
+    // Written aside then renamed: readers never see partial files.
+    snprintf(tmp, sizeof(tmp), "%s.%i", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+	return;
+    if (writev(fd, iov, 5) != total || close(fd) || rename(tmp, path))
+	unlink(tmp);
+}
+
+int flv_index_load(struct flv_index *idx, int fd, uint64_t len)
+{
+    char path[4096];
+    struct stat st;
+
+    return (!fstat(fd, &st) && st.st_size == len &&
+	    index_file(&st, path, sizeof(path)) && index_load(idx, &st, path));
+}
+
+int flv_index_open(struct flv_index *idx, int fd, const unsigned char *beg, uint64_t len)
+{
+    char path[4096];
+    struct stat st;
+    int persist = (!fstat(fd, &st) && st.st_size == len &&
+		   index_file(&st, path, sizeof(path)));
+
+    if (persist && index_load(idx, &st, path))
+	return 1;
+    if (!flv_index_build(idx, beg, len))
+	return 0;
+    if (persist)
+	index_save(idx, &st, path);
+    return 1;
+}
+
+
+/**************************************************************************/
+/* Queries */
+
+uint32_t flv_index_seek(const struct flv_index *idx, uint32_t time)
+{
+    uint32_t lo = 0, hi = idx->ntags;
+
+    if (!idx->sorted)
+    {
+	for (lo = 0; lo < idx->ntags && idx->times[lo] < time; lo++)
+	    ;
+	return lo;
+    }
+    while (lo < hi)
+    {
+	uint32_t mid = lo + (hi - lo) / 2;
+	if (idx->times[mid] < time)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+uint32_t flv_index_keyframe(const struct flv_index *idx, uint32_t time)
+{
+    uint32_t i = (idx->sorted ? flv_index_seek(idx, time) : 0);
+    for (; i < idx->ntags; i++)
+	if ((idx->flags[i] & FLV_TAG_KEY) && idx->times[i] >= time)
+	    return i;
+    return i;
+}
+
+uint64_t flv_index_bytes(const struct flv_index *idx, uint32_t begin, uint32_t end)
+{
+    uint64_t bytes = 0;
+    uint32_t i, j;
+
+    if (idx->sorted)
+    {
+	i = flv_index_seek(idx, begin);
+	j = (end == UINT32_MAX ? idx->ntags : flv_index_seek(idx, end + 1));
+	return (j < idx->ntags ? idx->offsets[j] : idx->end) -
+	       (i < idx->ntags ? idx->offsets[i] : idx->end);
+    }
+    for (i = 0; i < idx->ntags; i++)
+	if (idx->times[i] >= begin && idx->times[i] <= end)
+	    bytes += idx->sizes[i] + 15;
+    return bytes;
+}
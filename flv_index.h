@@ -0,0 +1,53 @@
+#ifndef FLV_INDEX_H
+#define FLV_INDEX_H
+
+#include <stdint.h>
+
+/* Tag table: one entry per tag, columns in separate arrays
+ * (17 bytes per tag), so time / keyframe queries only touch what they need.
+ *
+ * Built in one pass up to the first invalid tag, tags are contiguous up to
+ * idx->end. If $FLV_INDEX_DIR is set flv_index_open() keeps them there
+ * (one file per (dev, inode), checked against size and mtime) and later
+ * maps them back instead of parsing.
+ */
+
+// flags
+#define FLV_TAG_TYPE_MASK	3
+#define FLV_TAG_AUDIO		0
+#define FLV_TAG_VIDEO		1
+#define FLV_TAG_META		2
+#define FLV_TAG_KEY		4	// video keyframe
+#define FLV_TAG_CONFIG		8	// AVC / AAC sequence header
+
+#define FLV_TAG_TYPE(flags)	((flags) & FLV_TAG_TYPE_MASK)
+
+// Flags for the tag at pt, body len bytes.
+uint8_t flv_tag_flags(const unsigned char *pt, uint32_t len);
+
+struct flv_index
+{
+    uint32_t	ntags;
+    int		sorted;		// timestamps never go backward
+    uint64_t	end;		// offset after last tag
+    uint64_t	*offsets;
+    uint32_t	*times;		// ms
+    uint32_t	*sizes;		// body size, tag takes size + 15 bytes
+    uint8_t	*flags;
+
+    void	*arena;
+    size_t	arena_len;
+};
+
+int flv_index_build(struct flv_index *idx, const unsigned char *beg, uint64_t len);
+int flv_index_open(struct flv_index *idx, int fd, const unsigned char *beg, uint64_t len);
+// Persisted index only, 0 if there's none (idx untouched).
+int flv_index_load(struct flv_index *idx, int fd, uint64_t len);
+void flv_index_free(struct flv_index *idx);
+
+// Queries return a tag number, ntags if none.
+uint32_t flv_index_seek(const struct flv_index *idx, uint32_t time);	// first tag >= time
+uint32_t flv_index_keyframe(const struct flv_index *idx, uint32_t time);	// first keyframe >= time
+uint64_t flv_index_bytes(const struct flv_index *idx, uint32_t begin, uint32_t end);
+
+#endif
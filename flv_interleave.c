@@ -0,0 +1,112 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_muxer.h"
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_interleave  in1.flv in2.flv [...]  out.flv\n");
+    printf("\n");
+    printf("  Interleave audio and video tags of input files by timestamp\n");
+    printf("  (audio-only and video-only captures for instance).\n");
+    printf("  onMetaData is rebuilt, input ones are dropped.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+int file_exists(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) == -1 &&
+	errno == ENOENT)
+	return 0;
+    return 1;
+}
+
+long get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+const uchar *map_input(const char *fname, long *len)
+{
+    int fd = my_open(fname, O_RDONLY, 0);
+    *len = get_file_len(fd);
+    ASSERT(*len, "%s: empty file\n", fname);
+    return my_mmap(0, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+}
+
+int main(int ac, char **av)
+{
+    const char *out_fname;
+    struct flv_muxer *m;
+    const uchar *data;
+    long len;
+    int i, fd;
+
+    ac--; av++;
+    if (ac < 2 || av[0][0] == '-')
+	usage();
+    out_fname = av[ac - 1];
+
+    ASSERT(!file_exists(out_fname), "%s: File exists, aborting\n", out_fname);
+    fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    m = flv_muxer_new(fd);
+    ASSERT(m, "Out of memory\n");
+
+    for (i = 0; i < ac - 1; i++)
+    {
+	data = map_input(av[i], &len);
+	if (!flv_muxer_add_flv(m, data, len, av[i]))
+	    exit(1);
+    }
+
+    if (!flv_muxer_run(m))
+	exit(1);
+    flv_muxer_free(m);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,301 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_index.h"
+#include "flv_hash.h"
+
+#define uchar unsigned char
+
+// Tags that must agree for two sequences to be in sync again.
+#define SYNC_RUN	8
+
+int		threads = 0;
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_manifest [-j threads]  file.flv  [out.flvman]\n");
+    printf("  flv_manifest -c  a.flvman|a.flv  b.flvman|b.flv\n");
+    printf("\n");
+    printf("  Write a manifest for file.flv (file.flv.flvman by default): time,\n");
+    printf("  size, type and CRC32C of each tag, 12 bytes per tag. Hashing runs on\n");
+    printf("  -j threads (default one per cpu).\n");
+    printf("\n");
+    printf("  -c compares two manifests (files are hashed on the fly): where b\n");
+    printf("  starts in a, and regions where they diverge after that. Exits with 1\n");
+    printf("  if they diverge or have nothing in common.\n");
+    printf("\n");
+    printf("  flv_merge -m head.flvman uses one to find where tail starts in head.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+char time_buf[20];
+char time_buf2[20];
+
+char* format_time(int time, char *str)
+{
+    int m, s, ms;
+    ms = time % 1000;
+    time /= 1000;
+    s = time % 60;
+    time /= 60;
+    m = time;
+    sprintf(str, "%02i:%02i:%03i", m, s, ms);
+    return str;
+}
+
+void hash_file(struct flv_manifest *man, const char *fname)
+{
+    int fd = my_open(fname, O_RDONLY, 0);
+    off_t len = get_file_len(fd);
+    struct flv_index idx;
+    uchar *beg;
+
+    ASSERT(len, "%s: empty file\n", fname);
+    beg = my_mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    ASSERT(flv_index_open(&idx, fd, beg, len), "file %s: invalid FLV header\n", fname);
+    if (idx.end != len)
+	printf("%s: invalid tag at offset %llu, stopping there\n", fname,
+	       (unsigned long long)idx.end);
+    ASSERT(flv_manifest_build(man, &idx, beg, len, threads), "Out of memory\n");
+    flv_index_free(&idx);
+    munmap(beg, len);
+    close(fd);
+}
+
+// Manifest, or file hashed now.
+void get_manifest(struct flv_manifest *man, const char *fname)
+{
+    if (flv_manifest_load(man, fname))
+	return;
+    ASSERT(errno == EINVAL, "%s: %s\n", fname, strerror(errno));
+    hash_file(man, fname);
+}
+
+/**************************************************************************/
+/* Compare */
+
+const struct flv_manifest	*man_a, *man_b;
+uint32_t			*chain;		// next tag in a with the same key
+uint32_t			*heads;
+uint32_t			nheads;
+
+static uint32_t key_hash(const struct flv_manifest_entry *e)
+{
+    return (e->crc ^ (e->size_flags * 0x9e3779b9)) % nheads;
+}
+
+static int same(uint32_t a, uint32_t b)
+{
+    const struct flv_manifest_entry *ea = &man_a->entries[a], *eb = &man_b->entries[b];
+    return (ea->crc == eb->crc && ea->size_flags == eb->size_flags);
+}
+
+// Tags of a chained by key, so b's tags are found in a quickly.
+static void hash_a(void)
+{
+    uint32_t n = man_a->h.ntags, i;
+
+    nheads = n * 2 + 1;
+    heads = malloc(nheads * sizeof(*heads));
+    chain = malloc((n + 1) * sizeof(*chain));
+    ASSERT(heads && chain, "Out of memory\n");
+    for (i = 0; i < nheads; i++)
+	heads[i] = -1;
+    for (i = n; i-- > 0; )
+    {
+	uint32_t k = key_hash(&man_a->entries[i]);
+	chain[i] = heads[k];
+	heads[k] = i;
+    }
+}
+
+// Next place from (*a, *b) where SYNC_RUN tags agree (or up to the end).
+// Chains are in ascending order and *a never goes back, so heads are moved
+// past tags before *a for good: each chain is skipped through only once.
+static int sync_up(uint32_t *a, uint32_t *b)
+{
+    uint32_t na = man_a->h.ntags, nb = man_b->h.ntags, i, j, k, h;
+
+    for (j = *b; j < nb; j++)
+    {
+	h = key_hash(&man_b->entries[j]);
+	while (heads[h] != (uint32_t)-1 && heads[h] < *a)
+	    heads[h] = chain[heads[h]];
+	for (i = heads[h]; i != (uint32_t)-1; i = chain[i])
+	{
+	    if (!same(i, j))
+		continue;
+	    for (k = 1; k < SYNC_RUN && i + k < na && j + k < nb && same(i + k, j + k); k++)
+		;
+	    if (k == SYNC_RUN || i + k == na || j + k == nb)
+	    {
+		*a = i;
+		*b = j;
+		return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+static void show_range(const char *name, const struct flv_manifest *man,
+		       uint32_t from, uint32_t to)
+{
+    uint32_t i, min_time = -1, max_time = 0;
+
+    for (i = from; i < to; i++)
+    {
+	const struct flv_manifest_entry *e = &man->entries[i];
+	if (FLV_TAG_TYPE(FLV_MANIFEST_FLAGS(e)) == FLV_TAG_META)
+	    continue;
+	if (e->time < min_time)
+	    min_time = e->time;
+	if (e->time > max_time)
+	    max_time = e->time;
+    }
+    printf("  %s:[%7u, %7u)", name, from, to);
+    if (min_time != (uint32_t)-1)
+	printf(" %s-%s", format_time(min_time, time_buf), format_time(max_time, time_buf2));
+    else
+	printf("                       ");
+}
+
+static void show_region(const char *what, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1)
+{
+    printf("%-8s", what);
+    show_range("a", man_a, a0, a1);
+    show_range("b", man_b, b0, b1);
+    printf("\n");
+}
+
+int compare(const char *fname_a, const char *fname_b)
+{
+    struct flv_manifest ma, mb;
+    uint32_t a = 0, b = 0, a0, b0, na, nb;
+    int diverging = 0;
+
+    get_manifest(&ma, fname_a);
+    get_manifest(&mb, fname_b);
+    man_a = &ma;
+    man_b = &mb;
+    na = ma.h.ntags;
+    nb = mb.h.ntags;
+    printf("a: %s, %u tags\n", fname_a, na);
+    printf("b: %s, %u tags\n", fname_b, nb);
+    hash_a();
+
+    if (!sync_up(&a, &b))
+    {
+	printf("Nothing in common.\n");
+	return 1;
+    }
+    if (a || b)
+	show_region("start", 0, a, 0, b);
+    if (ma.entries[a].time != mb.entries[b].time)
+	printf("*** Warning: timestamps differ by %i ms\n",
+	       (int)(mb.entries[b].time - ma.entries[a].time));
+
+    while (a < na && b < nb)
+    {
+	a0 = a;
+	b0 = b;
+	for (; a < na && b < nb && same(a, b); a++, b++)
+	    ;
+	show_region("same", a0, a, b0, b);
+	if (a == na || b == nb)
+	    break;
+	a0 = a;
+	b0 = b;
+	if (!sync_up(&a, &b))
+	{
+	    a = na;
+	    b = nb;
+	}
+	show_region("differ", a0, a, b0, b);
+	diverging++;
+    }
+    if (a < na)
+	show_region("only a", a, na, nb, nb);
+    if (b < nb)
+	show_region("only b", na, na, b, nb);
+
+    printf("%i diverging region(s).\n", diverging);
+    return (diverging != 0);
+}
+
+int main(int ac, char **av)
+{
+    struct flv_manifest man;
+    char out_fname[4096];
+
+    ac--; av++;
+    if (ac == 3 && !strcmp(*av, "-c"))
+	return compare(av[1], av[2]);
+
+    if (ac > 2 && !strcmp(*av, "-j"))
+    {
+	threads = atoi(av[1]);
+	ac -= 2;
+	av += 2;
+    }
+    if (ac != 1 && ac != 2)
+	usage();
+
+    if (ac == 2)
+	snprintf(out_fname, sizeof(out_fname), "%s", av[1]);
+    else
+	snprintf(out_fname, sizeof(out_fname), "%s.flvman", av[0]);
+    hash_file(&man, av[0]);
+    ASSERT(flv_manifest_save(&man, out_fname), "%s: %s\n", out_fname, strerror(errno));
+    flv_manifest_free(&man);
+    return 0;
+}
@@ -0,0 +1,171 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_map.h"
+
+int flv_pack_open(struct flv_pack *pk, const char *fname)
+{
+    struct flv_pack_trailer t;
+    struct stat st;
+    uint64_t index_len;
+    uint32_t i;
+    int err = EINVAL;
+
+    memset(pk, 0, sizeof(*pk));
+    pk->fd = open(fname, O_RDONLY);
+    if (pk->fd == -1)
+	return 0;
+    if (fstat(pk->fd, &st) || st.st_size < sizeof(t) ||
+	pread(pk->fd, &t, sizeof(t), st.st_size - sizeof(t)) != sizeof(t))
+	goto fail;
+    index_len = st.st_size - t.index_off;
+    if (memcmp(t.magic, FLV_PACK_MAGIC, 8) || t.index_off % FLV_PACK_ALIGN ||
+	t.index_off > st.st_size ||
+	index_len != (uint64_t)t.nentries * sizeof(struct flv_pack_entry) +
+		     t.names_len + sizeof(t))
+	goto fail;
+
+    pk->map = mmap(0, index_len, PROT_READ, MAP_SHARED, pk->fd, t.index_off);
+    if (pk->map == MAP_FAILED)
+    {
+	err = errno;
+	pk->map = 0;
+	goto fail;
+    }
+    pk->map_len = index_len;
+    pk->n = t.nentries;
+    pk->entries = pk->map;
+    pk->names = (const char*)(pk->entries + pk->n);
+
+    // Don't trust entries either: names within names, members before the index.
+    if (t.names_len && pk->names[t.names_len - 1])
+	goto fail;
+    for (i = 0; i < pk->n; i++)
+    {
+	const struct flv_pack_entry *e = &pk->entries[i];
+	if (e->name_off >= t.names_len || e->offset % FLV_PACK_ALIGN ||
+	    e->offset > t.index_off || e->len > t.index_off - e->offset)
+	    goto fail;
+    }
+    return 1;
+
+  fail:
+    flv_pack_close(pk);
+    errno = err;
+    return 0;
+}
+
+void flv_pack_close(struct flv_pack *pk)
+{
+    if (pk->map)
+	munmap(pk->map, pk->map_len);
+    if (pk->fd >= 0)
+	close(pk->fd);
+    memset(pk, 0, sizeof(*pk));
+    pk->fd = -1;
+}
+
+const char *flv_pack_name(const struct flv_pack *pk, const struct flv_pack_entry *e)
+{
+    return pk->names + e->name_off;
+}
+
+// Binary search, index is sorted by name.
+const struct flv_pack_entry *flv_pack_find(const struct flv_pack *pk, const char *name)
+{
+    uint32_t lo = 0, hi = pk->n;
+
+    while (lo < hi)
+    {
+	uint32_t mid = lo + (hi - lo) / 2;
+	int c = strcmp(name, flv_pack_name(pk, &pk->entries[mid]));
+	if (!c)
+	    return &pk->entries[mid];
+	if (c < 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return 0;
+}
+
+static int map_member(struct flv_map *m, const char *fname)
+{
+    const char *sep = strrchr(fname, ':');	// member names have none
+    const struct flv_pack_entry *e;
+    struct flv_pack pk;
+    char path[4096];
+    void *beg;
+
+    if (!sep || sep - fname >= sizeof(path))
+	return 0;
+    memcpy(path, fname, sep - fname);
+    path[sep - fname] = 0;
+    if (!flv_pack_open(&pk, path))
+	return 0;
+    if (!(e = flv_pack_find(&pk, sep + 1)) || !e->len)
+    {
+	flv_pack_close(&pk);
+	errno = ENOENT;
+	return 0;
+    }
+    // Members are page aligned: map just that.
+    beg = mmap(0, e->len, PROT_READ, MAP_SHARED, pk.fd, e->offset);
+    m->len = e->len;
+    flv_pack_close(&pk);
+    if (beg == MAP_FAILED)
+	return 0;
+    m->beg = beg;
+    m->fd = -1;
+    return 1;
+}
+
+int flv_map_open(struct flv_map *m, const char *fname)
+{
+    struct stat st;
+    void *beg;
+    int err;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = open(fname, O_RDONLY);
+    if (m->fd == -1)
+	return (errno == ENOENT && map_member(m, fname));
+    if (fstat(m->fd, &st))
+	goto fail;
+    if (!st.st_size)
+    {
+	errno = EINVAL;
+	goto fail;
+    }
+    beg = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if (beg == MAP_FAILED)
+	goto fail;
+    m->beg = beg;
+    m->len = st.st_size;
+    return 1;
+
+  fail:
+    err = errno;
+    close(m->fd);
+    m->fd = -1;
+    errno = err;
+    return 0;
+}
+
+void flv_map_close(struct flv_map *m)
+{
+    if (m->beg)
+	munmap((void*)m->beg, m->len);
+    if (m->fd >= 0)
+	close(m->fd);
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+}
@@ -0,0 +1,65 @@
+#ifndef FLV_MAP_H
+#define FLV_MAP_H
+
+#include <stdint.h>
+
+/* Read-only mappings of plain files and pack members.
+ *
+ * A pack (see flv_pack) is FLV files concatenated at page aligned offsets,
+ * then an index sorted by name, page aligned too:
+ *   entries	struct flv_pack_entry[n]
+ *   names	NUL terminated
+ *   trailer	struct flv_pack_trailer, at end of file
+ * Listing only reads the index. Members are named "file.flvpack:name" and
+ * mapped on their own, straight from the pack (no copy).
+ */
+
+#define FLV_PACK_MAGIC	"FLVPACK1"
+#define FLV_PACK_ALIGN	4096
+
+struct flv_pack_entry
+{
+    uint64_t	offset;
+    uint64_t	len;
+    uint32_t	start;		// first audio / video timestamp (ms)
+    uint32_t	duration;	// ms
+    uint32_t	ntags;
+    uint32_t	name_off;	// in names
+};
+
+struct flv_pack_trailer
+{
+    uint64_t	index_off;
+    uint32_t	nentries;
+    uint32_t	names_len;
+    char	magic[8];
+};
+
+struct flv_pack
+{
+    int				fd;
+    uint32_t			n;
+    const struct flv_pack_entry	*entries;
+    const char			*names;
+    void			*map;		// index
+    uint64_t			map_len;
+};
+
+int flv_pack_open(struct flv_pack *pk, const char *fname);
+void flv_pack_close(struct flv_pack *pk);
+const struct flv_pack_entry *flv_pack_find(const struct flv_pack *pk, const char *name);
+const char *flv_pack_name(const struct flv_pack *pk, const struct flv_pack_entry *e);
+
+struct flv_map
+{
+    const unsigned char	*beg;
+    uint64_t		len;
+    int			fd;		// plain files, -1 for pack members
+};
+
+/* Plain file, or "file.flvpack:name" if there's no such file.
+ * Returns 0 (errno set) on failure. */
+int flv_map_open(struct flv_map *m, const char *fname);
+void flv_map_close(struct flv_map *m);
+
+#endif
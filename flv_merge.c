@@ -9,6 +9,10 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include "flv_index.h"
+#include "flv_ckpt.h"
+#include "flv_hash.h"
+
 // Number of video frames to skip at beginning of tail.
 //   we need this because seek may not happen immediately,
 //   in which case tail will begin with a few frames
@@ -18,6 +22,14 @@ int		skip_frames = 100;
 // same idea as skip_frames, but with timestamp.
 int		time_clue = -1;
 
+// Match frame sequences instead of identical frames.
+int		align_only = 0;
+
+int		resume = 0;
+
+// Head's manifest, to search it without reading it.
+const char	*manifest_fname = 0;
+
 
 #define uchar unsigned char
 
@@ -35,7 +47,7 @@ void die(char *str)
 void usage(void)
 {
     printf("Usage:\n");
-    printf("  flv_merge [-s skip_frames] [-t mm:ss:ms] head.flv   tail.flv   out.flv\n");
+    printf("  flv_merge [--resume] [-m head.flvman] [-a] [-s skip_frames] [-t mm:ss:ms] head.flv   tail.flv   out.flv\n");
     printf("\n");
     printf("  Merge overlapping head.flv and tail.flv into one file.\n");
     printf("\n");    
@@ -54,6 +66,18 @@ void usage(void)
     printf("\n");
     printf("  Instead of -s, -t can be used to give a time clue (much easier to use)\n");
     printf("\n");
+    printf("  If no frame is identical (parts from different servers / remuxers),\n");
+    printf("  sequences of video frames are matched instead: timestamp deltas, sizes\n");
+    printf("  and keyframes, searching from the end of head. This needs no\n");
+    printf("  skip_frames or time clue, -a goes straight to it.\n");
+    printf("\n");
+    printf("  With -m, head.flv's manifest (see flv_manifest) is searched instead:\n");
+    printf("  only frames with the same time, size and CRC are read from head.\n");
+    printf("\n");
+    printf("  Output goes to out.flv.part, checkpointed in out.flv.ckpt, and is\n");
+    printf("  renamed to out.flv once complete. If interrupted, run again with\n");
+    printf("  --resume to go on from the last checkpoint.\n");
+    printf("\n");
     exit(1);
 }
 
@@ -85,7 +109,7 @@ void *my_mmap(void *addr, size_t length, int prot, int flags,
     return ret;    
 }
 
-int get_file_len(int fd)
+long get_file_len(int fd)
 {
     struct stat st;
     if (fstat(fd, &st))
@@ -174,12 +198,12 @@ int parse_tag(const uchar *pt, uchar *type, int *body_len, int *timestamp,
 uchar		*head_beg = 0;
 const char	*head_fname = 0;
 int		head_fd = 0;
-int		head_len = 0;
+long		head_len = 0;
 
 uchar		*tail_beg = 0;
 const char	*tail_fname = 0;
 int		tail_fd = 0;
-int		tail_len = 0;
+long		tail_len = 0;
 
 const char	*out_fname = 0;
 int		out_fd = 0;
@@ -187,10 +211,10 @@ int		out_fd = 0;
 
 ssize_t my_write(int fd, const void *buf, size_t count)
 {
-    int total = 0;
+    size_t total = 0;
     while (total != count)
     {
-	int ret = write(fd, buf, count);
+	ssize_t ret = write(fd, (const uchar*)buf + total, count - total);
 	if (ret == -1)
 	{
 	    perror(out_fname);
@@ -201,63 +225,97 @@ ssize_t my_write(int fd, const void *buf, size_t count)
     return total;
 }
 
+// search_head() from head's manifest.
+const uchar* search_manifest(const uchar *search_pt, const int search_len)
+{
+    struct flv_manifest man;
+    uint32_t crc = flv_crc32c(0, search_pt + 11, search_len);
+    uint32_t search_time = read_number(search_pt + 4, 3) | (search_pt[7] << 24);
+    int time_min = 99999999, time_max = 0;
+    const uchar *found = 0;
+    uint64_t offset;
+    uint32_t i;
+
+    ASSERT(flv_manifest_load(&man, manifest_fname), "%s: %s\n", manifest_fname,
+	   errno == EINVAL ? "not a manifest" : strerror(errno));
+    ASSERT(man.h.file_len == head_len, "%s: not a manifest for %s (size differs)\n",
+	   manifest_fname, head_fname);
+    if (man.h.end < head_len)
+    {
+	int percent = (int)(man.h.end * 100 / head_len);
+	printf("Invalid tag at %i%% of file, %s.\n", percent,
+	       (percent > 95) ? "that's ok" : "stopping search there");
+    }
+
+    for (i = 0, offset = man.h.first; i < man.h.ntags; i++)
+    {
+	const struct flv_manifest_entry *e = &man.entries[i];
+	int size = FLV_MANIFEST_SIZE(e);
+
+	if ((int)e->time < time_min)
+	    time_min = e->time;
+	if ((int)e->time > time_max)
+	    time_max = e->time;
+
+	// Only compare the real thing when everything else agrees.
+	if (FLV_TAG_TYPE(FLV_MANIFEST_FLAGS(e)) == FLV_TAG_VIDEO &&
+	    size == search_len && e->crc == crc && e->time == search_time &&
+	    offset + size + 15 <= head_len &&
+	    !memcmp(head_beg + offset, search_pt, search_len))
+	{
+	    ASSERT(!found,
+		   "Found multiple matches! Change skip_frames to use another frame!\n");
+	    printf("Match found ! Making sure that's the only one ...\n");
+	    found = head_beg + offset;
+	}
+	offset += size + 15;
+    }
+    flv_manifest_free(&man);
+    printf("Time range scanned: [%s, %s]\n",
+	   format_time(time_min, time_buf),
+	   format_time(time_max, time_buf2));
+    return found;
+}
+
 const uchar* search_head(const uchar *search_pt, const int search_len)
 {
     const uchar const *beg = head_beg;
-    const uchar *pt = beg;
-    uchar type;
-    int len, timestamp;
+    struct flv_index idx;
     int time_min = 99999999, time_max = 0;
     const uchar *found = 0;    
+    uint32_t i;
 
     /* Checking head */
-    ASSERT(!strncmp((char*)pt, "FLV", 3), "file %s: invalid FLV header\n", head_fname);
-    pt += 13;
-
-#if 0    
-    ASSERT(*pt == FLV_TYPE_META, "Non metadata tag (%#02x) at offset 13\n", *pt);    
-    parse_tag(pt, &type, &len, &timestamp, beg);
-    pt = skip_tag(pt, len);
-
-    ASSERT(*pt == FLV_TYPE_AUDIO ||
-	   *pt == FLV_TYPE_VIDEO,
-	   "hum, second tag neither audio or video ...\n");
-#endif
+    ASSERT(!strncmp((char*)beg, "FLV", 3), "file %s: invalid FLV header\n", head_fname);
+    if (manifest_fname)
+	return search_manifest(search_pt, search_len);
+    ASSERT(flv_index_open(&idx, head_fd, beg, head_len), "%s: couldn't index file\n", head_fname);
+    if (idx.end < head_len)
+    {
+	int percent = (int)(idx.end * 100 / head_len);
+	printf("Invalid tag at %i%% of file, %s.\n", percent,
+	       (percent > 95) ? "that's ok" : "stopping search there");
+    }
 
-    while (pt - beg < head_len)    
+    // Only video tags of the right size are worth comparing.
+    for (i = 0; i < idx.ntags; i++)
     {
-	if (parse_tag(pt, &type, &len, &timestamp, beg) < 0)
-	{
-	    int percent = (pt - beg) * 100 / head_len;
-	    printf("at %i%% of file, %s.\n", percent,
-		   (percent > 95) ? "that's ok" : "stopping search there");
-	    break; 
-	}
-	
-	if (timestamp < time_min)
-	    time_min = timestamp;
-	if (timestamp > time_max)
-	    time_max = timestamp;
+	if ((int)idx.times[i] < time_min)
+	    time_min = idx.times[i];
+	if ((int)idx.times[i] > time_max)
+	    time_max = idx.times[i];
 	
-	ASSERT(*pt == FLV_TYPE_AUDIO ||
-	       *pt == FLV_TYPE_VIDEO ||
-	       *pt == FLV_TYPE_META,
-	       "Neither audio nor video tag ... corrupted file ?\n");	
-//	printf("TAG type %#02x, len %i\n", type, len);
-
-	// TODO: could check that there are not multiple matches ...	
-	if (type == FLV_TYPE_VIDEO &&
-//	    len == search_len &&
-	    !memcmp(pt, search_pt, search_len))
+	if (FLV_TAG_TYPE(idx.flags[i]) == FLV_TAG_VIDEO &&
+	    idx.sizes[i] == search_len &&
+	    !memcmp(beg + idx.offsets[i], search_pt, search_len))
 	{
 	    ASSERT(!found,
 		   "Found multiple matches! Change skip_frames to use another frame!\n");
 	    printf("Match found ! Making sure that's the only one ...\n");
-	    found = pt;
+	    found = beg + idx.offsets[i];
 	}
-	
-	pt = skip_tag(pt, len);	
     }
+    flv_index_free(&idx);
     printf("Time range scanned: [%s, %s]\n",
 	   format_time(time_min, time_buf),
 	   format_time(time_max, time_buf2));
@@ -319,29 +377,240 @@ const uchar* get_search_video_frame(int *search_len, int *search_time)
     return pt;
 }
 
+/**************************************************************************/
+/* Content alignment: frames may differ a bit between parts, but a run of
+ * (timestamp delta, size, keyframe) is as good as a fingerprint. */
+
+// Frames per signature
+#define ALIGN_WINDOW	32
+// Tail windows looked for in head
+#define ALIGN_TAIL_FRAMES 2048
+#define ALIGN_SLOTS	(2 * ALIGN_TAIL_FRAMES)
+#define ALIGN_BASE	0x100000001b3ULL
+
+// Video frames (tag numbers), sequence headers left out.
+uint32_t *video_frames(const struct flv_index *idx, uint32_t *n)
+{
+    uint32_t i, *frames = malloc((idx->ntags + 1) * sizeof(*frames));
+    ASSERT(frames, "Out of memory\n");
+    for (*n = 0, i = 0; i < idx->ntags; i++)
+	if (FLV_TAG_TYPE(idx->flags[i]) == FLV_TAG_VIDEO &&
+	    !(idx->flags[i] & FLV_TAG_CONFIG))
+	    frames[(*n)++] = i;
+    return frames;
+}
+
+// Signature of frame i (i > 0)
+uint64_t frame_sig(const struct flv_index *idx, const uint32_t *frames, uint32_t i)
+{
+    uint64_t delta = idx->times[frames[i]] - idx->times[frames[i - 1]];
+    uint64_t size = idx->sizes[frames[i]];
+    uint64_t key = (idx->flags[frames[i]] & FLV_TAG_KEY) != 0;
+    return (((delta << 32) | size) * 0x9e3779b97f4a7c15ULL) ^ key;
+}
+
+// Window of ALIGN_WINDOW frames starting at i: sum sig[i + k] * BASE^k
+uint64_t window_hash(const struct flv_index *idx, const uint32_t *frames, uint32_t i)
+{
+    uint64_t h = 0;
+    int k;
+    for (k = ALIGN_WINDOW - 1; k >= 0; k--)
+	h = h * ALIGN_BASE + frame_sig(idx, frames, i + k);
+    return h;
+}
+
+int same_window(const struct flv_index *i1, const uint32_t *f1, uint32_t p1,
+		const struct flv_index *i2, const uint32_t *f2, uint32_t p2)
+{
+    int k;
+    for (k = 0; k < ALIGN_WINDOW; k++)
+	if (frame_sig(i1, f1, p1 + k) != frame_sig(i2, f2, p2 + k))
+	    return 0;
+    return 1;
+}
+
+// Junction point in head and tail, 0 if none.
+int align_parts(const uchar **head_pt, const uchar **tail_pt)
+{
+    struct flv_index head_idx, tail_idx;
+    uint32_t *head_frames, *tail_frames, nhead, ntail;
+    uint64_t hashes[ALIGN_SLOTS], h, pow = 1;
+    uint32_t slots[ALIGN_SLOTS];	// tail window + 1, 0 = empty
+    uchar repeated[ALIGN_SLOTS];	// window shows up more than once: useless
+    uint32_t i, j, k, ntail_windows;
+    int found = 0;
+
+    ASSERT(flv_index_open(&head_idx, head_fd, head_beg, head_len), "%s: couldn't index file\n", head_fname);
+    ASSERT(flv_index_open(&tail_idx, tail_fd, tail_beg, tail_len), "%s: couldn't index file\n", tail_fname);
+    head_frames = video_frames(&head_idx, &nhead);
+    tail_frames = video_frames(&tail_idx, &ntail);
+    if (nhead <= ALIGN_WINDOW || ntail <= ALIGN_WINDOW)
+    {
+	printf("Not enough video frames to align.\n");
+	goto out;
+    }
+
+    // Tail windows, hashed. Periodic content (same sizes over and over)
+    // can't be aligned, such windows are left out.
+    memset(slots, 0, sizeof(slots));
+    memset(repeated, 0, sizeof(repeated));
+    ntail_windows = ntail - ALIGN_WINDOW;
+    if (ntail_windows > ALIGN_TAIL_FRAMES)
+	ntail_windows = ALIGN_TAIL_FRAMES;
+    for (i = 1; i <= ntail_windows; i++)
+    {
+	h = window_hash(&tail_idx, tail_frames, i);
+	for (k = h % ALIGN_SLOTS; slots[k] && hashes[k] != h; k = (k + 1) % ALIGN_SLOTS)
+	    ;
+	if (slots[k])
+	    repeated[k] = 1;
+	else
+	{
+	    slots[k] = i + 1;
+	    hashes[k] = h;
+	}
+    }
+
+    // One pass over head, backward from the end, rolling hash.
+    for (k = 1; k < ALIGN_WINDOW; k++)
+	pow *= ALIGN_BASE;
+    j = nhead - ALIGN_WINDOW;
+    h = window_hash(&head_idx, head_frames, j);
+    for (;;)
+    {
+	for (k = h % ALIGN_SLOTS; slots[k]; k = (k + 1) % ALIGN_SLOTS)
+	    if (hashes[k] == h && !repeated[k] &&
+		same_window(&head_idx, head_frames, j, &tail_idx, tail_frames, slots[k] - 1))
+		break;
+	if (slots[k])
+	    break;
+	if (j == 1)
+	    goto out;
+	j--;
+	h = frame_sig(&head_idx, head_frames, j) +
+	    ALIGN_BASE * (h - frame_sig(&head_idx, head_frames, j + ALIGN_WINDOW) * pow);
+    }
+
+    i = slots[k] - 1;
+    printf("Frame sequences match: head frame %u (%s), tail frame %u (%s)\n",
+	   j, format_time(head_idx.times[head_frames[j]], time_buf),
+	   i, format_time(tail_idx.times[tail_frames[i]], time_buf2));
+    if (head_idx.times[head_frames[j]] != tail_idx.times[tail_frames[i]])
+	printf("*** Warning: timestamps differ by %i ms, run flv_fix on result.\n",
+	       (int)(tail_idx.times[tail_frames[i]] - head_idx.times[head_frames[j]]));
+    *head_pt = head_beg + head_idx.offsets[head_frames[j]];
+    *tail_pt = tail_beg + tail_idx.offsets[tail_frames[i]];
+    found = 1;
+
+  out:
+    free(head_frames);
+    free(tail_frames);
+    flv_index_free(&head_idx);
+    flv_index_free(&tail_idx);
+    return found;
+}
+
+/* Output is head [0, head_cut) then tail [tail_start, end), written in
+ * FLV_CKPT_BYTES chunks with a checkpoint after each one. */
+struct merge_state
+{
+    uint64_t	head_cut;
+    uint64_t	tail_start;
+};
+
+void write_output(struct merge_state *st, uint64_t out_off)
+{
+    uint64_t out_len = st->head_cut + tail_len - st->tail_start;
+    int in_fds[2] = { head_fd, tail_fd };
+
+    if (!out_off)
+	flv_ckpt_save(out_fname, out_fd, in_fds, 2, 0, 0, st, sizeof(*st));
+    while (out_off < out_len)
+    {
+	uint64_t n = out_len - out_off;
+	const uchar *src;
+
+	if (out_off < st->head_cut)
+	{
+	    src = head_beg + out_off;
+	    if (n > st->head_cut - out_off)
+		n = st->head_cut - out_off;
+	}
+	else
+	    src = tail_beg + st->tail_start + (out_off - st->head_cut);
+	if (n > FLV_CKPT_BYTES)
+	    n = FLV_CKPT_BYTES;
+	my_write(out_fd, src, n);
+	out_off += n;
+	if (out_off < out_len &&
+	    !flv_ckpt_save(out_fname, out_fd, in_fds, 2, 0, out_off, st, sizeof(*st)))
+	    printf("Warning: couldn't save checkpoint.\n");
+    }
+    if (!flv_ckpt_done(out_fname, out_fd))
+	exit(1);
+}
+
+// Go on from checkpoint, returns 0 if there's none we can use.
+int resume_output()
+{
+    int in_fds[2] = { head_fd, tail_fd };
+    struct merge_state *st;
+    uint64_t in_off, out_off;
+    uint32_t len;
+
+    out_fd = flv_ckpt_reopen(out_fname);
+    if (out_fd == -1)
+	return 0;
+    st = flv_ckpt_load(out_fname, out_fd, in_fds, 2, &in_off, &out_off, &len);
+    if (!st || len != sizeof(*st) || st->head_cut > head_len || st->tail_start > tail_len)
+    {
+	printf("%s.part: no usable checkpoint, starting over\n", out_fname);
+	free(st);
+	close(out_fd);
+	return 0;
+    }
+    if (ftruncate(out_fd, out_off) || lseek(out_fd, out_off, SEEK_SET) == -1)
+    {
+	perror(out_fname);
+	exit(1);
+    }
+    printf("Resuming %s at offset %lu\n", out_fname, (unsigned long)out_off);
+    write_output(st, out_off);
+    free(st);
+    return 1;
+}
+
 void doit()
 {
-    const uchar *head_pt;
-    const uchar *search_pt;
+    const uchar *head_pt = 0;
+    const uchar *search_pt = 0;
     int search_len = 0;
     int search_time = 0;
-    int out_len = 0;
+    long out_len = 0;
     int head_percent = 0;
+    struct merge_state st;
 
-    if (time_clue == -1)
-	printf("%s: skipping first %i video frames\n", tail_fname, skip_frames);
-        // The video frame we'll be searching for in head:    
-    search_pt = get_search_video_frame(&search_len, &search_time);
-    printf("\n");
-
-    printf("%s: Searching for matching video frame ...\n", head_fname);
-    head_pt = search_head(search_pt, search_len);
+    if (!align_only)
+    {
+	if (time_clue == -1)
+	    printf("%s: skipping first %i video frames\n", tail_fname, skip_frames);
+	// The video frame we'll be searching for in head:    
+	search_pt = get_search_video_frame(&search_len, &search_time);
+	printf("\n");
+
+	printf("%s: Searching for matching video frame ...\n", head_fname);
+	head_pt = search_head(search_pt, search_len);
+    }
+    if (!head_pt)
+    {
+	printf("%s: Aligning frame sequences ...\n", head_fname);
+	align_parts(&head_pt, &search_pt);
+    }
     ASSERT(head_pt,
-	   "Couldn't find common part. Make sure the two files are overlapping.\n"
-	   "If they are, then try changing skip_frames\n");
+	   "Couldn't find common part. Make sure the two files are overlapping.\n");
     head_percent = (float)(head_pt - head_beg) * 100 / head_len;    
-    printf("\nJunction point found at %i%% of file (offset %i)!\n",
-	   head_percent, head_pt - head_beg);	
+    printf("\nJunction point found at %i%% of file (offset %li)!\n",
+	   head_percent, (long)(head_pt - head_beg));
     printf("\n");
 
     out_len = (head_pt - head_beg) + (tail_len - (search_pt - tail_beg));
@@ -354,10 +623,16 @@ void doit()
 	printf("             Make sure resulting file is ok, otherwise increase skip_frames\n");
     }
 
-    out_fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);    
+    out_fd = flv_ckpt_create(out_fname);
+    if (out_fd == -1)
+    {
+	perror(out_fname);
+	exit(1);
+    }
     printf("Writing %s\n", out_fname);
-    my_write(out_fd, head_beg, head_pt - head_beg);
-    my_write(out_fd, search_pt, tail_len - (search_pt - tail_beg));
+    st.head_cut = head_pt - head_beg;
+    st.tail_start = search_pt - tail_beg;
+    write_output(&st, 0);
 }
 
 int parse_time(const char *str)
@@ -372,6 +647,27 @@ int main(int ac, char **av)
 {
     ac--; av++;
 
+    if (ac >= 1 && !strcmp(*av, "--resume"))
+    {
+	resume = 1;
+	ac--;
+	av++;
+    }
+
+    if (ac >= 2 && !strcmp(*av, "-m"))
+    {
+	manifest_fname = av[1];
+	ac -= 2;
+	av += 2;
+    }
+
+    if (ac >= 1 && !strcmp(*av, "-a"))
+    {
+	align_only = 1;
+	ac--;
+	av++;
+    }
+
     if (ac >= 2 && !strcmp(*av, "-s"))
     {
 	skip_frames = atoi(av[1]);	
@@ -402,14 +698,19 @@ int main(int ac, char **av)
 
 
     out_fname = *av;
-    ASSERT(!file_exists(out_fname),
-	   "%s: File exists, aborting\n", out_fname);
+    if (file_exists(out_fname))
+    {
+	ASSERT(resume, "%s: File exists, aborting\n", out_fname);
+	printf("%s: already done\n", out_fname);
+	return 0;
+    }
     ac--; av++;    
 
     head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
     tail_beg = my_mmap(0, tail_len, PROT_READ, MAP_PRIVATE, tail_fd, 0);
 
-    doit();
+    if (!resume || !resume_output())
+	doit();
     
     close(out_fd);
     
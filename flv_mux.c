@@ -0,0 +1,135 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_muxer.h"
+
+#define DEFAULT_FPS	25
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_mux [-r fps] [-v in.h264] [-a in.aac]  out.flv\n");
+    printf("\n");
+    printf("  Build flv file from elementary streams:\n");
+    printf("    video: H.264 Annex B, frame rate given by -r (default %i)\n", DEFAULT_FPS);
+    printf("    audio: AAC with ADTS headers\n");
+    printf("  No B-frames reordering: composition times are left at 0.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+int file_exists(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) == -1 &&
+	errno == ENOENT)
+	return 0;
+    return 1;
+}
+
+long get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+const uchar *map_input(const char *fname, long *len)
+{
+    int fd = my_open(fname, O_RDONLY, 0);
+    *len = get_file_len(fd);
+    ASSERT(*len, "%s: empty file\n", fname);
+    return my_mmap(0, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+}
+
+int main(int ac, char **av)
+{
+    const char *video_fname = 0, *audio_fname = 0, *out_fname;
+    double fps = DEFAULT_FPS;
+    struct flv_muxer *m;
+    const uchar *data;
+    long len;
+    int fd;
+
+    ac--; av++;
+    while (ac > 1 && av[0][0] == '-')
+    {
+	if (!strcmp(av[0], "-v"))
+	    video_fname = av[1];
+	else if (!strcmp(av[0], "-a"))
+	    audio_fname = av[1];
+	else if (!strcmp(av[0], "-r"))
+	{
+	    fps = atof(av[1]);
+	    ASSERT(fps > 0, "Invalid frame rate: %s\n", av[1]);
+	}
+	else
+	    usage();
+	ac -= 2; av += 2;
+    }
+    if (ac != 1 || (!video_fname && !audio_fname))
+	usage();
+    out_fname = *av;
+
+    ASSERT(!file_exists(out_fname), "%s: File exists, aborting\n", out_fname);
+    fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    m = flv_muxer_new(fd);
+    ASSERT(m, "Out of memory\n");
+
+    if (video_fname)
+    {
+	data = map_input(video_fname, &len);
+	ASSERT(flv_muxer_add_h264(m, data, len, fps), "%s: invalid H.264 stream\n", video_fname);
+    }
+    if (audio_fname)
+    {
+	data = map_input(audio_fname, &len);
+	ASSERT(flv_muxer_add_aac(m, data, len), "%s: invalid AAC stream\n", audio_fname);
+    }
+
+    if (!flv_muxer_run(m))
+	exit(1);
+    flv_muxer_free(m);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,800 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flv_muxer.h"
+#include "flv_codec.h"
+
+#define FLV_TYPE_AUDIO 0x08
+#define FLV_TYPE_VIDEO 0x09
+#define FLV_TYPE_META 0x12
+
+#define MAX_SOURCES	16
+#define OUT_BUF_SIZE	(4 << 20)
+
+struct flv_muxer
+{
+    int			fd;
+    int			error;
+    uchar		*buf;		// output buffer
+    int			used;
+    long long		offset;		// file offset of buf
+
+    struct mux_source	*sources[MAX_SOURCES];
+    int			nsources;
+    int			heap[MAX_SOURCES];	// sources by next timestamp
+    int			heap_len;
+
+    long long		meta_offset;	// onMetaData tag
+    int			meta_len;
+    int			max_keyframes;	// room in keyframes table
+    int			nkeyframes;
+    double		*kf_times;
+    double		*kf_positions;
+    int			last_time;
+};
+
+
+/**************************************************************************/
+/* Output */
+
+static void out_flush(struct flv_muxer *m)
+{
+    int total = 0;
+    while (total != m->used && !m->error)
+    {
+	int ret = write(m->fd, m->buf + total, m->used - total);
+	if (ret == -1)
+	{
+	    perror("flv_muxer: write");
+	    m->error = 1;
+	}
+	else
+	    total += ret;
+    }
+    m->offset += m->used;
+    m->used = 0;
+}
+
+static void out_bytes(struct flv_muxer *m, const void *data, int len)
+{
+    while (len)
+    {
+	int n = OUT_BUF_SIZE - m->used;
+	if (n > len)
+	    n = len;
+	memcpy(m->buf + m->used, data, n);
+	m->used += n;
+	data = (const uchar*)data + n;
+	len -= n;
+	if (m->used == OUT_BUF_SIZE)
+	    out_flush(m);
+    }
+}
+
+static void put_number(uchar *pt, unsigned int n, int bytes)
+{
+    int i;
+    for (i = bytes - 1; i >= 0; i--, n >>= 8)
+	pt[i] = n;
+}
+
+static long long write_tag(struct flv_muxer *m, int type, int timestamp,
+			   const struct iovec *iov, int niov)
+{
+    long long offset = m->offset + m->used;
+    uchar hdr[11];
+    int i, len = 0;
+
+    for (i = 0; i < niov; i++)
+	len += iov[i].iov_len;
+    hdr[0] = type;
+    put_number(hdr + 1, len, 3);
+    put_number(hdr + 4, timestamp, 3);
+    hdr[7] = timestamp >> 24;	// extended timestamp
+    put_number(hdr + 8, 0, 3);	// stream id
+    out_bytes(m, hdr, 11);
+    for (i = 0; i < niov; i++)
+	out_bytes(m, iov[i].iov_base, iov[i].iov_len);
+    put_number(hdr, len + 11, 4);	// PreviousTagSize
+    out_bytes(m, hdr, 4);
+    return offset;
+}
+
+
+/**************************************************************************/
+/* onMetaData */
+
+struct amf
+{
+    uchar	*buf;		// 0: just count
+    int		len;
+};
+
+static void amf_bytes(struct amf *a, const void *data, int len)
+{
+    if (a->buf)
+	memcpy(a->buf + a->len, data, len);
+    a->len += len;
+}
+
+static void amf_name(struct amf *a, const char *name)
+{
+    uchar len[2];
+    put_number(len, strlen(name), 2);
+    amf_bytes(a, len, 2);
+    amf_bytes(a, name, strlen(name));
+}
+
+static void amf_double(struct amf *a, double d)
+{
+    uchar b[9];
+    union { double d; unsigned long long n; } u;
+    int i;
+    u.d = d;
+    b[0] = 0;			// number
+    for (i = 0; i < 8; i++)
+	b[1 + i] = u.n >> (56 - 8 * i);
+    amf_bytes(a, b, 9);
+}
+
+static void amf_number(struct amf *a, const char *name, double d)
+{
+    amf_name(a, name);
+    amf_double(a, d);
+}
+
+static void amf_array(struct amf *a, const char *name, const double *v, int n, int max)
+{
+    uchar b[5];
+    int i;
+    amf_name(a, name);
+    b[0] = 0x0a;		// strict array
+    put_number(b + 1, max, 4);
+    amf_bytes(a, b, 5);
+    // unused entries repeat last one
+    for (i = 0; i < max; i++)
+	amf_double(a, (i < n ? v[i] : n ? v[n - 1] : 0));
+}
+
+// Build onMetaData body in buf, or just get its length if buf is 0.
+static int build_meta(struct flv_muxer *m, uchar *buf, long long filesize)
+{
+    struct amf a = { buf, 0 };
+    uchar b[5];
+    int i, duration = 0;
+    struct mux_source *video = 0, *audio = 0;
+
+    for (i = 0; i < m->nsources; i++)
+    {
+	struct mux_source *src = m->sources[i];
+	if (src->videocodecid && !video)
+	    video = src;
+	if (src->audiocodecid && !audio)
+	    audio = src;
+	if (src->duration > duration)
+	    duration = src->duration;
+    }
+    if (m->last_time > duration)
+	duration = m->last_time;
+
+    b[0] = 2;			// string
+    amf_bytes(&a, b, 1);
+    amf_name(&a, "onMetaData");
+    b[0] = 8;			// ECMA array
+    put_number(b + 1, 0, 4);
+    amf_bytes(&a, b, 5);
+
+    amf_number(&a, "duration", duration / 1000.0);
+    amf_number(&a, "filesize", filesize);
+    if (video)
+    {
+	amf_number(&a, "videocodecid", video->videocodecid);
+	amf_number(&a, "width", video->width);
+	amf_number(&a, "height", video->height);
+	amf_number(&a, "framerate", video->framerate);
+    }
+    if (audio)
+    {
+	amf_number(&a, "audiocodecid", audio->audiocodecid);
+	amf_number(&a, "audiosamplerate", audio->samplerate);
+	amf_number(&a, "audiosamplesize", 16);
+	amf_name(&a, "stereo");
+	b[0] = 1;		// boolean
+	b[1] = (audio->channels > 1);
+	amf_bytes(&a, b, 2);
+    }
+    if (m->max_keyframes)
+    {
+	amf_name(&a, "keyframes");
+	b[0] = 3;		// object
+	amf_bytes(&a, b, 1);
+	amf_array(&a, "filepositions", m->kf_positions, m->nkeyframes, m->max_keyframes);
+	amf_array(&a, "times", m->kf_times, m->nkeyframes, m->max_keyframes);
+	b[0] = 0; b[1] = 0; b[2] = 9;	// object end
+	amf_bytes(&a, b, 3);
+    }
+    b[0] = 0; b[1] = 0; b[2] = 9;	// array end
+    amf_bytes(&a, b, 3);
+    return a.len;
+}
+
+
+/**************************************************************************/
+/* Muxer */
+
+struct flv_muxer *flv_muxer_new(int fd)
+{
+    struct flv_muxer *m = calloc(1, sizeof(*m));
+    if (!m)
+	return 0;
+    m->fd = fd;
+    m->buf = malloc(OUT_BUF_SIZE);
+    if (!m->buf)
+    {
+	free(m);
+	return 0;
+    }
+    return m;
+}
+
+void flv_muxer_free(struct flv_muxer *m)
+{
+    int i;
+    for (i = 0; i < m->nsources; i++)
+	free(m->sources[i]);
+    free(m->kf_times);
+    free(m->kf_positions);
+    free(m->buf);
+    free(m);
+}
+
+// Takes ownership of src (malloc()ed)
+int flv_muxer_add_source(struct flv_muxer *m, struct mux_source *src)
+{
+    if (m->nsources == MAX_SOURCES)
+    {
+	printf("flv_muxer: too many streams\n");
+	return 0;
+    }
+    m->sources[m->nsources++] = src;
+    return 1;
+}
+
+static int source_before(struct flv_muxer *m, int a, int b)
+{
+    int ta = m->sources[a]->sample.timestamp;
+    int tb = m->sources[b]->sample.timestamp;
+    return (ta < tb || (ta == tb && a < b));
+}
+
+static void heap_down(struct flv_muxer *m, int i)
+{
+    int child, tmp;
+    while ((child = 2 * i + 1) < m->heap_len)
+    {
+	if (child + 1 < m->heap_len &&
+	    source_before(m, m->heap[child + 1], m->heap[child]))
+	    child++;
+	if (!source_before(m, m->heap[child], m->heap[i]))
+	    break;
+	tmp = m->heap[i];
+	m->heap[i] = m->heap[child];
+	m->heap[child] = tmp;
+	i = child;
+    }
+}
+
+int flv_muxer_run(struct flv_muxer *m)
+{
+    uchar hdr[13] = { 'F', 'L', 'V', 1, 0, 0, 0, 0, 9, 0, 0, 0, 0 };
+    struct iovec iov;
+    uchar *meta;
+    int i;
+
+    if (!m->nsources)
+    {
+	printf("flv_muxer: no stream\n");
+	return 0;
+    }
+
+    m->max_keyframes = 0;
+    for (i = 0; i < m->nsources; i++)
+    {
+	struct mux_source *src = m->sources[i];
+	hdr[4] |= (src->audiocodecid ? 4 : 0) | (src->videocodecid ? 1 : 0);
+	m->max_keyframes += src->keyframes;
+    }
+    if (m->max_keyframes)
+    {
+	m->kf_times = malloc(m->max_keyframes * sizeof(double));
+	m->kf_positions = malloc(m->max_keyframes * sizeof(double));
+	if (!m->kf_times || !m->kf_positions)
+	{
+	    printf("flv_muxer: out of memory\n");
+	    return 0;
+	}
+    }
+    out_bytes(m, hdr, 13);
+
+    // Room for onMetaData, filled in at the end.
+    m->meta_len = build_meta(m, 0, 0);
+    meta = calloc(1, m->meta_len);
+    if (!meta)
+    {
+	printf("flv_muxer: out of memory\n");
+	return 0;
+    }
+    build_meta(m, meta, 0);
+    iov.iov_base = meta;
+    iov.iov_len = m->meta_len;
+    m->meta_offset = write_tag(m, FLV_TYPE_META, 0, &iov, 1);
+
+    // k-way merge on timestamps
+    m->heap_len = 0;
+    for (i = 0; i < m->nsources; i++)
+	if (m->sources[i]->next(m->sources[i], &m->sources[i]->sample))
+	    m->heap[m->heap_len++] = i;
+    for (i = m->heap_len / 2 - 1; i >= 0; i--)
+	heap_down(m, i);
+
+    while (m->heap_len && !m->error)
+    {
+	struct mux_source *src = m->sources[m->heap[0]];
+	struct mux_sample *s = &src->sample;
+	long long offset = write_tag(m, s->type, s->timestamp, s->iov, s->niov);
+
+	if (s->type == FLV_TYPE_VIDEO && s->key &&
+	    m->nkeyframes < m->max_keyframes)
+	{
+	    m->kf_positions[m->nkeyframes] = offset;
+	    m->kf_times[m->nkeyframes++] = s->timestamp / 1000.0;
+	}
+	if (s->timestamp > m->last_time)
+	    m->last_time = s->timestamp;
+
+	if (!src->next(src, s))
+	    m->heap[0] = m->heap[--m->heap_len];
+	heap_down(m, 0);
+    }
+    out_flush(m);
+
+    // Seek back and fill in onMetaData.
+    build_meta(m, meta, m->offset);
+    if (!m->error &&
+	pwrite(m->fd, meta, m->meta_len, m->meta_offset + 11) != m->meta_len)
+    {
+	perror("flv_muxer: onMetaData");
+	m->error = 1;
+    }
+    free(meta);
+    return !m->error;
+}
+
+
+/**************************************************************************/
+/* H.264 Annex B source */
+
+struct h264_source
+{
+    struct mux_source	src;
+    const uchar		*pt;		// next NAL unit
+    const uchar		*end;
+    double		fps;
+    int			frame;
+    int			sent_config;
+    uchar		record[1024];	// AVCDecoderConfigurationRecord
+    int			record_len;
+    uchar		hdr[5];
+    uchar		nal_len[MUX_MAX_IOVS / 2][4];
+};
+
+// Next start code, or end.
+static const uchar *find_start_code(const uchar *pt, const uchar *end)
+{
+    while (pt + 3 <= end)
+    {
+	if (pt[2] > 1)
+	    pt += 3;
+	else if (!pt[0] && !pt[1] && pt[2] == 1)
+	    return pt;
+	else
+	    pt++;
+    }
+    return end;
+}
+
+// NAL unit at or after pt: returns its start, *nal_end its end.
+static const uchar *next_nal(const uchar *pt, const uchar *end, const uchar **nal_end)
+{
+    const uchar *nal = find_start_code(pt, end);
+    if (nal == end)
+	return 0;
+    nal += 3;
+    *nal_end = find_start_code(nal, end);
+    // trailing zeros belong to next 4 bytes start code
+    while (*nal_end > nal && !(*nal_end)[-1] && *nal_end != end)
+	(*nal_end)--;
+    return nal;
+}
+
+#define NAL_TYPE(nal)		((nal)[0] & 0x1f)
+#define NAL_IS_VCL(nal)		(NAL_TYPE(nal) == 1 || NAL_TYPE(nal) == 5)
+// first_mb_in_slice == 0
+#define NAL_FIRST_SLICE(nal, nal_end)	((nal_end) - (nal) > 1 && ((nal)[1] & 0x80))
+
+// Starts a new access unit, after one with slices.
+static int au_boundary(const uchar *nal, const uchar *nal_end)
+{
+    int type = NAL_TYPE(nal);
+    return ((type >= 6 && type <= 9) || (type >= 14 && type <= 18) ||
+	    (NAL_IS_VCL(nal) && NAL_FIRST_SLICE(nal, nal_end)));
+}
+
+static int h264_next(struct mux_source *src, struct mux_sample *s)
+{
+    struct h264_source *h = (struct h264_source*)src;
+    const uchar *nal, *nal_end;
+    int has_vcl = 0, n = 0;
+
+    s->type = FLV_TYPE_VIDEO;
+    s->timestamp = h->frame * 1000 / h->fps + 0.5;
+    s->iov[0].iov_base = h->hdr;
+    s->iov[0].iov_len = 5;
+    s->niov = 1;
+
+    if (!h->sent_config)
+    {
+	h->sent_config = 1;
+	h->hdr[0] = 0x17;
+	h->hdr[1] = 0;		// sequence header
+	h->hdr[2] = h->hdr[3] = h->hdr[4] = 0;
+	s->key = 0;
+	s->iov[1].iov_base = h->record;
+	s->iov[1].iov_len = h->record_len;
+	s->niov = 2;
+	return 1;
+    }
+
+    s->key = 0;
+    while ((nal = next_nal(h->pt, h->end, &nal_end)))
+    {
+	if (has_vcl && au_boundary(nal, nal_end))
+	    break;
+	h->pt = nal_end;
+	if (nal_end == nal || NAL_TYPE(nal) == 9)	// AUD
+	    continue;
+	if (NAL_IS_VCL(nal))
+	    has_vcl = 1;
+	if (NAL_TYPE(nal) == 5)
+	    s->key = 1;
+	if (s->niov + 2 > MUX_MAX_IOVS)
+	{
+	    printf("flv_muxer: too many NAL units in frame %i, dropping some\n", h->frame);
+	    continue;
+	}
+	put_number(h->nal_len[n], nal_end - nal, 4);
+	s->iov[s->niov].iov_base = h->nal_len[n++];
+	s->iov[s->niov++].iov_len = 4;
+	s->iov[s->niov].iov_base = (void*)nal;
+	s->iov[s->niov++].iov_len = nal_end - nal;
+    }
+    if (!has_vcl)
+	return 0;
+
+    h->frame++;
+    h->hdr[0] = (s->key ? 0x17 : 0x27);
+    h->hdr[1] = 1;		// NAL units
+    h->hdr[2] = h->hdr[3] = h->hdr[4] = 0;	// composition time
+    return 1;
+}
+
+int flv_muxer_add_h264(struct flv_muxer *m, const uchar *data, long len, double fps)
+{
+    struct h264_source *h = calloc(1, sizeof(*h));
+    const uchar *end = data + len;
+    const uchar *nal, *nal_end, *pt = data;
+    const uchar *sps = 0, *pps = 0;
+    int sps_len = 0, pps_len = 0, frames = 0;
+    struct avc_config avc;
+
+    if (!h)
+	return 0;
+    // Count frames and keyframes, find SPS / PPS.
+    while ((nal = next_nal(pt, end, &nal_end)))
+    {
+	if (NAL_TYPE(nal) == 7 && !sps)
+	{
+	    sps = nal;
+	    sps_len = nal_end - nal;
+	}
+	if (NAL_TYPE(nal) == 8 && !pps)
+	{
+	    pps = nal;
+	    pps_len = nal_end - nal;
+	}
+	if (NAL_IS_VCL(nal) && NAL_FIRST_SLICE(nal, nal_end))
+	{
+	    frames++;
+	    if (NAL_TYPE(nal) == 5)
+		h->src.keyframes++;
+	}
+	pt = nal_end;
+    }
+    if (!sps || !pps || sps_len < 4 || sps_len + pps_len + 11 > sizeof(h->record))
+    {
+	printf("flv_muxer: no SPS / PPS found in H.264 stream\n");
+	free(h);
+	return 0;
+    }
+
+    h->record[0] = 1;
+    h->record[1] = sps[1];	// profile
+    h->record[2] = sps[2];	// compatibility
+    h->record[3] = sps[3];	// level
+    h->record[4] = 0xff;	// 4 bytes NAL lengths
+    h->record[5] = 0xe1;	// 1 SPS
+    put_number(h->record + 6, sps_len, 2);
+    memcpy(h->record + 8, sps, sps_len);
+    h->record_len = 8 + sps_len;
+    h->record[h->record_len++] = 1;	// 1 PPS
+    put_number(h->record + h->record_len, pps_len, 2);
+    memcpy(h->record + h->record_len + 2, pps, pps_len);
+    h->record_len += 2 + pps_len;
+
+    h->pt = data;
+    h->end = end;
+    h->fps = fps;
+    h->src.next = h264_next;
+    h->src.duration = frames * 1000 / fps;
+    h->src.videocodecid = FLV_CODEC_AVC;
+    h->src.framerate = fps;
+    if (parse_avc_config(h->record, h->record_len, &avc))
+    {
+	h->src.width = avc.width;
+	h->src.height = avc.height;
+    }
+    return flv_muxer_add_source(m, &h->src);
+}
+
+
+/**************************************************************************/
+/* AAC ADTS source */
+
+struct aac_source
+{
+    struct mux_source	src;
+    const uchar		*pt;
+    const uchar		*end;
+    long long		samples;	// decoded samples so far
+    int			sent_config;
+    uchar		asc[2];		// AudioSpecificConfig
+    uchar		hdr[2];
+};
+
+// ADTS frame at pt ?  Returns its length (header included), 0 if not.
+static int adts_frame(const uchar *pt, const uchar *end)
+{
+    int len;
+    if (end - pt < 7 || pt[0] != 0xff || (pt[1] & 0xf6) != 0xf0)
+	return 0;
+    len = ((pt[3] & 3) << 11) | (pt[4] << 3) | (pt[5] >> 5);
+    if (len < 7 + (pt[1] & 1 ? 0 : 2) || len > end - pt)
+	return 0;
+    return len;
+}
+
+static int aac_next(struct mux_source *src, struct mux_sample *s)
+{
+    struct aac_source *a = (struct aac_source*)src;
+    int len, hdr_len;
+
+    s->type = FLV_TYPE_AUDIO;
+    s->key = 0;
+    s->timestamp = a->samples * 1000 / a->src.samplerate;
+    s->iov[0].iov_base = a->hdr;
+    s->iov[0].iov_len = 2;
+    s->niov = 2;
+    a->hdr[0] = 0xaf;		// AAC, 44 kHz, 16 bits, stereo: always for AAC
+
+    if (!a->sent_config)
+    {
+	a->sent_config = 1;
+	a->hdr[1] = 0;		// sequence header
+	s->iov[1].iov_base = a->asc;
+	s->iov[1].iov_len = 2;
+	return 1;
+    }
+
+    // resync if needed
+    while (a->pt < a->end && !(len = adts_frame(a->pt, a->end)))
+	a->pt++;
+    if (a->pt >= a->end)
+	return 0;
+
+    hdr_len = (a->pt[1] & 1 ? 7 : 9);	// CRC
+    a->hdr[1] = 1;		// raw frame
+    s->iov[1].iov_base = (void*)(a->pt + hdr_len);
+    s->iov[1].iov_len = len - hdr_len;
+    a->pt += len;
+    a->samples += 1024;
+    return 1;
+}
+
+int flv_muxer_add_aac(struct flv_muxer *m, const uchar *data, long len)
+{
+    struct aac_source *a = calloc(1, sizeof(*a));
+    const uchar *pt = data, *end = data + len;
+    int object_type, freq_index, channels, n, frames = 0;
+    struct aac_config aac;
+
+    if (!a)
+	return 0;
+    while (pt < end && !adts_frame(pt, end))
+	pt++;
+    if (pt >= end)
+    {
+	printf("flv_muxer: no ADTS frame found in AAC stream\n");
+	free(a);
+	return 0;
+    }
+    object_type = (pt[2] >> 6) + 1;
+    freq_index = (pt[2] >> 2) & 0xf;
+    channels = ((pt[2] & 1) << 2) | (pt[3] >> 6);
+    a->asc[0] = (object_type << 3) | (freq_index >> 1);
+    a->asc[1] = ((freq_index & 1) << 7) | (channels << 3);
+    if (!parse_aac_config(a->asc, 2, &aac))
+    {
+	printf("flv_muxer: bad AAC header\n");
+	free(a);
+	return 0;
+    }
+
+    a->pt = pt;
+    a->end = end;
+    for (; pt < end && (n = adts_frame(pt, end)); pt += n)
+	frames++;
+    a->src.next = aac_next;
+    a->src.audiocodecid = FLV_CODEC_AAC;
+    a->src.samplerate = aac.sample_rate;
+    a->src.channels = channels;
+    a->src.duration = (long long)frames * 1024 * 1000 / aac.sample_rate;
+    return flv_muxer_add_source(m, &a->src);
+}
+
+
+/**************************************************************************/
+/* FLV source: audio / video tags of an existing file */
+
+struct flv_source
+{
+    struct mux_source	src;
+    const uchar		*beg;
+    const uchar		*pt;
+    const uchar		*end;
+    const char		*fname;
+};
+
+static int read_number(const uchar *pt, int bytes)
+{
+    int i, n = 0;
+    for (i = 0; i < bytes; i++)
+	n = (n << 8) | pt[i];
+    return n;
+}
+
+// Valid tag at pt ?  Returns body length, -1 if not.
+static int flv_tag(const uchar *pt, const uchar *end)
+{
+    int len;
+    if (end - pt < 15 ||
+	(pt[0] != FLV_TYPE_AUDIO && pt[0] != FLV_TYPE_VIDEO && pt[0] != FLV_TYPE_META))
+	return -1;
+    len = read_number(pt + 1, 3);
+    if (end - pt < len + 15 || read_number(pt + 11 + len, 4) != len + 11)
+	return -1;
+    return len;
+}
+
+#define TAG_TIME(pt)	(read_number((pt) + 4, 3) | ((pt)[7] << 24))
+// Video keyframe, not AVC sequence header
+#define TAG_IS_KEY(pt, len)  ((pt)[0] == FLV_TYPE_VIDEO && (len) && ((pt)[11] >> 4) == 1 && \
+			      !(((pt)[11] & 0xf) == FLV_CODEC_AVC && (len) > 1 && (pt)[12] == 0))
+
+static int flv_next(struct mux_source *src, struct mux_sample *s)
+{
+    struct flv_source *f = (struct flv_source*)src;
+    int len;
+
+    for (; f->pt < f->end; f->pt += len + 15)
+    {
+	if ((len = flv_tag(f->pt, f->end)) < 0)
+	{
+	    printf("%s: invalid tag at offset %li, ignoring rest of file.\n",
+		   f->fname, (long)(f->pt - f->beg));
+	    f->pt = f->end;
+	    return 0;
+	}
+	if (f->pt[0] != FLV_TYPE_META && len)	// onMetaData is rebuilt
+	    break;
+    }
+    if (f->pt >= f->end)
+	return 0;
+
+    s->type = f->pt[0];
+    s->timestamp = TAG_TIME(f->pt);
+    s->key = TAG_IS_KEY(f->pt, len);
+    s->iov[0].iov_base = (void*)(f->pt + 11);
+    s->iov[0].iov_len = len;
+    s->niov = 1;
+    f->pt += len + 15;
+    return 1;
+}
+
+int flv_muxer_add_flv(struct flv_muxer *m, const uchar *data, long len, const char *fname)
+{
+    struct flv_source *f = calloc(1, sizeof(*f));
+    const uchar *pt, *end = data + len;
+    int l, frames = 0;
+
+    if (!f)
+	return 0;
+    if (len < 13 || strncmp((const char*)data, "FLV", 3))
+    {
+	printf("%s: invalid FLV header\n", fname);
+	free(f);
+	return 0;
+    }
+    f->beg = data;
+    f->pt = data + read_number(data + 5, 4) + 4;
+    f->end = end;
+    f->fname = fname;
+    f->src.next = flv_next;
+
+    // Prescan: keyframes, duration and what goes in onMetaData.
+    for (pt = f->pt; pt < end && (l = flv_tag(pt, end)) >= 0; pt += l + 15)
+    {
+	struct avc_config avc;
+	struct aac_config aac;
+	int time = TAG_TIME(pt);
+
+	if (time > f->src.duration)
+	    f->src.duration = time;
+	if (!l)
+	    continue;
+	if (TAG_IS_KEY(pt, l))
+	    f->src.keyframes++;
+	if (pt[0] == FLV_TYPE_VIDEO)
+	{
+	    if (!((pt[11] & 0xf) == FLV_CODEC_AVC && l > 1 && !pt[12]))
+		frames++;
+	    if (!f->src.videocodecid)
+		f->src.videocodecid = pt[11] & 0xf;
+	    if ((pt[11] & 0xf) == FLV_CODEC_AVC && l > 5 && !pt[12] && !f->src.width &&
+		parse_avc_config(pt + 16, l - 5, &avc))
+	    {
+		f->src.width = avc.width;
+		f->src.height = avc.height;
+	    }
+	}
+	if (pt[0] == FLV_TYPE_AUDIO && !f->src.audiocodecid)
+	{
+	    static const int rates[4] = { 5512, 11025, 22050, 44100 };
+	    f->src.audiocodecid = pt[11] >> 4;
+	    f->src.samplerate = rates[(pt[11] >> 2) & 3];
+	    f->src.channels = (pt[11] & 1) + 1;
+	}
+	if (pt[0] == FLV_TYPE_AUDIO && (pt[11] >> 4) == FLV_CODEC_AAC && l > 2 && !pt[12] &&
+	    parse_aac_config(pt + 13, l - 2, &aac))
+	{
+	    f->src.samplerate = aac.sample_rate;
+	    f->src.channels = aac.channels;
+	}
+    }
+    if (frames > 1 && f->src.duration)
+	f->src.framerate = (frames - 1) * 1000.0 / f->src.duration;
+    return flv_muxer_add_source(m, &f->src);
+}
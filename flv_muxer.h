@@ -0,0 +1,61 @@
+#ifndef FLV_MUXER_H
+#define FLV_MUXER_H
+
+/* FLV muxer: interleaves streams into a flv file by timestamp.
+ *
+ *   m = flv_muxer_new(fd);
+ *   flv_muxer_add_h264(m, data, len, fps);	// Annex B, mapped in memory
+ *   flv_muxer_add_aac(m, data, len);		// ADTS
+ *   flv_muxer_add_flv(m, data, len, fname);	// audio / video tags of a flv file
+ *   flv_muxer_run(m);
+ *   flv_muxer_free(m);
+ *
+ * Sequence headers are built from the streams, onMetaData (with keyframes
+ * table) is written first and filled in at the end, so fd must be seekable.
+ * Functions return 0 on error (message printed).
+ */
+
+#include <sys/uio.h>
+
+#ifndef uchar
+#define uchar unsigned char
+#endif
+
+#define MUX_MAX_IOVS	256
+
+struct mux_sample
+{
+    uchar		type;		// flv tag type
+    int			timestamp;	// ms
+    int			key;		// video keyframe
+    struct iovec	iov[MUX_MAX_IOVS];	// tag body
+    int			niov;
+};
+
+/* Stream feeding the muxer: next() gets next sample in s, returns 0 at end. */
+struct mux_source
+{
+    int			(*next)(struct mux_source *src, struct mux_sample *s);
+    struct mux_sample	sample;		// current one
+    int			keyframes;	// expected, for the keyframes table
+    int			duration;	// ms, if known
+    // what goes in onMetaData, 0 if unknown
+    int			width, height;
+    double		framerate;
+    int			videocodecid;
+    int			audiocodecid;
+    int			samplerate;
+    int			channels;
+};
+
+struct flv_muxer;
+
+struct flv_muxer *flv_muxer_new(int fd);
+void flv_muxer_free(struct flv_muxer *m);
+int flv_muxer_add_source(struct flv_muxer *m, struct mux_source *src);
+int flv_muxer_add_h264(struct flv_muxer *m, const uchar *data, long len, double fps);
+int flv_muxer_add_aac(struct flv_muxer *m, const uchar *data, long len);
+int flv_muxer_add_flv(struct flv_muxer *m, const uchar *data, long len, const char *fname);
+int flv_muxer_run(struct flv_muxer *m);
+
+#endif
@@ -0,0 +1,215 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_index.h"
+#include "flv_map.h"
+
+#define uchar unsigned char
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_pack -c out.flvpack  file1.flv file2.flv ...\n");
+    printf("  flv_pack -l pack.flvpack\n");
+    printf("  flv_pack -x pack.flvpack  name  out.flv|-\n");
+    printf("\n");
+    printf("  Keep many files in one: -c packs files (page aligned) followed by an\n");
+    printf("  index sorted by name with offset, size, start, duration and number of\n");
+    printf("  tags for each. -l lists it, reading the index only. -x gets one back.\n");
+    printf("\n");
+    printf("  flv_debug and flv_times take pack.flvpack:name for a file inside a\n");
+    printf("  pack (mapped straight from it), flv_times pack.flvpack lists them all.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+void my_write(int fd, const void *buf, size_t count)
+{
+    const char *pt = buf;
+    while (count)
+    {
+	ssize_t n = write(fd, pt, count);
+	if (n <= 0)
+	{
+	    perror("write");
+	    exit(1);
+	}
+	pt += n;
+	count -= n;
+    }
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Start, duration, tags count
+static void member_info(const uchar *beg, long len, struct flv_pack_entry *e, const char *fname)
+{
+    struct flv_index idx;
+    uint32_t i, min_time = -1, max_time = 0;
+
+    ASSERT(flv_index_build(&idx, beg, len), "file %s: invalid FLV header\n", fname);
+    if (idx.end != len)
+	printf("%s: invalid tag at offset %llu, packed anyway\n", fname,
+	       (unsigned long long)idx.end);
+    for (i = 0; i < idx.ntags; i++)
+    {
+	if (FLV_TAG_TYPE(idx.flags[i]) == FLV_TAG_META)
+	    continue;
+	if (idx.times[i] < min_time)
+	    min_time = idx.times[i];
+	if (idx.times[i] > max_time)
+	    max_time = idx.times[i];
+    }
+    e->start = (min_time == (uint32_t)-1 ? 0 : min_time);
+    e->duration = (min_time == (uint32_t)-1 ? 0 : max_time - min_time);
+    e->ntags = idx.ntags;
+    flv_index_free(&idx);
+}
+
+static void create_pack(const char *out_fname, char **files, int n)
+{
+    struct flv_pack_entry *entries = calloc(n, sizeof(*entries));
+    struct flv_pack_trailer t;
+    uint64_t offset = 0;
+    uint32_t names_len = 0;
+    int i, out_fd;
+
+    ASSERT(entries, "Out of memory\n");
+    qsort(files, n, sizeof(*files), cmp_names);
+    for (i = 1; i < n; i++)
+	ASSERT(strcmp(files[i - 1], files[i]), "%s given twice\n", files[i]);
+    for (i = 0; i < n; i++)
+	ASSERT(!strchr(files[i], ':'), "%s: ':' not allowed in names\n", files[i]);
+
+    out_fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    for (i = 0; i < n; i++)
+    {
+	int fd = my_open(files[i], O_RDONLY, 0);
+	off_t len = get_file_len(fd);
+	const uchar *beg;
+
+	ASSERT(len, "%s: empty file\n", files[i]);
+	beg = my_mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	madvise((void*)beg, len, MADV_SEQUENTIAL);
+	member_info(beg, len, &entries[i], files[i]);
+	entries[i].offset = offset;
+	entries[i].len = len;
+	entries[i].name_off = names_len;
+	names_len += strlen(files[i]) + 1;
+
+	// Leave a hole up to the next page, members are mapped on their own.
+	ASSERT(lseek(out_fd, offset, SEEK_SET) != -1, "lseek failed\n");
+	my_write(out_fd, beg, len);
+	offset = (offset + len + FLV_PACK_ALIGN - 1) & ~(uint64_t)(FLV_PACK_ALIGN - 1);
+	munmap((void*)beg, len);
+	close(fd);
+    }
+
+    // Index
+    ASSERT(lseek(out_fd, offset, SEEK_SET) != -1, "lseek failed\n");
+    my_write(out_fd, entries, n * sizeof(*entries));
+    for (i = 0; i < n; i++)
+	my_write(out_fd, files[i], strlen(files[i]) + 1);
+    memset(&t, 0, sizeof(t));
+    t.index_off = offset;
+    t.nentries = n;
+    t.names_len = names_len;
+    memcpy(t.magic, FLV_PACK_MAGIC, 8);
+    my_write(out_fd, &t, sizeof(t));
+    ASSERT(!close(out_fd), "%s: close failed\n", out_fname);
+    free(entries);
+}
+
+static void list_pack(const char *fname)
+{
+    struct flv_pack pk;
+    uint32_t i;
+
+    ASSERT(flv_pack_open(&pk, fname), "%s: not a pack (%s)\n", fname, strerror(errno));
+    for (i = 0; i < pk.n; i++)
+    {
+	const struct flv_pack_entry *e = &pk.entries[i];
+	printf("%12llu  %8u tags  [%u, %u]  %s\n", (unsigned long long)e->len,
+	       e->ntags, e->start, e->start + e->duration, flv_pack_name(&pk, e));
+    }
+    flv_pack_close(&pk);
+}
+
+static void extract(const char *fname, const char *name, const char *out_fname)
+{
+    char member[8192];
+    struct flv_map m;
+    int out_fd = 1;
+
+    ASSERT(snprintf(member, sizeof(member), "%s:%s", fname, name) < sizeof(member),
+	   "name too long\n");
+    ASSERT(flv_map_open(&m, member), "%s: %s\n", member, strerror(errno));
+    if (strcmp(out_fname, "-"))
+	out_fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    my_write(out_fd, m.beg, m.len);
+    ASSERT(!close(out_fd), "%s: close failed\n", out_fname);
+    flv_map_close(&m);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 3 && !strcmp(argv[1], "-c"))
+	create_pack(argv[2], argv + 3, argc - 3);
+    else if (argc == 3 && !strcmp(argv[1], "-l"))
+	list_pack(argv[2]);
+    else if (argc == 5 && !strcmp(argv[1], "-x"))
+	extract(argv[2], argv[3], argv[4]);
+    else
+	usage();
+    return 0;
+}
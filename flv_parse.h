@@ -0,0 +1,165 @@
+#ifndef FLV_PARSE_H
+#define FLV_PARSE_H
+
+/* Tag parse loop, specialized at compile time.
+ *
+ * flv_parse_tag() and flv_parse_loop() are always inlined, and policy must
+ * be a constant: each caller gets its own copy of the loop with the policy
+ * tests folded away and the callbacks inlined. Tools have one small wrapper
+ * per mode and pick it at runtime, once per file instead of once per tag.
+ *
+ *   FLV_PARSE_TOLERANT  resync after invalid tags (on_bad), strict loops stop
+ *   FLV_PARSE_VERBOSE   say why a tag is invalid
+ *   FLV_PARSE_TIMES     keep min / max audio / video timestamps
+ *   FLV_PARSE_FOLLOW    file is still being written: stop on a tag that isn't
+ *                       all there yet, offset is left on it for next time
+ */
+
+#include <stdio.h>
+
+#ifndef uchar
+#define uchar unsigned char
+#endif
+
+#define FLV_PARSE_STRICT	0
+#define FLV_PARSE_TOLERANT	1
+#define FLV_PARSE_VERBOSE	2
+#define FLV_PARSE_TIMES		4
+#define FLV_PARSE_FOLLOW	8
+#define FLV_PARSE_USER		16	// first bit tools can use for their own
+
+#define FLV_INLINE static inline __attribute__((always_inline))
+
+struct flv_tag
+{
+    int		type;
+    int		len;		// body
+    int		timestamp;	// ms, lower 24 bits
+    int		stream_id;
+};
+
+struct flv_parse
+{
+    const uchar	*beg;
+    long	file_len;
+    long	offset;		// where the loop stopped
+    int		bad;		// strict loop stopped on an invalid tag
+    int		min_time;	// FLV_PARSE_TIMES, -1 if none
+    int		max_time;
+    void	*arg;
+};
+
+FLV_INLINE int flv_read24(const uchar *pt)
+{
+    return (pt[0] << 16) | (pt[1] << 8) | pt[2];
+}
+
+FLV_INLINE void flv_parse_init(struct flv_parse *p, const uchar *beg, long file_len, void *arg)
+{
+    p->beg = beg;
+    p->file_len = file_len;
+    p->offset = 0;
+    p->bad = 0;
+    p->min_time = p->max_time = -1;
+    p->arg = arg;
+}
+
+// Check tag framing: type, within file, PreviousTagSize.
+FLV_INLINE int flv_parse_tag(const uchar *pt, const uchar *beg, long file_len,
+			     int policy, struct flv_tag *tag)
+{
+    long offset = pt - beg;
+    int prev_len;
+
+    if (offset + 15 > file_len)
+    {
+	if (policy & FLV_PARSE_VERBOSE)
+	    printf("File boundaries exceeded.\n");
+	return 0;
+    }
+    tag->type = pt[0];
+    if (!(tag->type == 0x08 || tag->type == 0x09 || tag->type == 0x12))
+    {
+	if (policy & FLV_PARSE_VERBOSE)
+	    printf("Invalid tag type %#02x at offset %li\n", tag->type, offset);
+	return 0;
+    }
+    tag->len = flv_read24(pt + 1);
+    tag->timestamp = flv_read24(pt + 4);
+    tag->stream_id = (pt[7] << 24) | flv_read24(pt + 8);
+
+    if (offset + tag->len + 15 > file_len)
+    {
+	if (policy & FLV_PARSE_VERBOSE)
+	    printf("File boundaries exceeded.\n");
+	return 0;
+    }
+    pt += tag->len + 11;
+    prev_len = (pt[0] << 24) | flv_read24(pt + 1);
+    if (prev_len + 4 != tag->len + 15)
+    {
+	if (policy & FLV_PARSE_VERBOSE)
+	    printf("*** Warning: Invalid tag, end of tag length mismatch (%i != %i)\n",
+		   prev_len + 4, tag->len + 15);
+	return 0;
+    }
+    return 1;
+}
+
+// Tag at pt may still be in the works: header or announced body not there yet.
+FLV_INLINE int flv_parse_partial(const uchar *pt, const uchar *end)
+{
+    if (end - pt < 11)
+	return 1;
+    if (!(pt[0] == 0x08 || pt[0] == 0x09 || pt[0] == 0x12))
+	return 0;		// garbage, let the loop deal with it
+    return (end - pt < flv_read24(pt + 1) + 15);
+}
+
+/* Walk tags from offset. on_tag() returns 0 to stop (offset is left on that
+ * tag). Tolerant loops call on_bad() on invalid tags, which returns where to
+ * go on (> pt) or 0 to stop; without on_bad they go on at pt + 1. */
+FLV_INLINE long flv_parse_loop(struct flv_parse *p, long offset, int policy,
+	int (*on_tag)(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag),
+	const uchar *(*on_bad)(struct flv_parse *p, const uchar *pt))
+{
+    const uchar *beg = p->beg;
+    const uchar *end = beg + p->file_len;
+    const uchar *pt = beg + offset;
+    const uchar *next;
+    struct flv_tag tag;
+
+    p->bad = 0;
+    while (pt < end)
+    {
+	if ((policy & FLV_PARSE_FOLLOW) && flv_parse_partial(pt, end))
+	    break;
+	if (!flv_parse_tag(pt, beg, p->file_len, policy, &tag))
+	{
+	    if (!(policy & FLV_PARSE_TOLERANT))
+	    {
+		p->bad = 1;
+		break;
+	    }
+	    next = (on_bad ? on_bad(p, pt) : pt + 1);
+	    if (!next)
+		break;
+	    pt = next;
+	    continue;
+	}
+	if ((policy & FLV_PARSE_TIMES) && tag.type != 0x12)
+	{
+	    if (p->min_time == -1 || tag.timestamp < p->min_time)
+		p->min_time = tag.timestamp;
+	    if (tag.timestamp > p->max_time)
+		p->max_time = tag.timestamp;
+	}
+	if (!on_tag(p, pt, &tag))
+	    break;
+	pt += tag.len + 15;
+    }
+    p->offset = pt - beg;
+    return p->offset;
+}
+
+#endif
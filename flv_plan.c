@@ -0,0 +1,178 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flv_plan.h"
+
+#define FLV_TYPE_META 0x12
+
+static void put_number(unsigned char *pt, uint32_t n, int bytes)
+{
+    int i;
+    for (i = bytes - 1; i >= 0; i--, n >>= 8)
+	pt[i] = n;
+}
+
+static unsigned char *amf_number(unsigned char *pt, const char *name, double d)
+{
+    union { double d; uint64_t n; } u;
+    int i, len = strlen(name);
+
+    put_number(pt, len, 2);
+    memcpy(pt + 2, name, len);
+    pt += 2 + len;
+    *pt++ = 0;			// number
+    u.d = d;
+    for (i = 0; i < 8; i++)
+	*pt++ = u.n >> (56 - 8 * i);
+    return pt;
+}
+
+// Tag header, body is at pt + 11, PreviousTagSize added by tag_end()
+static void tag_begin(unsigned char *pt, int type, uint32_t time)
+{
+    pt[0] = type;
+    put_number(pt + 4, time, 3);
+    pt[7] = time >> 24;
+    put_number(pt + 8, 0, 3);
+}
+
+static unsigned char *tag_end(unsigned char *tag, unsigned char *body_end)
+{
+    int len = body_end - tag - 11;
+    put_number(tag + 1, len, 3);
+    put_number(body_end, len + 11, 4);
+    return body_end + 4;
+}
+
+static int add_range(struct flv_plan *plan, uint64_t offset, uint64_t len, int *max)
+{
+    struct flv_range *r;
+
+    plan->total += len;
+    if (plan->nranges)
+    {
+	r = &plan->ranges[plan->nranges - 1];
+	if (r->offset + r->len == offset)
+	{
+	    r->len += len;
+	    return 1;
+	}
+    }
+    if (plan->nranges == *max)
+    {
+	*max *= 2;
+	r = realloc(plan->ranges, *max * sizeof(*r));
+	if (!r)
+	    return 0;
+	plan->ranges = r;
+    }
+    plan->ranges[plan->nranges].offset = offset;
+    plan->ranges[plan->nranges++].len = len;
+    return 1;
+}
+
+int flv_plan_make(const struct flv_index *idx, const unsigned char *beg,
+		  uint32_t begin, uint32_t end, struct flv_plan *plan)
+{
+    uint32_t i, start, stop, config[2] = { idx->ntags, idx->ntags };
+    int has_video = 0, max_ranges = 4, prefix_size = 13 + 256;
+    unsigned char *pt, *meta;
+    uint64_t filesize;
+
+    memset(plan, 0, sizeof(*plan));
+    for (i = 0; i < idx->ntags && !has_video; i++)
+	has_video = (FLV_TAG_TYPE(idx->flags[i]) == FLV_TAG_VIDEO);
+
+    // Start on a keyframe, audio-only files anywhere.
+    start = (has_video ? flv_index_keyframe(idx, begin) : flv_index_seek(idx, begin));
+    if (start == idx->ntags)
+	return 0;
+    if (idx->sorted)
+	stop = (end == UINT32_MAX ? idx->ntags : flv_index_seek(idx, end + 1));
+    else
+	for (stop = start; stop < idx->ntags && idx->times[stop] <= end; stop++)
+	    ;
+    plan->begin = idx->times[start];
+    plan->end = plan->begin;
+
+    // Last sequence headers before start go in prefix.
+    for (i = start; i-- > 0 && (config[0] == idx->ntags || config[1] == idx->ntags); )
+	if ((idx->flags[i] & FLV_TAG_CONFIG) &&
+	    config[FLV_TAG_TYPE(idx->flags[i])] == idx->ntags)
+	{
+	    config[FLV_TAG_TYPE(idx->flags[i])] = i;
+	    prefix_size += idx->sizes[i] + 15;
+	}
+
+    plan->ranges = malloc(max_ranges * sizeof(*plan->ranges));
+    plan->prefix = malloc(prefix_size);
+    if (!plan->ranges || !plan->prefix)
+    {
+	flv_plan_free(plan);
+	return 0;
+    }
+
+    // Ranges: whole tags, except onMetaData.
+    for (i = start; i < stop; i++)
+    {
+	if (FLV_TAG_TYPE(idx->flags[i]) == FLV_TAG_META)
+	    continue;
+	if (idx->times[i] > plan->end)
+	    plan->end = idx->times[i];
+	if (!add_range(plan, idx->offsets[i], idx->sizes[i] + 15, &max_ranges))
+	{
+	    flv_plan_free(plan);
+	    return 0;
+	}
+    }
+
+    // Prefix
+    pt = plan->prefix;
+    memcpy(pt, beg, 5);		// signature, version, flags
+    put_number(pt + 5, 9, 4);
+    put_number(pt + 9, 0, 4);
+    pt += 13;
+
+    meta = pt;
+    tag_begin(meta, FLV_TYPE_META, plan->begin);
+    pt = meta + 11;
+    *pt++ = 2;			// string
+    put_number(pt, 10, 2);
+    memcpy(pt + 2, "onMetaData", 10);
+    pt += 12;
+    *pt++ = 8;			// ECMA array
+    put_number(pt, 2, 4);
+    pt += 4;
+    pt = amf_number(pt, "duration", (plan->end - plan->begin) / 1000.0);
+    // filesize: prefix size is known before writing it, everything's fixed size
+    filesize = (pt - plan->prefix) + 2 + 8 + 1 + 8 + 3 + 4;
+    for (i = 0; i < 2; i++)
+	if (config[i] != idx->ntags)
+	    filesize += idx->sizes[config[i]] + 15;
+    plan->total += filesize;
+    pt = amf_number(pt, "filesize", plan->total);
+    *pt++ = 0; *pt++ = 0; *pt++ = 9;	// array end
+    pt = tag_end(meta, pt);
+
+    for (i = 0; i < 2; i++)
+    {
+	uint32_t n = config[i];
+	if (n == idx->ntags)
+	    continue;
+	memcpy(pt, beg + idx->offsets[n], idx->sizes[n] + 15);
+	put_number(pt + 4, plan->begin, 3);	// with the rest
+	pt[7] = plan->begin >> 24;
+	pt += idx->sizes[n] + 15;
+    }
+    plan->prefix_len = pt - plan->prefix;
+    return 1;
+}
+
+void flv_plan_free(struct flv_plan *plan)
+{
+    free(plan->prefix);
+    free(plan->ranges);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,34 @@
+#ifndef FLV_PLAN_H
+#define FLV_PLAN_H
+
+#include "flv_index.h"
+
+/* Cut plan: what to send for a time range without copying the file.
+ *
+ * Output is prefix (FLV header, onMetaData, sequence headers) followed by
+ * ranges of the original file, in order. Ranges start on the first keyframe
+ * >= begin and are made of whole tags, so they can go out with sendfile().
+ * Timestamps are left as they are, like flv_cut.
+ */
+
+struct flv_range
+{
+    uint64_t	offset;
+    uint64_t	len;
+};
+
+struct flv_plan
+{
+    unsigned char	*prefix;
+    int			prefix_len;
+    struct flv_range	*ranges;
+    int			nranges;
+    uint32_t		begin, end;	// actual times covered
+    uint64_t		total;		// output size
+};
+
+int flv_plan_make(const struct flv_index *idx, const unsigned char *beg,
+		  uint32_t begin, uint32_t end, struct flv_plan *plan);
+void flv_plan_free(struct flv_plan *plan);
+
+#endif
@@ -0,0 +1,67 @@
+
+#define _GNU_SOURCE		// SEEK_DATA, SEEK_HOLE
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_scan.h"
+
+// Don't bother with lseek() for zero runs shorter than that.
+#define SHORT_RUN	4096
+
+// First non zero byte in [pt, end), 64 bytes at a time (vectorized).
+static const unsigned char *zero_end(const unsigned char *pt, const unsigned char *end)
+{
+    while (pt < end && ((uintptr_t)pt & 63))
+    {
+	if (*pt)
+	    return pt;
+	pt++;
+    }
+    while (end - pt >= 64)
+    {
+	uint64_t w[8], or = 0;
+	int i;
+	memcpy(w, pt, 64);
+	for (i = 0; i < 8; i++)
+	    or |= w[i];
+	if (or)
+	    break;
+	pt += 64;
+    }
+    while (pt < end && !*pt)
+	pt++;
+    return pt;
+}
+
+const unsigned char *flv_skip_missing(int fd, const unsigned char *beg,
+				      const unsigned char *pt, const unsigned char *end)
+{
+    const unsigned char *limit = (end - pt > SHORT_RUN ? pt + SHORT_RUN : end);
+
+    pt = zero_end(pt, limit);
+    if (pt < limit || pt == end)
+	return pt;
+
+    // Long run: ask the filesystem where data is, only scan that.
+    while (pt < end && !*pt)
+    {
+	off_t off = pt - beg;
+	off_t data = lseek(fd, off, SEEK_DATA);
+	off_t hole;
+
+	if (data == -1 && errno == ENXIO)	// hole up to the end
+	    return end;
+	if (data > off)
+	{
+	    pt = (data < end - beg ? beg + data : end);
+	    continue;
+	}
+	hole = lseek(fd, off, SEEK_HOLE);
+	limit = (hole > off && hole < end - beg ? beg + hole : end);
+	pt = zero_end(pt, limit);
+    }
+    return pt;
+}
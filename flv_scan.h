@@ -0,0 +1,16 @@
+#ifndef FLV_SCAN_H
+#define FLV_SCAN_H
+
+/* Resync over missing data in broken files: preallocated downloads are
+ * full of holes / zeros where nothing was written. No tag starts with a
+ * zero byte, so these can be skipped at once instead of byte by byte.
+ */
+
+// Smaller zero runs are just skipped, not reported.
+#define MISSING_MIN	512
+
+// End of holes and zeros starting at pt (pt if *pt isn't zero).
+const unsigned char *flv_skip_missing(int fd, const unsigned char *beg,
+				      const unsigned char *pt, const unsigned char *end);
+
+#endif
@@ -0,0 +1,391 @@
+
+#define _GNU_SOURCE		// fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/falloc.h>
+
+#include "flv_index.h"
+#include "flv_codec.h"
+
+#define uchar unsigned char
+
+#define FLV_TYPE_META 0x12
+
+// Smallest padding property: name, long string type, length
+#define PAD_NAME	"padding"
+#define PAD_MIN		(2 + 7 + 1 + 4)
+
+int		force_rewrite = 0;
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_setmeta [--rewrite]  file.flv\n");
+    printf("\n");
+    printf("  Write onMetaData for file.flv in place: duration, filesize, codecs,\n");
+    printf("  picture size and keyframes table (for seeking), from the tags.\n");
+    printf("\n");
+    printf("  If the new tag doesn't fit where the old one was, room is made at\n");
+    printf("  the beginning of the file with fallocate(FALLOC_FL_INSERT_RANGE)\n");
+    printf("  (ext4, xfs), so the file isn't copied. Slack goes in a padding\n");
+    printf("  property inside the tag. Otherwise, or with --rewrite, the file is\n");
+    printf("  rewritten next to the original and renamed.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+void my_pwrite(int fd, const void *buf, size_t count, off_t offset, const char *fname)
+{
+    while (count)
+    {
+	ssize_t ret = pwrite(fd, buf, count, offset);
+	if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+	buf = (const uchar*)buf + ret;
+	count -= ret;
+	offset += ret;
+    }
+}
+
+int read_number(const uchar *pt, int bytes)
+{
+    int i, len = 0;
+    for (i = 0; i < bytes; i++)
+    {
+	len = len << 8;
+	len |= pt[i];
+    }
+    return len;
+}
+
+void put_number(uchar *pt, unsigned int n, int bytes)
+{
+    int i;
+    for (i = bytes - 1; i >= 0; i--, n >>= 8)
+	pt[i] = n;
+}
+
+uchar		*head_beg = 0;
+const char	*head_fname = 0;
+int		head_fd = 0;
+off_t		head_len = 0;
+uchar		flv_header[13];		// mapping shifts after insert
+
+
+/**************************************************************************/
+/* onMetaData */
+
+// What goes in it, from the tags.
+struct meta_info
+{
+    double	duration;
+    int		videocodecid, audiocodecid;
+    int		width, height;
+    uint32_t	nkeyframes;
+    uint32_t	*keyframes;	// tag numbers
+};
+
+struct meta_info	info;
+struct flv_index	idx;
+
+// AMF writer, only counts if buf is 0.
+struct amf
+{
+    uchar	*buf;
+    size_t	len;
+};
+
+void amf_bytes(struct amf *a, const void *data, size_t len)
+{
+    if (a->buf)
+	memcpy(a->buf + a->len, data, len);
+    a->len += len;
+}
+
+void amf_name(struct amf *a, const char *name)
+{
+    uchar b[2];
+    put_number(b, strlen(name), 2);
+    amf_bytes(a, b, 2);
+    amf_bytes(a, name, strlen(name));
+}
+
+void amf_double(struct amf *a, double d)
+{
+    union { double d; unsigned long long n; } u;
+    uchar b[9];
+    int i;
+    u.d = d;
+    b[0] = 0;			// number
+    for (i = 0; i < 8; i++)
+	b[1 + i] = u.n >> (56 - 8 * i);
+    amf_bytes(a, b, 9);
+}
+
+void amf_number(struct amf *a, const char *name, double d)
+{
+    amf_name(a, name);
+    amf_double(a, d);
+}
+
+/* Tag body. Keyframe positions are where tags end up: old offset + shift.
+ * pad: bytes of padding property (0 or >= PAD_MIN). */
+void build_meta(struct amf *a, off_t shift, off_t filesize, size_t pad)
+{
+    uchar b[5];
+    uint32_t i;
+
+    b[0] = 2;			// string
+    amf_bytes(a, b, 1);
+    amf_name(a, "onMetaData");
+    b[0] = 8;			// ECMA array
+    put_number(b + 1, 0, 4);
+    amf_bytes(a, b, 5);
+
+    amf_number(a, "duration", info.duration);
+    amf_number(a, "filesize", filesize);
+    if (info.videocodecid)
+	amf_number(a, "videocodecid", info.videocodecid);
+    if (info.width)
+    {
+	amf_number(a, "width", info.width);
+	amf_number(a, "height", info.height);
+    }
+    if (info.audiocodecid)
+	amf_number(a, "audiocodecid", info.audiocodecid);
+
+    if (info.nkeyframes)
+    {
+	amf_name(a, "keyframes");
+	b[0] = 3;		// object
+	amf_bytes(a, b, 1);
+	amf_name(a, "filepositions");
+	b[0] = 0x0a;		// strict array
+	put_number(b + 1, info.nkeyframes, 4);
+	amf_bytes(a, b, 5);
+	for (i = 0; i < info.nkeyframes; i++)
+	    amf_double(a, idx.offsets[info.keyframes[i]] + shift);
+	amf_name(a, "times");
+	amf_bytes(a, b, 5);
+	for (i = 0; i < info.nkeyframes; i++)
+	    amf_double(a, idx.times[info.keyframes[i]] / 1000.0);
+	b[0] = 0; b[1] = 0; b[2] = 9;	// object end
+	amf_bytes(a, b, 3);
+    }
+
+    if (pad)			// long string, filled with spaces
+    {
+	amf_name(a, PAD_NAME);
+	b[0] = 0x0c;
+	put_number(b + 1, pad - PAD_MIN, 4);
+	amf_bytes(a, b, 5);
+	if (a->buf)
+	    memset(a->buf + a->len, ' ', pad - PAD_MIN);
+	a->len += pad - PAD_MIN;
+    }
+    b[0] = 0; b[1] = 0; b[2] = 9;	// array end
+    amf_bytes(a, b, 3);
+}
+
+void get_info()
+{
+    struct avc_config avc;
+    uint32_t i, max_time = 0;
+
+    ASSERT(flv_index_build(&idx, head_beg, head_len),
+	   "file %s: invalid FLV header\n", head_fname);
+    ASSERT(idx.end == head_len, "invalid tag found, aborting. Fix file first.\n");
+
+    info.keyframes = malloc((idx.ntags + 1) * sizeof(uint32_t));
+    ASSERT(info.keyframes, "Out of memory\n");
+    for (i = 0; i < idx.ntags; i++)
+    {
+	const uchar *pt = head_beg + idx.offsets[i];
+	int len = idx.sizes[i];
+
+	if (idx.times[i] > max_time)
+	    max_time = idx.times[i];
+	if (!len)
+	    continue;
+	if (FLV_TAG_TYPE(idx.flags[i]) == FLV_TAG_VIDEO)
+	{
+	    if (!info.videocodecid)
+		info.videocodecid = pt[11] & 0xf;
+	    if ((idx.flags[i] & FLV_TAG_CONFIG) && !info.width && len > 5 &&
+		parse_avc_config(pt + 16, len - 5, &avc))
+	    {
+		info.width = avc.width;
+		info.height = avc.height;
+	    }
+	    if (idx.flags[i] & FLV_TAG_KEY)
+		info.keyframes[info.nkeyframes++] = i;
+	}
+	if (FLV_TAG_TYPE(idx.flags[i]) == FLV_TAG_AUDIO && !info.audiocodecid)
+	    info.audiocodecid = pt[11] >> 4;
+    }
+    info.duration = max_time / 1000.0;
+}
+
+
+/**************************************************************************/
+
+// Write header + meta tag of exactly tag_size bytes in buf.
+void make_head(uchar *buf, size_t tag_size, off_t shift, off_t filesize)
+{
+    struct amf a = { buf + 13 + 11, 0 };
+    size_t body = tag_size - 15;
+    struct amf count = { 0, 0 };
+
+    build_meta(&count, 0, 0, 0);
+    memcpy(buf, flv_header, 13);
+    buf += 13;
+    buf[0] = FLV_TYPE_META;
+    put_number(buf + 1, body, 3);
+    put_number(buf + 4, 0, 4);	// timestamp
+    put_number(buf + 8, 0, 3);
+    build_meta(&a, shift, filesize, (body > count.len ? body - count.len : 0));
+    put_number(buf + 11 + body, body + 11, 4);
+}
+
+int main(int ac, char **av)
+{
+    struct amf count = { 0, 0 };
+    size_t needed, tag_size, old_size = 0;
+    off_t shift, insert = 0, blksize;
+    struct stat st;
+    uchar *buf;
+
+    ac--; av++;
+    if (ac && !strcmp(*av, "--rewrite"))
+    {
+	force_rewrite = 1;
+	ac--; av++;
+    }
+    if (ac != 1)
+	usage();
+
+    head_fname = *av;
+    head_fd = my_open(head_fname, O_RDWR, 0);
+    head_len = get_file_len(head_fd);
+    ASSERT(head_len > 13, "file %s: invalid FLV header\n", head_fname);
+    head_beg = my_mmap(0, head_len, PROT_READ, MAP_SHARED, head_fd, 0);
+    ASSERT(!strncmp((char*)head_beg, "FLV", 3) && read_number(head_beg + 5, 4) == 9,
+	   "file %s: invalid FLV header\n", head_fname);
+    memcpy(flv_header, head_beg, 13);
+
+    get_info();
+    // Existing onMetaData, replaced
+    if (idx.ntags && FLV_TAG_TYPE(idx.flags[0]) == FLV_TAG_META &&
+	idx.offsets[0] == 13)
+	old_size = idx.sizes[0] + 15;
+
+    build_meta(&count, 0, 0, 0);
+    needed = count.len + 15;
+
+    fstat(head_fd, &st);
+    blksize = st.st_blksize;
+    if (needed <= old_size &&
+	(needed == old_size || old_size - needed >= PAD_MIN))
+	tag_size = old_size;		// fits
+    else
+    {
+	// Insert whole blocks, padding must be big enough for its header.
+	insert = (needed - old_size + PAD_MIN + blksize - 1) / blksize * blksize;
+	tag_size = old_size + insert;
+    }
+    shift = tag_size - old_size;
+
+    buf = calloc(1, 13 + tag_size);
+    ASSERT(buf, "Out of memory\n");
+
+    if (insert && !force_rewrite &&
+	!fallocate(head_fd, FALLOC_FL_INSERT_RANGE, 0, insert))
+    {
+	// mapping now shows the shifted file, header and tags info saved before
+	make_head(buf, tag_size, shift, head_len + insert);
+	printf("%s: inserted %li bytes at beginning of file\n", head_fname, (long)insert);
+    }
+    else if (insert || force_rewrite)
+    {
+	char tmp[4096];
+	int fd;
+
+	if (insert && !force_rewrite)
+	    printf("%s: can't insert range (%s), rewriting file.\n", head_fname, strerror(errno));
+	// rewrite: no need for block alignment
+	tag_size = needed;
+	shift = tag_size - old_size;
+	make_head(buf, tag_size, shift, head_len + shift);
+
+	ASSERT(snprintf(tmp, sizeof(tmp), "%s.setmeta", head_fname) < sizeof(tmp),
+	       "File name too long\n");
+	fd = my_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	my_pwrite(fd, buf, 13 + tag_size, 0, tmp);
+	my_pwrite(fd, head_beg + 13 + old_size, head_len - 13 - old_size, 13 + tag_size, tmp);
+	if (close(fd) || rename(tmp, head_fname))
+	{
+	    perror(tmp);
+	    unlink(tmp);
+	    exit(1);
+	}
+	printf("%s: rewritten\n", head_fname);
+	return 0;
+    }
+    else
+	make_head(buf, tag_size, shift, head_len);
+
+    // Header and new tag over the old ones (+ inserted range).
+    my_pwrite(head_fd, buf, 13 + tag_size, 0, head_fname);
+    printf("%s: onMetaData written (%u keyframes)\n", head_fname, info.nkeyframes);
+    close(head_fd);
+    return 0;
+}
@@ -0,0 +1,501 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_cache.h"
+#include "flv_map.h"
+#include "flv_follow.h"
+#include "flv_parse.h"
+
+
+#define uchar unsigned char
+
+#define FLV_TYPE_AUDIO 0x08
+#define FLV_TYPE_VIDEO 0x09
+#define FLV_TYPE_META 0x12
+
+// Number of tags checked at each end of the file for the quick answer.
+#define HEAD_TAGS 16
+#define TAIL_TAGS 16
+
+// Same threshold as flv_debug.
+#define GAP_THRESHOLD 500
+
+#define MAX_RANGES 256
+
+int		show_gaps = 0;
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_times [--gaps] file.flv|pack.flvpack[:name] [...]\n");
+    printf("  flv_times --follow file.flv [...]\n");
+    printf("\n");
+    printf("  Show time ranges of frames in flv files.\n");
+    printf("  Only the first and last few tags are read: the end of the file is\n");
+    printf("  found by walking back the PreviousTagSize chain from EOF.\n");
+    printf("  The whole file is scanned only with --gaps, or if the chain is broken.\n");
+    printf("  Results are kept in the scan cache ($FLV_CACHE or ~/.flv_cache).\n");
+    printf("  For a pack, times of all files in it come from its index.\n");
+    printf("\n");
+    printf("  --follow watches files being written (inotify) and shows duration,\n");
+    printf("  bitrate and gaps so far each time they grow, parsing new data only.\n");
+    printf("  Files are followed until their writer closes them, they're truncated,\n");
+    printf("  or nothing is written to them for %i s.\n", FLV_FOLLOW_IDLE);
+    exit(1);
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+
+char time_buf[20];
+char time_buf2[20];
+
+char* format_time(int time, char *str)
+{
+    int m, s, ms;
+    ms = time % 1000;
+    s = (time / 1000) % 60;
+    m = time / (60 * 1000);
+    sprintf(str, "%02i:%02i:%03i", m, s, ms);
+    return str;
+}
+
+int min_times[MAX_RANGES];
+int max_times[MAX_RANGES];
+int nranges = 0;
+
+struct flv_summary summary;
+
+struct scan_state
+{
+    int		prev_time;
+    int		in_error;
+};
+
+int scan_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    struct flv_summary *sum = &summary;
+    struct scan_state *st = p->arg;
+    int type = tag->type, len = tag->len, timestamp = tag->timestamp;
+
+    st->in_error = 0;
+    if (type == FLV_TYPE_AUDIO)
+	sum->audio_tags++;
+    if (type == FLV_TYPE_VIDEO)
+    {
+	sum->video_tags++;
+	// not counting AVC sequence header
+	if (len > 1 && (pt[11] >> 4) == 1 &&
+	    !((pt[11] & 0xf) == 7 && pt[12] == 0))
+	    sum->keyframes++;
+    }
+    if (type == FLV_TYPE_META)
+	sum->meta_tags++;
+    if (timestamp < st->prev_time)
+	sum->backward++;
+
+    if (st->prev_time == -1 ||
+	(timestamp - st->prev_time > GAP_THRESHOLD && nranges < MAX_RANGES))
+    {
+	min_times[nranges] = max_times[nranges] = timestamp;
+	nranges++;
+    }
+    st->prev_time = timestamp;
+
+    if (timestamp < min_times[nranges - 1])
+	min_times[nranges - 1] = timestamp;
+    if (timestamp > max_times[nranges - 1])
+	max_times[nranges - 1] = timestamp;
+    return 1;
+}
+
+// Count each run of garbage once, resync byte by byte.
+const uchar *scan_bad(struct flv_parse *p, const uchar *pt)
+{
+    struct flv_summary *sum = &summary;
+    struct scan_state *st = p->arg;
+
+    if (!st->in_error && sum->errors < FLV_SUMMARY_ERRORS)
+	sum->error_offsets[sum->errors] = pt - p->beg;
+    sum->errors += !st->in_error;
+    st->in_error = 1;
+    return pt + 1;
+}
+
+// Walk the whole file, same logic as flv_debug.
+void scan_forward(const uchar *beg, off_t file_len)
+{
+    struct flv_summary *sum = &summary;
+    struct scan_state st = { -1, 0 };
+    struct flv_parse p;
+
+    nranges = 0;
+    memset(sum, 0, sizeof(*sum));
+    sum->flags = FLV_SUMMARY_FULL;
+    flv_parse_init(&p, beg, file_len, &st);
+    flv_parse_loop(&p, 13, FLV_PARSE_TOLERANT, scan_tag, scan_bad);
+}
+
+// Stop after HEAD_TAGS tags.
+int count_head_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    return (++*(int*)p->arg < HEAD_TAGS);
+}
+
+// Lowest timestamp among the first audio/video tags.
+int first_time(const uchar *beg, off_t file_len, int *first)
+{
+    struct flv_parse p;
+    int ntags = 0;
+
+    flv_parse_init(&p, beg, file_len, &ntags);
+    flv_parse_loop(&p, 13, FLV_PARSE_STRICT | FLV_PARSE_TIMES, count_head_tag, 0);
+    if (p.bad || p.min_time == -1)
+	return 0;
+    *first = p.min_time;
+    return 1;
+}
+
+// Highest timestamp among the last audio/video tags, walking backward
+// from EOF. Fails if the chain is broken (truncated file, garbage at the end ...)
+int last_time(const uchar *beg, off_t file_len, int *last)
+{
+    const uchar *end = beg + file_len;
+    const uchar *pt;
+    struct flv_tag tag;
+    int i, prev_len;
+    int found = 0;
+
+    for (i = 0; i < TAIL_TAGS && end - beg > 13; i++)
+    {
+	prev_len = (end[-4] << 24) | flv_read24(end - 3);
+	if (prev_len < 11 || prev_len + 4 > end - beg - 13)
+	    return 0;
+	pt = end - prev_len - 4;
+	if (!flv_parse_tag(pt, beg, file_len, FLV_PARSE_STRICT, &tag) ||
+	    pt + tag.len + 15 != end)
+	    return 0;
+	if (tag.type != FLV_TYPE_META &&
+	    (!found || tag.timestamp > *last))
+	{
+	    *last = tag.timestamp;
+	    found = 1;
+	}
+	end = pt;
+    }
+    return found;
+}
+
+// Cache summary -> time ranges.
+int cached_times(int fd)
+{
+    struct flv_summary *sum = &summary;
+    int i;
+
+    if (!flv_cache_lookup(fd, sum) ||
+	(show_gaps && !(sum->flags & FLV_SUMMARY_FULL)))
+	return 0;
+    nranges = sum->nranges;
+    for (i = 0; i < nranges; i++)
+    {
+	min_times[i] = sum->min_times[i];
+	max_times[i] = sum->max_times[i];
+    }
+    return 1;
+}
+
+// Time ranges -> cache summary.
+void cache_times(int fd)
+{
+    struct flv_summary *sum = &summary;
+    int i;
+
+    if (!(sum->flags & FLV_SUMMARY_FULL))
+	memset(sum, 0, sizeof(*sum));
+    if (nranges > FLV_SUMMARY_RANGES || !nranges)
+    {
+	// Doesn't fit, just keep the overall range.
+	sum->flags = 0;
+	sum->min_times[0] = min_times[0];
+	sum->max_times[0] = max_times[0];
+	for (i = 1; i < nranges; i++)
+	    if (max_times[i] > sum->max_times[0])
+		sum->max_times[0] = max_times[i];
+	sum->nranges = (nranges != 0);
+    }
+    else
+    {
+	sum->nranges = nranges;
+	for (i = 0; i < nranges; i++)
+	{
+	    sum->min_times[i] = min_times[i];
+	    sum->max_times[i] = max_times[i];
+	}
+    }
+    flv_cache_store(fd, sum);
+}
+
+void show_times(const char *fname)
+{
+    off_t file_len;
+    int first = 0, last = 0, i;
+    struct flv_map m;
+    const uchar *beg;
+
+    printf("%-45s: ", fname);
+    if (!flv_map_open(&m, fname))
+    {
+	if (errno == EINVAL)
+	    printf("not a flv file\n");
+	else
+	    perror("");
+	return;
+    }
+    beg = m.beg;
+    file_len = m.len;
+    // Pack members aren't cached: no file of their own to key on.
+    if (m.fd != -1 && cached_times(m.fd))
+	goto show;
+    if (file_len < 13)
+    {
+	printf("not a flv file\n");
+	flv_map_close(&m);
+	return;
+    }
+    if (strncmp((char*)beg, "FLV", 3))
+	printf("invalid FLV header, ");
+
+    summary.flags = 0;
+    if (!show_gaps &&
+	first_time(beg, file_len, &first) &&
+	last_time(beg, file_len, &last))
+    {
+	min_times[0] = first;
+	max_times[0] = last;
+	nranges = 1;
+    }
+    else
+	scan_forward(beg, file_len);
+    if (m.fd != -1)
+	cache_times(m.fd);
+
+ show:
+    printf("Time range: ");
+    for (i = 0; i < nranges; i++)
+	printf("[%s, %s] ",
+	       format_time(min_times[i], time_buf),
+	       format_time(max_times[i], time_buf2));
+    printf("\n");
+
+    flv_map_close(&m);
+}
+
+// Whole pack: from the index, unless gaps are wanted.
+void show_pack(const char *fname)
+{
+    struct flv_pack pk;
+    char member[8192];
+    uint32_t i;
+
+    if (!flv_pack_open(&pk, fname))
+    {
+	show_times(fname);
+	return;
+    }
+    for (i = 0; i < pk.n; i++)
+    {
+	const struct flv_pack_entry *e = &pk.entries[i];
+
+	snprintf(member, sizeof(member), "%s:%s", fname, flv_pack_name(&pk, e));
+	if (show_gaps)
+	{
+	    show_times(member);
+	    continue;
+	}
+	printf("%-45s: Time range: [%s, %s]\n", member,
+	       format_time(e->start, time_buf),
+	       format_time(e->start + e->duration, time_buf2));
+    }
+    flv_pack_close(&pk);
+}
+
+/**************************************************************************/
+/* --follow */
+
+struct follow_state
+{
+    struct flv_follow	f;
+    long		offset;		// next tag, 0 before the header
+    int			prev_time;
+    int			range_min, range_max;
+    int			duration;	// of ranges before the current one
+    int			gaps;
+    long		last_offset;	// at last report
+    int			last_time;
+};
+
+int follow_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    struct follow_state *fs = p->arg;
+    int timestamp = tag->timestamp;
+
+    if (tag->type == FLV_TYPE_META)
+	return 1;
+    if (fs->prev_time == -1)
+	fs->range_min = fs->range_max = timestamp;
+    else if (timestamp - fs->prev_time > GAP_THRESHOLD)
+    {
+	fs->gaps++;
+	fs->duration += fs->range_max - fs->range_min;
+	fs->range_min = fs->range_max = timestamp;
+    }
+    if (timestamp < fs->range_min)
+	fs->range_min = timestamp;
+    if (timestamp > fs->range_max)
+	fs->range_max = timestamp;
+    fs->prev_time = timestamp;
+    return 1;
+}
+
+void follow_report(struct follow_state *fs)
+{
+    int ms = fs->range_max - fs->last_time;
+
+    printf("%-45s: [%s] duration %s", fs->f.fname,
+	   format_time(fs->range_max, time_buf),
+	   format_time(fs->duration + fs->range_max - fs->range_min, time_buf2));
+    if (fs->last_time != -1 && ms > 0)
+	printf(", %li kbit/s", (fs->offset - fs->last_offset) * 8 / ms);
+    printf(", %i gap(s)%s\n", fs->gaps,
+	   (fs->f.truncated ? ", truncated" : fs->f.idle ? ", idle" :
+	    fs->f.done ? ", done" : ""));
+    fs->last_offset = fs->offset;
+    fs->last_time = fs->range_max;
+}
+
+// Parse what was added since last time.
+void follow_update(struct follow_state *fs)
+{
+    struct flv_parse p;
+
+    if (!flv_follow_update(&fs->f) || fs->f.len < 13)
+	return;
+    if (!fs->offset)
+    {
+	if (strncmp((char*)fs->f.beg, "FLV", 3))
+	{
+	    printf("%-45s: not a flv file\n", fs->f.fname);
+	    fs->f.done = 1;
+	    return;
+	}
+	fs->offset = 13;
+    }
+    flv_parse_init(&p, fs->f.beg, fs->f.len, fs);
+    flv_parse_loop(&p, fs->offset, FLV_PARSE_TOLERANT | FLV_PARSE_FOLLOW, follow_tag, 0);
+    if (p.offset == fs->offset)
+	return;
+    fs->offset = p.offset;
+    if (fs->prev_time != -1)
+	follow_report(fs);
+}
+
+// One inotify fd for all files, only the ones that changed get looked at.
+void follow_files(char **fnames, int n)
+{
+    struct follow_state *states = calloc(n, sizeof(*states));
+    struct flv_follow **files = calloc(n, sizeof(*files));
+    int ifd = flv_follow_init();
+    int i, left = 0;
+
+    if (!states || !files || ifd == -1)
+    {
+	perror("follow");
+	exit(1);
+    }
+    for (i = 0; i < n; i++)
+    {
+	struct follow_state *fs = &states[i];
+
+	files[i] = &fs->f;
+	fs->prev_time = fs->last_time = -1;
+	if (!flv_follow_open(&fs->f, ifd, fnames[i]))
+	    perror(fnames[i]);
+	else
+	    left++;
+    }
+
+    while (left)
+    {
+	for (i = 0; i < n; i++)
+	{
+	    struct follow_state *fs = &states[i];
+
+	    if (fs->f.fd == -1 || !(fs->f.changed || fs->f.done))
+		continue;
+	    follow_update(fs);
+	    if (!fs->f.done)
+		continue;
+	    follow_report(fs);
+	    flv_follow_close(&fs->f, ifd);
+	    left--;
+	}
+	fflush(stdout);
+	if (left && !flv_follow_wait(ifd, files, n))
+	{
+	    perror("inotify");
+	    exit(1);
+	}
+    }
+    close(ifd);
+    free(files);
+    free(states);
+}
+
+int main(int ac, char **av)
+{
+    ac--; av++;
+    if (ac && !strcmp(*av, "--gaps"))
+    {
+	show_gaps = 1;
+	ac--; av++;
+    }
+    if (ac && !strcmp(*av, "--follow"))
+    {
+	ac--; av++;
+	if (!ac)
+	    usage();
+	follow_files(av, ac);
+	return 0;
+    }
+    if (!ac)
+	usage();
+
+    flv_cache_open();
+    for (; ac; ac--, av++)
+    {
+	int len = strlen(*av);
+	if (len > 8 && !strcmp(*av + len - 8, ".flvpack"))
+	    show_pack(*av);
+	else
+	    show_times(*av);
+    }
+
+    return 0;
+}
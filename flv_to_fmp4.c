@@ -0,0 +1,754 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "flv_codec.h"
+#include "flv_parse.h"
+
+#define FLV_TYPE_AUDIO 0x08
+#define FLV_TYPE_VIDEO 0x09
+#define FLV_TYPE_META 0x12
+
+// Tags looked at for sequence headers before writing moov.
+#define PRESCAN_TAGS	1000
+
+// Minimum fragment duration (ms), fragments start on video keyframes.
+int		frag_duration = 0;
+// Fragment duration for audio only files.
+#define AUDIO_FRAG_DURATION	1000
+
+void die(char *str)
+{
+    printf("%s", str);
+    exit(1);
+}
+
+void usage(void)
+{
+    printf("Usage:\n");
+    printf("  flv_to_fmp4 [-f frag_ms] file.flv out.mp4\n");
+    printf("\n");
+    printf("  Remux H.264 / AAC file.flv to fragmented mp4 (no re-encoding).\n");
+    printf("  A new fragment (moof + mdat) starts on each video keyframe\n");
+    printf("  at least frag_ms after the previous one (default: every keyframe).\n");
+    printf("  Other codecs are skipped.\n");
+    printf("\n");
+    exit(1);
+}
+
+#define ASSERT(check, format, args...)  do  {	\
+	if (!(check))				\
+	{ printf(format, ##args); exit(1); }		\
+    } while(0)
+
+int my_open(const char *fname, int flags, mode_t mode)
+{
+    int ret = open(fname, flags, mode);
+    if (ret == -1)
+	{
+	    perror(fname);
+	    exit(1);
+	}
+    return ret;
+}
+
+void *my_mmap(void *addr, size_t length, int prot, int flags,
+	      int fd, off_t offset)
+{
+    void *ret = mmap(addr, length, prot, flags, fd, offset);
+    if (ret == MAP_FAILED)
+	{
+	    perror("mmap: ");
+	    exit(1);
+	}
+    return ret;
+}
+
+int file_exists(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) == -1 &&
+	errno == ENOENT)
+	return 0;
+    return 1;
+}
+
+off_t get_file_len(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+	perror("fstat: ");
+	exit(1);
+    }
+    return st.st_size;
+}
+
+
+uchar		*head_beg = 0;
+const char	*head_fname = 0;
+int		head_fd = 0;
+off_t		head_len = 0;
+
+const char	*out_fname = 0;
+int		out_fd = 0;
+
+ssize_t my_write(int fd, const void *buf, size_t count)
+{
+    int total = 0;
+    while (total != count)
+    {
+	int ret = write(fd, buf + total, count - total);
+	if (ret == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	total += ret;
+    }
+    return total;
+}
+
+// iovecs per writev() call
+#define MAX_IOVS	1024
+
+void my_writev(int fd, struct iovec *iov, int n)
+{
+    while (n)
+    {
+	ssize_t ret = writev(fd, iov, (n < MAX_IOVS ? n : MAX_IOVS));
+	if (ret == -1)
+	{
+	    perror(out_fname);
+	    exit(1);
+	}
+	while (n && ret >= iov->iov_len)
+	{
+	    ret -= iov->iov_len;
+	    iov++; n--;
+	}
+	if (n)
+	{
+	    iov->iov_base = (uchar*)iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
+    }
+}
+
+
+/**************************************************************************/
+/* Box writing */
+
+struct buf
+{
+    uchar	*data;
+    int		len;
+    int		size;
+};
+
+void put_bytes(struct buf *b, const void *data, int len)
+{
+    if (b->len + len > b->size)
+    {
+	b->size = (b->size ? b->size * 2 : 4096) + len;
+	b->data = realloc(b->data, b->size);
+	ASSERT(b->data, "out of memory\n");
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+void put_number(struct buf *b, unsigned long long n, int bytes)
+{
+    uchar tmp[8];
+    int i;
+    for (i = bytes - 1; i >= 0; i--, n >>= 8)
+	tmp[i] = n;
+    put_bytes(b, tmp, bytes);
+}
+
+#define put8(b, n)	put_number(b, n, 1)
+#define put16(b, n)	put_number(b, n, 2)
+#define put24(b, n)	put_number(b, n, 3)
+#define put32(b, n)	put_number(b, n, 4)
+#define put64(b, n)	put_number(b, n, 8)
+
+void put_zeros(struct buf *b, int n)
+{
+    while (n--)
+	put8(b, 0);
+}
+
+// Returns box offset, for box_end().
+int box_begin(struct buf *b, const char *type)
+{
+    int off = b->len;
+    put32(b, 0);
+    put_bytes(b, type, 4);
+    return off;
+}
+
+int full_box_begin(struct buf *b, const char *type, int version, int flags)
+{
+    int off = box_begin(b, type);
+    put8(b, version);
+    put24(b, flags);
+    return off;
+}
+
+void box_end(struct buf *b, int off)
+{
+    int len = b->len - off;
+    b->data[off] = len >> 24;
+    b->data[off + 1] = len >> 16;
+    b->data[off + 2] = len >> 8;
+    b->data[off + 3] = len;
+}
+
+void put_matrix(struct buf *b)
+{
+    put32(b, 0x00010000); put32(b, 0); put32(b, 0);
+    put32(b, 0); put32(b, 0x00010000); put32(b, 0);
+    put32(b, 0); put32(b, 0); put32(b, 0x40000000);
+}
+
+
+/**************************************************************************/
+/* Tracks */
+
+struct sample
+{
+    const uchar	*data;
+    int		size;
+    int		dts;
+    int		cts;		// composition offset
+    int		duration;
+    int		key;
+};
+
+struct track
+{
+    int			id;		// 0 if not present
+    int			video;
+    struct avc_config	avc;
+    struct aac_config	aac;
+
+    // Last sample, waiting for the next one to know its duration.
+    struct sample	pending;
+    int			has_pending;
+    int			last_duration;
+
+    // Samples of current fragment
+    struct sample	*samples;
+    int			nsamples;
+    int			max_samples;
+    int			data_offset_pos;	// trun data_offset in moof
+};
+
+struct track	video = { 0, 1 };
+struct track	audio = { 0, 0 };
+struct track	*tracks[2] = { &video, &audio };
+
+int		time_base = -1;		// first timestamp, output starts at 0
+int		frag_start = -1;	// dts of current fragment's first sample
+unsigned int	frag_seq = 0;
+
+struct buf	box = { 0, 0, 0 };
+
+void add_sample(struct track *t, const struct sample *s)
+{
+    if (t->nsamples == t->max_samples)
+    {
+	t->max_samples = (t->max_samples ? t->max_samples * 2 : 256);
+	t->samples = realloc(t->samples, t->max_samples * sizeof(*s));
+	ASSERT(t->samples, "out of memory\n");
+    }
+    t->samples[t->nsamples++] = *s;
+    if (frag_start == -1)
+	frag_start = s->dts;
+}
+
+// New sample on track: previous one now has a duration.
+void push_sample(struct track *t, const struct sample *s)
+{
+    if (t->has_pending)
+    {
+	int d = s->dts - t->pending.dts;
+	t->pending.duration = (d >= 0 ? d : 0);
+	if (d > 0)
+	    t->last_duration = d;
+	add_sample(t, &t->pending);
+    }
+    t->pending = *s;
+    t->has_pending = 1;
+}
+
+void flush_pending(struct track *t)
+{
+    if (!t->has_pending)
+	return;
+    t->pending.duration = (t->last_duration ? t->last_duration :
+			   t->video ? 40 : 23);
+    add_sample(t, &t->pending);
+    t->has_pending = 0;
+}
+
+
+/**************************************************************************/
+/* moov */
+
+void write_avc1(struct buf *b, struct track *t)
+{
+    int off = box_begin(b, "avc1");
+    int off2;
+    put_zeros(b, 6);
+    put16(b, 1);		// data reference index
+    put_zeros(b, 16);
+    put16(b, t->avc.width);
+    put16(b, t->avc.height);
+    put32(b, 0x00480000);	// 72 dpi
+    put32(b, 0x00480000);
+    put32(b, 0);
+    put16(b, 1);		// frame count
+    put_zeros(b, 32);		// compressor name
+    put16(b, 0x18);		// depth
+    put16(b, 0xffff);
+
+    off2 = box_begin(b, "avcC");
+    put_bytes(b, t->avc.record, t->avc.record_len);
+    box_end(b, off2);
+    box_end(b, off);
+}
+
+void write_mp4a(struct buf *b, struct track *t)
+{
+    int off = box_begin(b, "mp4a");
+    int off2;
+    int asc_len = t->aac.asc_len;
+
+    put_zeros(b, 6);
+    put16(b, 1);		// data reference index
+    put_zeros(b, 8);
+    put16(b, t->aac.channels ? t->aac.channels : 2);
+    put16(b, 16);		// sample size
+    put_zeros(b, 4);
+    put32(b, (t->aac.sample_rate < 65536 ? t->aac.sample_rate << 16 : 0));
+
+    off2 = full_box_begin(b, "esds", 0, 0);
+    put8(b, 3);			// ES_Descriptor
+    put8(b, 3 + 2 + 13 + 2 + asc_len + 3);
+    put16(b, 0);		// ES_ID
+    put8(b, 0);
+    put8(b, 4);			// DecoderConfigDescriptor
+    put8(b, 13 + 2 + asc_len);
+    put8(b, 0x40);		// MPEG-4 audio
+    put8(b, 0x15);		// audio stream
+    put24(b, 0);		// buffer size
+    put32(b, 0);		// max bitrate
+    put32(b, 0);		// avg bitrate
+    put8(b, 5);			// DecoderSpecificInfo
+    put8(b, asc_len);
+    put_bytes(b, t->aac.asc, asc_len);
+    put8(b, 6);			// SLConfigDescriptor
+    put8(b, 1);
+    put8(b, 2);
+    box_end(b, off2);
+    box_end(b, off);
+}
+
+void write_trak(struct buf *b, struct track *t)
+{
+    int trak, mdia, minf, dinf, dref, stbl, stsd, off;
+
+    trak = box_begin(b, "trak");
+
+    off = full_box_begin(b, "tkhd", 0, 7);
+    put32(b, 0);		// creation time
+    put32(b, 0);		// modification time
+    put32(b, t->id);
+    put32(b, 0);
+    put32(b, 0);		// duration
+    put_zeros(b, 8);
+    put16(b, 0);		// layer
+    put16(b, 0);		// alternate group
+    put16(b, t->video ? 0 : 0x0100);	// volume
+    put16(b, 0);
+    put_matrix(b);
+    put32(b, t->video ? t->avc.width << 16 : 0);
+    put32(b, t->video ? t->avc.height << 16 : 0);
+    box_end(b, off);
+
+    mdia = box_begin(b, "mdia");
+    off = full_box_begin(b, "mdhd", 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 1000);		// timescale: flv timestamps are in ms
+    put32(b, 0);
+    put16(b, 0x55c4);		// 'und'
+    put16(b, 0);
+    box_end(b, off);
+
+    off = full_box_begin(b, "hdlr", 0, 0);
+    put32(b, 0);
+    put_bytes(b, t->video ? "vide" : "soun", 4);
+    put_zeros(b, 12);
+    put_bytes(b, t->video ? "VideoHandler" : "SoundHandler", 13);
+    box_end(b, off);
+
+    minf = box_begin(b, "minf");
+    if (t->video)
+    {
+	off = full_box_begin(b, "vmhd", 0, 1);
+	put_zeros(b, 8);
+    }
+    else
+    {
+	off = full_box_begin(b, "smhd", 0, 0);
+	put_zeros(b, 4);
+    }
+    box_end(b, off);
+
+    dinf = box_begin(b, "dinf");
+    dref = full_box_begin(b, "dref", 0, 0);
+    put32(b, 1);
+    off = full_box_begin(b, "url ", 0, 1);	// same file
+    box_end(b, off);
+    box_end(b, dref);
+    box_end(b, dinf);
+
+    stbl = box_begin(b, "stbl");
+    stsd = full_box_begin(b, "stsd", 0, 0);
+    put32(b, 1);
+    if (t->video)
+	write_avc1(b, t);
+    else
+	write_mp4a(b, t);
+    box_end(b, stsd);
+    // Empty tables, samples are in the fragments.
+    off = full_box_begin(b, "stts", 0, 0); put32(b, 0); box_end(b, off);
+    off = full_box_begin(b, "stsc", 0, 0); put32(b, 0); box_end(b, off);
+    off = full_box_begin(b, "stsz", 0, 0); put32(b, 0); put32(b, 0); box_end(b, off);
+    off = full_box_begin(b, "stco", 0, 0); put32(b, 0); box_end(b, off);
+    box_end(b, stbl);
+
+    box_end(b, minf);
+    box_end(b, mdia);
+    box_end(b, trak);
+}
+
+void write_moov()
+{
+    struct buf *b = &box;
+    int moov, mvex, off, i;
+
+    b->len = 0;
+    off = box_begin(b, "ftyp");
+    put_bytes(b, "iso6", 4);
+    put32(b, 0);
+    put_bytes(b, "iso6isomavc1mp41", 16);
+    box_end(b, off);
+
+    moov = box_begin(b, "moov");
+    off = full_box_begin(b, "mvhd", 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 1000);		// timescale
+    put32(b, 0);		// duration: unknown, fragmented
+    put32(b, 0x00010000);	// rate
+    put16(b, 0x0100);		// volume
+    put_zeros(b, 10);
+    put_matrix(b);
+    put_zeros(b, 24);
+    put32(b, 3);		// next track id
+    box_end(b, off);
+
+    for (i = 0; i < 2; i++)
+	if (tracks[i]->id)
+	    write_trak(b, tracks[i]);
+
+    mvex = box_begin(b, "mvex");
+    for (i = 0; i < 2; i++)
+	if (tracks[i]->id)
+	{
+	    off = full_box_begin(b, "trex", 0, 0);
+	    put32(b, tracks[i]->id);
+	    put32(b, 1);	// sample description index
+	    put32(b, 0);
+	    put32(b, 0);
+	    put32(b, 0);
+	    box_end(b, off);
+	}
+    box_end(b, mvex);
+    box_end(b, moov);
+
+    my_write(out_fd, b->data, b->len);
+}
+
+
+/**************************************************************************/
+/* Fragments */
+
+void write_traf(struct buf *b, struct track *t)
+{
+    int traf, off, i;
+
+    traf = box_begin(b, "traf");
+    off = full_box_begin(b, "tfhd", 0, 0x020000);	// default base is moof
+    put32(b, t->id);
+    box_end(b, off);
+
+    off = full_box_begin(b, "tfdt", 1, 0);
+    put64(b, t->samples[0].dts);
+    box_end(b, off);
+
+    if (t->video)	// data offset, duration, size, flags, composition offset
+	off = full_box_begin(b, "trun", 1, 0x000f01);
+    else		// data offset, duration, size
+	off = full_box_begin(b, "trun", 0, 0x000301);
+    put32(b, t->nsamples);
+    t->data_offset_pos = b->len;
+    put32(b, 0);
+    for (i = 0; i < t->nsamples; i++)
+    {
+	struct sample *s = &t->samples[i];
+	put32(b, s->duration);
+	put32(b, s->size);
+	if (t->video)
+	{
+	    put32(b, s->key ? 0x02000000 : 0x01010000);
+	    put32(b, s->cts);
+	}
+    }
+    box_end(b, off);
+    box_end(b, traf);
+}
+
+struct iovec	*frag_iov = 0;
+int		max_iov = 0;
+
+void write_fragment()
+{
+    struct buf *b = &box;
+    uchar mdat_head[8];
+    int moof, off, i, j, niov;
+    unsigned int data_off, mdat_len = 8;
+
+    if (!video.nsamples && !audio.nsamples)
+	return;
+
+    b->len = 0;
+    moof = box_begin(b, "moof");
+    off = full_box_begin(b, "mfhd", 0, 0);
+    put32(b, ++frag_seq);
+    box_end(b, off);
+    for (i = 0; i < 2; i++)
+	if (tracks[i]->nsamples)
+	    write_traf(b, tracks[i]);
+    box_end(b, moof);
+
+    // Samples follow each other in mdat, one track after the other.
+    data_off = b->len + 8;
+    niov = 2;
+    for (i = 0; i < 2; i++)
+    {
+	struct track *t = tracks[i];
+	if (!t->nsamples)
+	    continue;
+	b->data[t->data_offset_pos] = data_off >> 24;
+	b->data[t->data_offset_pos + 1] = data_off >> 16;
+	b->data[t->data_offset_pos + 2] = data_off >> 8;
+	b->data[t->data_offset_pos + 3] = data_off;
+	for (j = 0; j < t->nsamples; j++)
+	    data_off += t->samples[j].size;
+	niov += t->nsamples;
+    }
+    mdat_len = data_off - b->len;
+
+    if (niov > max_iov)
+    {
+	max_iov = niov * 2;
+	frag_iov = realloc(frag_iov, max_iov * sizeof(*frag_iov));
+	ASSERT(frag_iov, "out of memory\n");
+    }
+
+    // Sample data straight from the mapping.
+    mdat_head[0] = mdat_len >> 24;
+    mdat_head[1] = mdat_len >> 16;
+    mdat_head[2] = mdat_len >> 8;
+    mdat_head[3] = mdat_len;
+    memcpy(mdat_head + 4, "mdat", 4);
+    frag_iov[0].iov_base = b->data;
+    frag_iov[0].iov_len = b->len;
+    frag_iov[1].iov_base = mdat_head;
+    frag_iov[1].iov_len = 8;
+    niov = 2;
+    for (i = 0; i < 2; i++)
+    {
+	struct track *t = tracks[i];
+	for (j = 0; j < t->nsamples; j++, niov++)
+	{
+	    frag_iov[niov].iov_base = (void*)t->samples[j].data;
+	    frag_iov[niov].iov_len = t->samples[j].size;
+	}
+	t->nsamples = 0;
+    }
+    my_writev(out_fd, frag_iov, niov);
+    frag_start = -1;
+}
+
+
+/**************************************************************************/
+
+// Find sequence headers, so we know which tracks there are.
+// Stops when both are found, or after PRESCAN_TAGS tags.
+int prescan_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    int type = tag->type, len = tag->len;
+
+    if (type == FLV_TYPE_VIDEO && len > 5 && !video.id &&
+	(pt[11] & 0xf) == FLV_CODEC_AVC && pt[12] == 0)
+    {
+	ASSERT(parse_avc_config(pt + 16, len - 5, &video.avc),
+	       "Invalid AVC sequence header at offset %li\n", (long)(pt - p->beg));
+	video.id = 1;
+    }
+    if (type == FLV_TYPE_AUDIO && len > 2 && !audio.id &&
+	(pt[11] >> 4) == FLV_CODEC_AAC && pt[12] == 0)
+    {
+	ASSERT(parse_aac_config(pt + 13, len - 2, &audio.aac),
+	       "Invalid AAC sequence header at offset %li\n", (long)(pt - p->beg));
+	audio.id = 2;
+    }
+    return (!(video.id && audio.id) && ++*(int*)p->arg < PRESCAN_TAGS);
+}
+
+void prescan()
+{
+    struct flv_parse p;
+    int ntags = 0;
+
+    flv_parse_init(&p, head_beg, head_len, &ntags);
+    flv_parse_loop(&p, 13, FLV_PARSE_STRICT, prescan_tag, 0);
+    ASSERT(video.id || audio.id, "No H.264 or AAC sequence header found, aborting.\n");
+    if (video.id)
+	printf("Video: H.264 %ix%i, profile %i level %i\n",
+	       video.avc.width, video.avc.height, video.avc.profile, video.avc.level);
+    if (audio.id)
+	printf("Audio: AAC, %i Hz, %i channels\n",
+	       audio.aac.sample_rate, audio.aac.channels);
+}
+
+int	skipped = 0;
+
+int fmp4_tag(struct flv_parse *p, const uchar *pt, const struct flv_tag *tag)
+{
+    int type = tag->type, len = tag->len, timestamp = tag->timestamp;
+    struct sample s;
+
+    if (type == FLV_TYPE_META || !len)
+	return 1;
+    if (time_base == -1)
+	time_base = timestamp;
+
+    memset(&s, 0, sizeof(s));
+    s.dts = timestamp - time_base;
+    if (type == FLV_TYPE_VIDEO && video.id &&
+	(pt[11] & 0xf) == FLV_CODEC_AVC && len > 5 && pt[12] == 1)
+    {
+	s.data = pt + 16;
+	s.size = len - 5;
+	s.key = ((pt[11] >> 4) == 1);
+	s.cts = flv_read24(pt + 13);
+	if (s.cts & 0x800000)	// signed
+	    s.cts -= 0x1000000;
+
+	if (s.key && frag_start != -1 &&
+	    s.dts - frag_start >= frag_duration)
+	{
+	    push_sample(&video, &s);
+	    video.has_pending = 0;
+	    write_fragment();
+	    video.pending = s;
+	    video.has_pending = 1;
+	}
+	else
+	    push_sample(&video, &s);
+    }
+    else if (type == FLV_TYPE_AUDIO && audio.id &&
+	     (pt[11] >> 4) == FLV_CODEC_AAC && len > 2 && pt[12] == 1)
+    {
+	s.data = pt + 13;
+	s.size = len - 2;
+	s.key = 1;
+	push_sample(&audio, &s);
+	if (!video.id && frag_start != -1 &&
+	    s.dts - frag_start >= AUDIO_FRAG_DURATION)
+	    write_fragment();
+    }
+    else if (!(len > 1 && pt[12] == 0))	// sequence headers
+	skipped++;
+    return 1;
+}
+
+void parse_tags()
+{
+    struct flv_parse p;
+
+    ASSERT(!strncmp((char*)head_beg, "FLV", 3), "file %s: invalid FLV header\n", head_fname);
+
+    prescan();
+    write_moov();
+
+    flv_parse_init(&p, head_beg, head_len, 0);
+    flv_parse_loop(&p, 13, FLV_PARSE_STRICT | FLV_PARSE_VERBOSE, fmp4_tag, 0);
+    if (p.bad)
+	die("invalid tag found, aborting. Fix file first.\n");
+
+    flush_pending(&video);
+    flush_pending(&audio);
+    write_fragment();
+
+    if (skipped)
+	printf("Warning: %i tags skipped (unsupported codec).\n", skipped);
+    printf("%u fragments written.\n", frag_seq);
+}
+
+int main(int ac, char **av)
+{
+    ac--; av++;
+    if (ac >= 2 && !strcmp(*av, "-f"))
+    {
+	frag_duration = atoi(av[1]);
+	ac -= 2;
+	av += 2;
+    }
+    if (ac != 2)
+	usage();
+
+    head_fname = *av;
+    head_fd = my_open(head_fname, O_RDONLY, 0);
+    head_len = get_file_len(head_fd);
+    ac--; av++;
+
+    out_fname = *av;
+    ASSERT(!file_exists(out_fname),
+	   "%s: File exists, aborting\n", out_fname);
+    out_fd = my_open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ac--; av++;
+
+    head_beg = my_mmap(0, head_len, PROT_READ, MAP_PRIVATE, head_fd, 0);
+
+    parse_tags();
+
+    close(out_fd);
+
+    return 0;
+}